@@ -0,0 +1,211 @@
+#include "ack.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// FreeRTOS includes
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+// ESP specific includes
+#include "driver/gpio.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+// Other
+#include "mqtt.h"
+
+#ifdef CONFIG_MILIGHT_ACK
+
+static const char *TAG = "ACK";
+
+#define ACK_PENDING_LENGTH 16
+#define ACK_EVENTS_LENGTH 16
+#define ACK_MSG_SIZE 128
+
+// A single blink may bounce on the pin
+#define ACK_DEBOUNCE_US 2000
+
+enum ack_event_type {
+    ACK_EVENT_EXPECT,  // A step was shown to the remote
+    ACK_EVENT_BLINK,   // The LED lit up
+};
+
+typedef struct {
+    uint8_t type;
+    uint8_t bus;
+    int64_t time_us;
+    milight_step_t step;
+} ack_event_t;
+
+// Both the ISR and the key schedulers only post events: the outstanding
+// steps belong to the ack task alone.
+static QueueHandle_t events;
+static StaticQueue_t events_struct;
+static uint8_t events_storage[ACK_EVENTS_LENGTH * sizeof(ack_event_t)];
+
+static ack_event_t pending[ACK_PENDING_LENGTH];
+static uint32_t pending_head;
+static uint32_t pending_tail;
+
+static ack_stats_t stats;
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void IRAM_ATTR ack_isr(void *arg) {
+    ack_event_t event = {.type = ACK_EVENT_BLINK,
+                         .time_us = esp_timer_get_time()};
+    BaseType_t woken = pdFALSE;
+    xQueueSendFromISR(events, &event, &woken);
+    if (woken == pdTRUE) portYIELD_FROM_ISR();
+}
+
+void ack_expect(int i2c_bus, const milight_step_t *step) {
+    if (events == NULL) return;
+    ack_event_t event = {.type = ACK_EVENT_EXPECT,
+                         .bus = i2c_bus,
+                         .time_us = esp_timer_get_time(),
+                         .step = *step};
+    if (xQueueSend(events, &event, 0) != pdTRUE) {
+        portENTER_CRITICAL(&stats_lock);
+        stats.dropped++;
+        portEXIT_CRITICAL(&stats_lock);
+    }
+}
+
+void ack_get_stats(ack_stats_t *out) {
+    portENTER_CRITICAL(&stats_lock);
+    *out = stats;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+static int ack_bucket(uint32_t us) {
+    uint32_t ms = us / 1000;
+    int bucket = ms == 0 ? 0 : 32 - __builtin_clz(ms);
+    return bucket < ACK_HIST_LENGTH ? bucket : ACK_HIST_LENGTH - 1;
+}
+
+static bool ack_retryable(const ack_event_t *event) {
+    const uint8_t *frame = event->step.frame;
+    if (event->bus == I2C_NUM_0 && frame_is_key(frame) &&
+        (frame[2] & VOLATILE_KEYS)) {
+        return false;
+    }
+    return event->step.attempt < CONFIG_MILIGHT_ACK_RETRIES;
+}
+
+static void ack_publish(const ack_event_t *event, const char *result,
+                        int64_t latency_us) {
+    static char msg[ACK_MSG_SIZE];
+    if (mqtt_event_group == NULL ||
+        !(xEventGroupGetBits(mqtt_event_group) & MQTT_CONNECTED_BIT)) {
+        return;
+    }
+    const uint8_t *frame = event->step.frame;
+    int len = snprintf(msg, sizeof(msg),
+                       "{\"bus\":%u,\"frame\":\"%02x%02x%02x%02x%02x\","
+                       "\"attempt\":%u,\"result\":\"%s\",\"latency_us\":%d}",
+                       event->bus, frame[0], frame[1], frame[2], frame[3],
+                       frame[4], event->step.attempt, result,
+                       (int)latency_us);
+    if (len < (int)sizeof(msg)) mqtt_publish(TOPIC_ACK, msg, len, 0, 0);
+}
+
+static void ack_blink(int64_t time_us) {
+    // Blinks only ack steps shown before them
+    if (pending_tail == pending_head) return;
+    const ack_event_t *oldest = &pending[pending_tail % ACK_PENDING_LENGTH];
+    if (oldest->time_us > time_us) return;
+    pending_tail++;
+
+    uint32_t latency = time_us - oldest->time_us;
+    portENTER_CRITICAL(&stats_lock);
+    stats.acked++;
+    stats.latency_ms[ack_bucket(latency)]++;
+    if (latency > stats.latency_max_us) stats.latency_max_us = latency;
+    portEXIT_CRITICAL(&stats_lock);
+    ack_publish(oldest, "ack", latency);
+}
+
+static void ack_expire(int64_t now) {
+    while (pending_tail != pending_head) {
+        ack_event_t *oldest = &pending[pending_tail % ACK_PENDING_LENGTH];
+        if (now - oldest->time_us < CONFIG_MILIGHT_ACK_TIMEOUT_MS * 1000LL) {
+            return;
+        }
+        pending_tail++;
+
+        bool retry = ack_retryable(oldest);
+        portENTER_CRITICAL(&stats_lock);
+        if (retry) {
+            stats.retried++;
+        } else {
+            stats.timeouts++;
+        }
+        portEXIT_CRITICAL(&stats_lock);
+        ack_publish(oldest, retry ? "retry" : "timeout", -1);
+
+        if (retry) {
+            milight_step_t step = oldest->step;
+            step.attempt++;
+            memset(&step.trace, 0, sizeof(step.trace));
+            send_step(oldest->bus, &step);
+        }
+    }
+}
+
+// Ticks until the oldest outstanding step expires
+static TickType_t ack_wait(void) {
+    if (pending_tail == pending_head) return portMAX_DELAY;
+    int64_t deadline = pending[pending_tail % ACK_PENDING_LENGTH].time_us +
+                       CONFIG_MILIGHT_ACK_TIMEOUT_MS * 1000LL;
+    int64_t left = deadline - esp_timer_get_time();
+    return left > 0 ? pdMS_TO_TICKS(left / 1000) + 1 : 0;
+}
+
+#define ACK_STACK_SIZE 2560
+StaticTask_t ack_buffer;
+StackType_t ack_stack[ACK_STACK_SIZE];
+static void ack_task(void *pvParameter) {
+    int64_t last_blink_us = 0;
+    while (1) {
+        ack_event_t event;
+        if (xQueueReceive(events, &event, ack_wait()) == pdTRUE) {
+            if (event.type == ACK_EVENT_EXPECT) {
+                if (pending_head - pending_tail < ACK_PENDING_LENGTH) {
+                    pending[pending_head++ % ACK_PENDING_LENGTH] = event;
+                } else {
+                    portENTER_CRITICAL(&stats_lock);
+                    stats.dropped++;
+                    portEXIT_CRITICAL(&stats_lock);
+                }
+            } else if (event.time_us - last_blink_us >= ACK_DEBOUNCE_US) {
+                last_blink_us = event.time_us;
+                ack_blink(event.time_us);
+            }
+        }
+        ack_expire(esp_timer_get_time());
+    }
+}
+
+void ack_init(void) {
+    events = xQueueCreateStatic(ACK_EVENTS_LENGTH, sizeof(ack_event_t),
+                                events_storage, &events_struct);
+    xTaskCreateStatic(&ack_task, "ack", ACK_STACK_SIZE, NULL,
+                      tskIDLE_PRIORITY + 2, ack_stack, &ack_buffer);
+
+#ifdef CONFIG_MILIGHT_ACK_ACTIVE_LOW
+    gpio_set_intr_type(PIN_NUM_LED, GPIO_INTR_NEGEDGE);
+#else
+    gpio_set_intr_type(PIN_NUM_LED, GPIO_INTR_POSEDGE);
+#endif
+    esp_err_t err = gpio_install_isr_service(0);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+        ESP_LOGE(TAG, "Cannot install the GPIO ISR service: %d", err);
+        return;
+    }
+    ESP_ERROR_CHECK(gpio_isr_handler_add(PIN_NUM_LED, ack_isr, NULL));
+}
+
+#endif  // CONFIG_MILIGHT_ACK
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "milight.h"
+
+#define TOPIC_ACK CONFIG_MQTT_PREFIX "/ack"
+
+// Command acknowledgement
+// =======================
+//
+// The remote blinks its LED when it sends a command over RF. Each command
+// step (a click, or the final frame of a slider move) is expected to be
+// followed by a blink within CONFIG_MILIGHT_ACK_TIMEOUT_MS: the first
+// blink acks the oldest outstanding step. Steps without one are played
+// again, up to CONFIG_MILIGHT_ACK_RETRIES times, except for the mode and
+// speed keys which do not give the same result twice. Every outcome is
+// published on TOPIC_ACK.
+//
+// latency_ms is a histogram of the step-to-blink delay: bucket 0 counts
+// acks under 1ms, bucket i those in [1 << (i - 1), 1 << i) ms, and the last
+// one everything above.
+#define ACK_HIST_LENGTH 12
+
+typedef struct {
+    uint32_t acked;
+    uint32_t retried;
+    uint32_t timeouts;  // Steps given up on
+    uint32_t dropped;   // Steps not tracked, too many outstanding
+    uint32_t latency_ms[ACK_HIST_LENGTH];
+    uint32_t latency_max_us;
+} ack_stats_t;
+
+#ifdef CONFIG_MILIGHT_ACK
+// Enables the LED interrupt, PIN_NUM_LED must be configured as an input.
+void ack_init(void);
+// Called by the key schedulers once the frame of step is shown on i2c_bus.
+void ack_expect(int i2c_bus, const milight_step_t *step);
+void ack_get_stats(ack_stats_t *stats);
+#else
+static inline void ack_init(void) {}
+static inline void ack_expect(int i2c_bus, const milight_step_t *step) {}
+#endif
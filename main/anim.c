@@ -0,0 +1,248 @@
+#include "anim.h"
+
+#include <string.h>
+
+// FreeRTOS includes
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+// ESP specific includes
+#include "esp_log.h"
+#include "esp_timer.h"
+
+// Other
+#include "i2c_slave.h"
+#include "milight.h"
+#include "queues.h"
+#include "shadow.h"
+
+static const char *TAG = "ANIM";
+
+// Progress of a transition, in 16.16 fixed point
+#define PROGRESS_ONE (1 << 16)
+
+// The temperature slider goes from 0xA0 (left) up to 0xFF, wraps to 0x00
+// (middle) and ends at 0x99 (right): shifted by 0xA0, it is a plain 0x00 -
+// 0xF9 range.
+#define TEMPERATURE_LEFT 0xA0
+
+typedef struct {
+    bool active;
+    bool sweep;
+    uint8_t from;    // Position where the transition started
+    int16_t delta;   // Distance to cover, signed
+    uint8_t last;    // Last position sent to the remote, kept when idle
+    int64_t start_us;
+    uint32_t duration_us;
+    latency_trace_t trace;
+} anim_channel_t;
+
+static anim_channel_t channels[SLIDER_LENGTH];
+
+// Next channel to play on each bus, so that channels sharing a bus take turns
+static int next_channel[I2C_NUM_MAX];
+
+static uint8_t to_position(enum milight_slider slider, uint8_t value) {
+    return slider == SLIDER_TEMPERATURE ? value - TEMPERATURE_LEFT : value;
+}
+
+static uint8_t to_value(enum milight_slider slider, uint8_t position) {
+    return slider == SLIDER_TEMPERATURE ? position + TEMPERATURE_LEFT
+                                        : position;
+}
+
+// Position a transition of slider starts from. An idle channel may have
+// been moved since by frames it did not send (scenes, raw frames), so it
+// starts from what the shadow last saw once every queued step is shown.
+static uint8_t anim_origin(enum milight_slider slider) {
+    anim_channel_t *channel = &channels[slider];
+    if (!channel->active && milight_settled()) {
+        int16_t value = shadow_slider_value(slider);
+        if (value >= 0) channel->last = to_position(slider, value);
+    }
+    return channel->last;
+}
+
+static bool anim_active(void) {
+    for (int i = 0; i < SLIDER_LENGTH; i++) {
+        if (channels[i].active) return true;
+    }
+    return false;
+}
+
+static void anim_release(enum milight_slider slider) {
+    anim_channel_t *channel = &channels[slider];
+    if (!channel->active) return;
+    channel->active = false;
+    send_slider(slider, to_value(slider, channel->last),
+                CONFIG_MILIGHT_ANIM_FRAME_MS, true, &channel->trace);
+}
+
+static void anim_start(enum milight_slider slider, uint8_t value,
+                       uint32_t duration_ms, const latency_trace_t *trace) {
+    anim_channel_t *channel = &channels[slider];
+    uint8_t target = to_position(slider, value);
+    uint8_t from = anim_origin(slider);
+
+    if (duration_ms == 0 || from == target) {
+        channel->active = false;
+        channel->last = target;
+        if (milight_settled() && shadow_slider_redundant(slider, value)) {
+            return;
+        }
+        send_slider(slider, value, CONFIG_MILIGHT_ANIM_FRAME_MS, true, trace);
+        return;
+    }
+
+    channel->active = true;
+    channel->sweep = false;
+    channel->from = from;
+    // The colour wheel is a circle, take the shortest way around it
+    channel->delta = slider == SLIDER_WHEEL ? (int8_t)(target - from)
+                                            : (int)target - (int)from;
+    channel->last = from;
+    channel->start_us = esp_timer_get_time();
+    channel->duration_us = duration_ms * 1000;
+    channel->trace = *trace;
+}
+
+static void anim_sweep(uint16_t period_ms) {
+    anim_channel_t *channel = &channels[SLIDER_WHEEL];
+    if (period_ms == 0) {
+        anim_release(SLIDER_WHEEL);
+        return;
+    }
+    channel->from = anim_origin(SLIDER_WHEEL);
+    channel->active = true;
+    channel->sweep = true;
+    channel->delta = 0x100;
+    channel->start_us = esp_timer_get_time();
+    channel->duration_us = period_ms * 1000;
+    memset(&channel->trace, 0, sizeof(channel->trace));
+}
+
+// Sends the next frame of a channel. Returns false if it had nothing new to
+// show.
+static bool anim_channel_step(enum milight_slider slider, int64_t now) {
+    anim_channel_t *channel = &channels[slider];
+    if (!channel->active) return false;
+
+    uint64_t elapsed = now - channel->start_us;
+    if (channel->sweep && elapsed >= channel->duration_us) {
+        elapsed %= channel->duration_us;
+        channel->start_us = now - elapsed;
+    }
+    int32_t progress = PROGRESS_ONE;
+    if (elapsed < channel->duration_us) {
+        progress = (elapsed << 16) / channel->duration_us;
+    }
+
+    uint8_t position =
+        channel->from +
+        ((channel->delta * progress + (PROGRESS_ONE >> 1)) >> 16);
+    if (progress == PROGRESS_ONE && !channel->sweep) {
+        channel->last = position;
+        anim_release(slider);
+        return true;
+    }
+    if (position == channel->last) return false;
+
+    channel->last = position;
+    send_slider(slider, to_value(slider, position),
+                CONFIG_MILIGHT_ANIM_FRAME_MS, false, &channel->trace);
+    // Only the first frame of a transition closes the latency trace
+    memset(&channel->trace, 0, sizeof(channel->trace));
+    return true;
+}
+
+static void anim_step(void) {
+    int64_t now = esp_timer_get_time();
+    for (int bus = 0; bus < I2C_NUM_MAX; bus++) {
+        // Never queue more than one frame ahead of what the remote has read
+        if (milight_queue_depth(bus) != 0) continue;
+        for (int i = 0; i < SLIDER_LENGTH; i++) {
+            int slider = (next_channel[bus] + i) % SLIDER_LENGTH;
+            if (frame_slider_bus(slider) != bus) continue;
+            if (anim_channel_step(slider, now)) {
+                next_channel[bus] = (slider + 1) % SLIDER_LENGTH;
+                break;
+            }
+        }
+    }
+}
+
+static void anim_handle(QueueSetMemberHandle_t queue) {
+    if (queue == dispatcher_queues[QUEUE_ANIM]) {
+        struct anim_command cmd;
+        if (xQueueReceive(queue, &cmd, 0) != pdTRUE) return;
+        latency_trace_t trace = {0};
+        switch (cmd.type) {
+            case ANIM_STOP:
+                for (int i = 0; i < SLIDER_LENGTH; i++) anim_release(i);
+                break;
+            case ANIM_SWEEP:
+                anim_sweep(cmd.period_ms);
+                break;
+            case ANIM_CROSSFADE:
+                anim_start(SLIDER_WHEEL, cmd.wheel, cmd.period_ms, &trace);
+                anim_start(SLIDER_LUMINOSITY, cmd.luminosity, cmd.period_ms,
+                           &trace);
+                break;
+            default:
+                ESP_LOGE(TAG, "Unknown animation %d", cmd.type);
+                break;
+        }
+    } else {
+        struct slider_command cmd;
+        if (xQueueReceive(queue, &cmd, 0) != pdTRUE) return;
+        latency_mark(&cmd.trace, LATENCY_DISPATCHED);
+        if (cmd.slider >= SLIDER_LENGTH) return;
+        anim_start(cmd.slider, cmd.value, cmd.duration_ms, &cmd.trace);
+    }
+}
+
+#define ANIM_STACK_SIZE 2048
+StaticTask_t anim_buffer;
+StackType_t anim_stack[ANIM_STACK_SIZE];
+static void anim_task(void *pvParameter) {
+    QueueSetHandle_t commands = (QueueSetHandle_t)pvParameter;
+    while (1) {
+        // Commands first, then wait for the remote to poll us before
+        // computing the next frame. Without a poll (remote off), fall back
+        // to one frame per CONFIG_MILIGHT_ANIM_FRAME_MS.
+        QueueSetMemberHandle_t queue = xQueueSelectFromSet(
+            commands, anim_active() ? 0 : portMAX_DELAY);
+        if (queue != NULL) {
+            anim_handle(queue);
+            continue;
+        }
+        ulTaskNotifyTake(pdTRUE,
+                         pdMS_TO_TICKS(CONFIG_MILIGHT_ANIM_FRAME_MS) + 1);
+        anim_step();
+    }
+}
+
+// Only an empty queue can be added to a set: the stages posting commands
+// must start after this one.
+static void anim_add_to_set(QueueHandle_t queue, QueueSetHandle_t set) {
+    ESP_ERROR_CHECK(xQueueAddToSet(queue, set) == pdPASS
+                        ? ESP_OK
+                        : ESP_ERR_INVALID_STATE);
+}
+
+void anim_init(void) {
+    QueueSetHandle_t commands = xQueueCreateSet(
+        QUEUE_LENGTH_ANIM + SLIDER_LENGTH * QUEUE_LENGTH_SLIDER);
+    anim_add_to_set(dispatcher_queues[QUEUE_ANIM], commands);
+    // Overwriting a mailbox that is already full does not add to the set
+    for (int slider = 0; slider < SLIDER_LENGTH; slider++) {
+        anim_add_to_set(dispatcher_queues[QUEUE_SLIDER(slider)], commands);
+    }
+
+    TaskHandle_t task = xTaskCreateStatic(
+        &anim_task, "anim", ANIM_STACK_SIZE, commands, tskIDLE_PRIORITY + 2,
+        anim_stack, &anim_buffer);
+    i2c_slave_set_poll_notify(I2C_NUM_0, task);
+    i2c_slave_set_poll_notify(I2C_NUM_1, task);
+}
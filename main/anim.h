@@ -0,0 +1,5 @@
+#pragma once
+
+// Consumes QUEUE_ANIM and the slider mailboxes and plays the slider
+// transitions at the rate the remote MCU polls us.
+void anim_init(void);
@@ -0,0 +1,119 @@
+#include "boot.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+// FreeRTOS includes
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
+
+// ESP specific includes
+#include "esp_log.h"
+#include "esp_timer.h"
+
+// Other
+#include "mqtt.h"
+#include "msg.h"
+
+static const char *TAG = "BOOT";
+
+#define TOPIC_BOOT CONFIG_MQTT_PREFIX "/boot"
+
+static const boot_stage_t *boot_stages;
+static int boot_length;
+static uint32_t boot_all;
+
+// Stages taken by a worker, and stages done (as event bits)
+static volatile uint32_t boot_claimed;
+static EventGroupHandle_t boot_done;
+static StaticEventGroup_t boot_done_buffer;
+
+// Timings in microseconds since power on
+static int64_t boot_start_us;
+static int64_t stage_start_us[BOOT_STAGES_MAX];
+static int64_t stage_end_us[BOOT_STAGES_MAX];
+
+// Takes a stage whose dependencies are done, returns -1 if there is none
+static int boot_claim(uint32_t done) {
+    for (int i = 0; i < boot_length; i++) {
+        uint32_t bit = BOOT_DEP(i);
+        uint32_t claimed = boot_claimed;
+        if ((claimed & bit) || (boot_stages[i].deps & ~done)) continue;
+        if (__sync_bool_compare_and_swap(&boot_claimed, claimed,
+                                         claimed | bit)) {
+            return i;
+        }
+        // Another worker took a stage meanwhile, look again
+        i = -1;
+    }
+    return -1;
+}
+
+static void boot_worker(void) {
+    while (boot_claimed != boot_all) {
+        uint32_t done = xEventGroupGetBits(boot_done);
+        int stage = boot_claim(done);
+        if (stage < 0) {
+            // Wait for any other stage to be done
+            xEventGroupWaitBits(boot_done, boot_all & ~done, false, false,
+                                portMAX_DELAY);
+            continue;
+        }
+
+        stage_start_us[stage] = esp_timer_get_time();
+        boot_stages[stage].init();
+        stage_end_us[stage] = esp_timer_get_time();
+        ESP_LOGI(TAG, "%s done in %u us", boot_stages[stage].name,
+                 (uint32_t)(stage_end_us[stage] - stage_start_us[stage]));
+        xEventGroupSetBits(boot_done, BOOT_DEP(stage));
+    }
+}
+
+#define BOOT_STACK_SIZE 4096
+StaticTask_t boot_buffer;
+StackType_t boot_stack[BOOT_STACK_SIZE];
+static void boot_task(void *pvParameter) {
+    boot_worker();
+    vTaskDelete(NULL);
+}
+
+void boot_run(const boot_stage_t *stages, int length) {
+    assert(length <= BOOT_STAGES_MAX);
+    boot_start_us = esp_timer_get_time();
+    boot_stages = stages;
+    boot_length = length;
+    boot_all = BOOT_DEP(length) - 1;
+    boot_done = xEventGroupCreateStatic(&boot_done_buffer);
+
+    xTaskCreateStatic(&boot_task, "boot", BOOT_STACK_SIZE, NULL,
+                      uxTaskPriorityGet(NULL), boot_stack, &boot_buffer);
+    boot_worker();
+}
+
+void boot_report(void) {
+    static bool reported;
+    if (reported) return;
+    reported = true;
+
+    static char msg[512];
+    // Room is kept for the closing "}", stages that do not fit are left out
+    const int size = sizeof(msg) - 1;
+    int len = 0;
+    int64_t now = esp_timer_get_time();
+    msg_append(msg, len, size, "{\"app_main\":%u,\"connected\":%u",
+               (uint32_t)boot_start_us, (uint32_t)now);
+    for (int i = 0; i < boot_length; i++) {
+        int entry = len;
+        msg_append(msg, len, size, ",\"%s\":[%u,%u]", boot_stages[i].name,
+                   (uint32_t)stage_start_us[i], (uint32_t)stage_end_us[i]);
+        if (len >= size) {
+            len = entry;
+            break;
+        }
+    }
+    if (len < size) {
+        msg[len++] = '}';
+        mqtt_publish(TOPIC_BOOT, msg, len, 1, 1);
+    }
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+// Boot stages
+// ===========
+//
+// Initialisation is split into stages, each one listing the stages it
+// depends on as a mask of BOOT_DEP(). boot_run() runs them on the calling
+// task and on a helper task, every stage starting as soon as its
+// dependencies are done, and returns once they have all been started.
+typedef struct {
+    const char *name;
+    void (*init)(void);
+    uint32_t deps;
+} boot_stage_t;
+
+#define BOOT_DEP(stage) (1U << (stage))
+#define BOOT_STAGES_MAX 16
+
+void boot_run(const boot_stage_t *stages, int length);
+
+// Publishes when each stage started and ended on TOPIC_BOOT, once. Called
+// when the MQTT client connects.
+void boot_report(void);
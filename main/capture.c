@@ -0,0 +1,62 @@
+#include "capture.h"
+
+#ifdef CONFIG_MILIGHT_I2C_CAPTURE
+
+#include <string.h>
+
+// ESP specific includes
+#include "esp_log.h"
+
+// Other
+#include "i2c_slave.h"
+#include "mqtt.h"
+
+static const char *TAG = "CAPTURE";
+
+// The capture of each port is published in pages of CAPTURE_PAGE_LENGTH
+// records. Each page starts with CAPTURE_MAGIC, the port, the page number,
+// the number of pages and the size of a record, followed by the records as
+// laid out in i2c_capture_record_t (little endian). tools/i2c_capture.py
+// reassembles, decodes and replays them.
+#define TOPIC_CAPTURE CONFIG_MQTT_PREFIX "/capture/data"
+#define CAPTURE_MAGIC "MIC1"
+#define CAPTURE_HEADER_SIZE 8
+#define CAPTURE_PAGE_LENGTH 64
+
+_Static_assert(CONFIG_MILIGHT_I2C_CAPTURE_LENGTH <=
+                   UINT8_MAX * CAPTURE_PAGE_LENGTH,
+               "page numbers and counts are one byte in the header");
+
+static i2c_capture_record_t records[CONFIG_MILIGHT_I2C_CAPTURE_LENGTH];
+static uint8_t page[CAPTURE_HEADER_SIZE +
+                    CAPTURE_PAGE_LENGTH * sizeof(i2c_capture_record_t)];
+
+void capture_dump(void) {
+    for (int port = 0; port < I2C_NUM_MAX; port++) {
+        int count = i2c_slave_capture_read(
+            port, records, CONFIG_MILIGHT_I2C_CAPTURE_LENGTH);
+        int pages = (count + CAPTURE_PAGE_LENGTH - 1) / CAPTURE_PAGE_LENGTH;
+        ESP_LOGI(TAG, "Port %d: %d records", port, count);
+
+        // An empty capture still gets a header, for the tool to know
+        for (int i = 0; i == 0 || i < pages; i++) {
+            int first = i * CAPTURE_PAGE_LENGTH;
+            int length = count - first < CAPTURE_PAGE_LENGTH
+                                ? count - first
+                                : CAPTURE_PAGE_LENGTH;
+            memcpy(page, CAPTURE_MAGIC, 4);
+            page[4] = port;
+            page[5] = i;
+            page[6] = pages;
+            page[7] = sizeof(i2c_capture_record_t);
+            memcpy(page + CAPTURE_HEADER_SIZE, &records[first],
+                   length * sizeof(i2c_capture_record_t));
+            mqtt_publish(TOPIC_CAPTURE, (const char *)page,
+                         CAPTURE_HEADER_SIZE +
+                             length * sizeof(i2c_capture_record_t),
+                         1, 0);
+        }
+    }
+}
+
+#endif  // CONFIG_MILIGHT_I2C_CAPTURE
@@ -0,0 +1,7 @@
+#pragma once
+
+#ifdef CONFIG_MILIGHT_I2C_CAPTURE
+// Publishes the I2C capture of both ports on TOPIC_CAPTURE, see capture.c for
+// the format. Runs on the MQTT task.
+void capture_dump(void);
+#endif
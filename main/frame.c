@@ -0,0 +1,235 @@
+#include "frame.h"
+
+#include <string.h>
+
+// General command buffer is 5 bytes long, MSB is defined as the class.
+//
+// KEYS
+// ====
+//
+// To press a key, the command is
+// {0x02, 0x00, DATA, 0x00, 0x00}
+// The third byte is defined as a set of flags:
+// I2C 1                |  I2C 2
+// ------------------------------------------
+// MSB                  |  MSB
+// 7   - SPEED PLUS     |  7   - ZONE 04 OFF
+// 6   - MODE           |  6   - ZONE 04 ON
+// 5   - SPEED MINUS    |  5   - ZONE 01 OFF
+// 4   - GENERAL OFF    |  4   - ZONE 01 ON
+// 3   - GENERAL ON     |  3   - ZONE 03 OFF
+// 2   - Unused         |  2   - ZONE 03 ON
+// 1   - Unused         |  1   - ZONE 02 OFF
+// 0   - Unused         |  0   - ZONE 02 ON
+// LSB                  |  LSB
+// Set the byte to 0x00 to release the key
+//
+// SLIDERS
+// =======
+//
+// Colour wheel
+// ------------
+// On I2C 1
+// Command {0x03, DATA, 0x00, 0x00, 0x99}
+// DATA is ranged on 0x00 - 0xFF
+// 0x00 is blue
+// 0x22
+// 0x3C is red
+// 0x5E
+// 0x73 is yellow
+// 0x9F
+// 0xC3 is green
+// 0xE1
+//
+// Temperature
+// -----------
+// On I2C 1
+// Class 2 also?
+// Command {0x06, 0x00, 0x00, 0x00, DATA}
+// DATA is ranged on (left) 0xA0 --- 0x00 (middle) --- 0x99 (right)
+//
+// Saturation + Luminosity
+// ----------
+// On I2C 2
+// The two sliders are two half sliders
+// Command {0x03, DATA, 0x00, 0x00, 0x00}
+// Saturation is ranged on 0x00 --- 0x7F
+// Luminosity is ranged on 0x80 --- 0xFF
+//
+// Frame layouts
+// =============
+//
+// Every slider frame is {class, 0x00, 0x00, 0x00, tail} with the value
+// masked and or-ed with set at index.
+//
+// The two ends of the temperature slider meet between 0x99 and 0xA0, the
+// remote never sends the bytes in between.
+#define TEMPERATURE_GAP_FIRST 0x9A
+#define TEMPERATURE_GAP_LAST 0x9F
+#define FRAME_CLASS_KEY 0x02
+#define FRAME_KEY_INDEX 2
+
+typedef struct {
+    uint8_t bus;
+    uint8_t class;
+    uint8_t index;
+    uint8_t mask;
+    uint8_t set;
+    uint8_t tail;
+} slider_layout_t;
+
+static const slider_layout_t slider_layouts[SLIDER_LENGTH] = {
+    [SLIDER_WHEEL] = {I2C_NUM_0, 0x03, 1, 0xFF, 0x00, 0x99},
+    [SLIDER_TEMPERATURE] = {I2C_NUM_0, 0x06, 4, 0xFF, 0x00, 0x00},
+    [SLIDER_SATURATION] = {I2C_NUM_1, 0x03, 1, 0x7F, 0x00, 0x00},
+    [SLIDER_LUMINOSITY] = {I2C_NUM_1, 0x03, 1, 0x7F, 0x80, 0x00},
+};
+
+// Key codes of each bus
+static const uint8_t bus_keys[I2C_NUM_MAX] = {
+    GENERAL_ON | GENERAL_OFF | SPEED_MINUS | MODE | SPEED_PLUS,
+    ZONE_01_OFF | ZONE_01_ON | ZONE_02_OFF | ZONE_02_ON | ZONE_03_OFF |
+        ZONE_03_ON | ZONE_04_OFF | ZONE_04_ON,
+};
+
+const uint8_t frame_release[I2C_SLAVE_FRAME_SIZE] = {FRAME_CLASS_KEY, 0x00,
+                                                     0x00, 0x00, 0x00};
+
+const char *const frame_slider_names[SLIDER_LENGTH] = {
+    [SLIDER_WHEEL] = "wheel",
+    [SLIDER_TEMPERATURE] = "temperature",
+    [SLIDER_SATURATION] = "saturation",
+    [SLIDER_LUMINOSITY] = "luminosity",
+};
+
+// Keys turning each zone on and off, zone 0 being all of them
+static const struct {
+    uint8_t bus;
+    uint8_t on;
+    uint8_t off;
+} zone_keys[FRAME_ZONES + 1] = {
+    {I2C_NUM_0, GENERAL_ON, GENERAL_OFF},
+    {I2C_NUM_1, ZONE_01_ON, ZONE_01_OFF},
+    {I2C_NUM_1, ZONE_02_ON, ZONE_02_OFF},
+    {I2C_NUM_1, ZONE_03_ON, ZONE_03_OFF},
+    {I2C_NUM_1, ZONE_04_ON, ZONE_04_OFF},
+};
+
+int frame_zone_key(uint8_t zone, bool on, uint8_t *keycode) {
+    if (zone > FRAME_ZONES) return -1;
+    *keycode = on ? zone_keys[zone].on : zone_keys[zone].off;
+    return zone_keys[zone].bus;
+}
+
+esp_err_t frame_encode_key(int i2c_bus, uint8_t keys, uint8_t *frame) {
+    if (keys & ~bus_keys[i2c_bus]) return ESP_ERR_INVALID_ARG;
+    memcpy(frame, frame_release, I2C_SLAVE_FRAME_SIZE);
+    frame[FRAME_KEY_INDEX] = keys;
+    return ESP_OK;
+}
+
+int frame_encode_slider(enum milight_slider slider, uint8_t value,
+                        uint8_t *frame) {
+    if (!frame_slider_valid(slider, value)) return -1;
+    const slider_layout_t *layout = &slider_layouts[slider];
+    frame[0] = layout->class;
+    frame[1] = 0x00;
+    frame[2] = 0x00;
+    frame[3] = 0x00;
+    frame[4] = layout->tail;
+    frame[layout->index] = (value & layout->mask) | layout->set;
+    return layout->bus;
+}
+
+int frame_slider_bus(enum milight_slider slider) {
+    return slider_layouts[slider].bus;
+}
+
+bool frame_slider_valid(enum milight_slider slider, int value) {
+    if (slider >= SLIDER_LENGTH || value < 0 ||
+        value > FRAME_SLIDER_MAX(slider)) {
+        return false;
+    }
+    return slider != SLIDER_TEMPERATURE || value < TEMPERATURE_GAP_FIRST ||
+           value > TEMPERATURE_GAP_LAST;
+}
+
+bool frame_is_key(const uint8_t *frame) {
+    return frame[0] == FRAME_CLASS_KEY;
+}
+
+bool frame_decode(int i2c_bus, const uint8_t *frame, frame_command_t *cmd) {
+    uint8_t expected[I2C_SLAVE_FRAME_SIZE];
+    memset(cmd, 0, sizeof(*cmd));
+
+    if (frame_is_key(frame)) {
+        uint8_t keys = frame[FRAME_KEY_INDEX];
+        if (frame_encode_key(i2c_bus, keys, expected) != ESP_OK) return false;
+        cmd->kind = keys == 0 ? FRAME_RELEASE : FRAME_KEY;
+        cmd->keys = keys;
+        return memcmp(frame, expected, I2C_SLAVE_FRAME_SIZE) == 0;
+    }
+
+    // A slider frame is valid if encoding its value gives it back
+    for (int slider = 0; slider < SLIDER_LENGTH; slider++) {
+        const slider_layout_t *layout = &slider_layouts[slider];
+        if (layout->bus != i2c_bus || layout->class != frame[0]) continue;
+        uint8_t value = frame[layout->index] & layout->mask;
+        if (frame_encode_slider(slider, value, expected) < 0) continue;
+        if (memcmp(frame, expected, I2C_SLAVE_FRAME_SIZE) == 0) {
+            cmd->kind = FRAME_SLIDER;
+            cmd->slider = slider;
+            cmd->value = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Hue to colour wheel
+// ===================
+//
+// Piecewise linear between the colours located on the wheel above: red
+// (0 degrees) at 0x3C, yellow (60) at 0x73, green (120) at 0xC3 and blue
+// (240) at 0x00, the table being expanded by the preprocessor.
+#define HUE_WHEEL(h)                                           \
+    ((uint8_t)((h) < 60    ? 0x3C + (h)*55 / 60                \
+               : (h) < 120 ? 0x73 + ((h)-60) * 80 / 60         \
+               : (h) < 240 ? 0xC3 + ((h)-120) * 61 / 120       \
+                           : 0x100 + ((h)-240) * 60 / 120))
+#define HUE_WHEEL_10(h)                                                    \
+    HUE_WHEEL(h), HUE_WHEEL((h) + 1), HUE_WHEEL((h) + 2),                  \
+        HUE_WHEEL((h) + 3), HUE_WHEEL((h) + 4), HUE_WHEEL((h) + 5),        \
+        HUE_WHEEL((h) + 6), HUE_WHEEL((h) + 7), HUE_WHEEL((h) + 8),        \
+        HUE_WHEEL((h) + 9)
+#define HUE_WHEEL_60(h)                                                    \
+    HUE_WHEEL_10(h), HUE_WHEEL_10((h) + 10), HUE_WHEEL_10((h) + 20),       \
+        HUE_WHEEL_10((h) + 30), HUE_WHEEL_10((h) + 40),                    \
+        HUE_WHEEL_10((h) + 50)
+
+static const uint8_t hue_wheel[360] = {
+    HUE_WHEEL_60(0),   HUE_WHEEL_60(60),  HUE_WHEEL_60(120),
+    HUE_WHEEL_60(180), HUE_WHEEL_60(240), HUE_WHEEL_60(300),
+};
+
+uint8_t frame_wheel_from_hue(uint16_t degrees) {
+    return hue_wheel[degrees % 360];
+}
+
+int frame_wheel_from_rgb(uint8_t r, uint8_t g, uint8_t b) {
+    int max = r > g ? (r > b ? r : b) : (g > b ? g : b);
+    int min = r < g ? (r < b ? r : b) : (g < b ? g : b);
+    int delta = max - min;
+    if (delta == 0) return -1;
+
+    int hue;
+    if (max == r) {
+        hue = 60 * (g - b) / delta;
+    } else if (max == g) {
+        hue = 120 + 60 * (b - r) / delta;
+    } else {
+        hue = 240 + 60 * (r - g) / delta;
+    }
+    if (hue < 0) hue += 360;
+    return hue_wheel[hue % 360];
+}
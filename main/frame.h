@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "driver/i2c.h"
+#include "esp_err.h"
+
+// Frame codec
+// ===========
+//
+// Builds and parses the frames served to the remote MCU, see frame.c for
+// the protocol. Encoders only produce valid frames: slider values and key
+// codes are checked against the positions of the slider and the keys of
+// the bus.
+// It only depends on the I2C port numbers, and is built on the host by the
+// tests in test/.
+
+// Size of the frames served by the I2C slave, see i2c_slave.h
+#define I2C_SLAVE_FRAME_SIZE 5
+
+// Key codes, flags of the third byte of a key frame
+#define RELEASE_KEY 0x00
+// Keycode defines for I2C 1
+#define GENERAL_ON (0x01 << 3)
+#define GENERAL_OFF (0x01 << 4)
+#define SPEED_MINUS (0x01 << 5)
+#define MODE (0x01 << 6)
+#define SPEED_PLUS (0x01 << 7)
+// Modes and their speed change the colour in ways that cannot be followed,
+// and playing them twice does not give the same result
+#define VOLATILE_KEYS (MODE | SPEED_MINUS | SPEED_PLUS)
+
+// Keycode defines for I2C 2
+#define ZONE_01_OFF (0x01 << 5)
+#define ZONE_01_ON (0x01 << 4)
+#define ZONE_02_OFF (0x01 << 1)
+#define ZONE_02_ON (0x01 << 0)
+#define ZONE_03_OFF (0x01 << 3)
+#define ZONE_03_ON (0x01 << 2)
+#define ZONE_04_OFF (0x01 << 7)
+#define ZONE_04_ON (0x01 << 6)
+
+// Sliders of the remote
+enum milight_slider {
+    SLIDER_WHEEL,        // Bus 1, 0x00 - 0xFF
+    SLIDER_TEMPERATURE,  // Bus 1, 0xA0 (left) - 0x00 - 0x99 (right)
+    SLIDER_SATURATION,   // Bus 2, 0x00 - 0x7F
+    SLIDER_LUMINOSITY,   // Bus 2, 0x00 - 0x7F
+};
+#define SLIDER_LENGTH (SLIDER_LUMINOSITY + 1)
+
+// Highest position of a slider. The temperature slider has a gap,
+// frame_slider_valid() tells the positions a slider can send.
+#define FRAME_SLIDER_MAX(slider) ((slider) < SLIDER_SATURATION ? 0xFF : 0x7F)
+
+// Zones of the remote, 1 - FRAME_ZONES, zone 0 being all of them
+#define FRAME_ZONES 4
+
+enum frame_kind {
+    FRAME_RELEASE,  // No key pressed, no slider touched
+    FRAME_KEY,
+    FRAME_SLIDER,
+};
+
+typedef struct {
+    uint8_t kind;    // enum frame_kind
+    uint8_t keys;    // FRAME_KEY: key codes pressed together
+    uint8_t slider;  // FRAME_SLIDER: enum milight_slider
+    uint8_t value;   // FRAME_SLIDER: position
+} frame_command_t;
+
+// Frame with every key released
+extern const uint8_t frame_release[I2C_SLAVE_FRAME_SIZE];
+
+// Slider names, by enum milight_slider
+extern const char *const frame_slider_names[SLIDER_LENGTH];
+
+// Key switching zone on, or off. Returns its bus, -1 for a zone over
+// FRAME_ZONES.
+int frame_zone_key(uint8_t zone, bool on, uint8_t *keycode);
+
+// Fails with ESP_ERR_INVALID_ARG if keys holds a key code that is not on
+// i2c_bus.
+esp_err_t frame_encode_key(int i2c_bus, uint8_t keys, uint8_t *frame);
+
+// Returns the bus of the slider, -1 for a value the slider cannot send
+int frame_encode_slider(enum milight_slider slider, uint8_t value,
+                        uint8_t *frame);
+int frame_slider_bus(enum milight_slider slider);
+bool frame_slider_valid(enum milight_slider slider, int value);
+
+// Returns false if frame is not a valid frame for i2c_bus
+bool frame_decode(int i2c_bus, const uint8_t *frame, frame_command_t *cmd);
+
+bool frame_is_key(const uint8_t *frame);
+
+// Colour wheel position of a hue in degrees, or of an RGB colour. Greys
+// have no hue, frame_wheel_from_rgb() returns -1 for them.
+uint8_t frame_wheel_from_hue(uint16_t degrees);
+int frame_wheel_from_rgb(uint8_t r, uint8_t g, uint8_t b);
@@ -14,6 +14,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "driver/i2c.h"
@@ -21,19 +22,17 @@
 #include "esp_attr.h"
 #include "esp_intr_alloc.h"
 #include "esp_log.h"
-#include "esp_pm.h"
 #include "esp_rom_gpio.h"
+#include "esp_timer.h"
 #include "esp_types.h"
 #include "freertos/FreeRTOS.h"
-#include "freertos/ringbuf.h"
-#include "freertos/semphr.h"
 #include "freertos/task.h"
-#include "freertos/xtensa_api.h"
+#include "hal/gpio_ll.h"
 #include "hal/i2c_hal.h"
-#include "malloc.h"
-#include "soc/dport_reg.h"
+#include "i2c_slave.h"
+#include "latency.h"
 #include "soc/i2c_periph.h"
-#include "soc/soc_memory_layout.h"
+#include "xtensa/hal.h"
 
 static const char *I2C_TAG = "i2c";
 
@@ -70,9 +69,10 @@ static const char *I2C_TAG = "i2c";
     }
 
 typedef struct {
-    int i2c_num;                        /*!< I2C port number */
-    intr_handle_t intr_handle;          /*!< I2C interrupt handle*/
-    uint8_t data_buf[SOC_I2C_FIFO_LEN]; /*!< a buffer to store i2c data */
+    int i2c_num;                            /*!< I2C port number */
+    intr_handle_t intr_handle;              /*!< I2C interrupt handle*/
+    uint8_t data_buf[SOC_I2C_FIFO_LEN];     /*!< a buffer to store i2c data */
+    uint8_t tx_frame[I2C_SLAVE_FRAME_SIZE]; /*!< last consistent keystate */
 } i2c_obj_t;
 
 typedef struct {
@@ -101,15 +101,216 @@ static void i2c_slave_hw_enable(i2c_port_t i2c_num) {
     I2C_EXIT_CRITICAL(&(i2c_context[i2c_num].spinlock));
 }
 
-#define DATA_SIZE 5
-static uint8_t keystate_0[] = {0x02, 0x00, 0x00, 0x00, 0x00};
-static uint8_t keystate_1[] = {0x02, 0x00, 0x00, 0x00, 0x00};
+// Frame served to the master on each port. The task side publishes it as a
+// seqlock so that the ISR never waits for it nor sends a torn frame: seq is
+// odd while a new frame is being written.
+typedef struct {
+    volatile uint32_t seq;
+    uint8_t frame[I2C_SLAVE_FRAME_SIZE];
+} keystate_t;
+
+#define KEYSTATE_INIT_DEF                                 \
+    {                                                     \
+        .seq = 0, .frame = {0x02, 0x00, 0x00, 0x00, 0x00} \
+    }
+
+static DRAM_ATTR keystate_t keystate[I2C_NUM_MAX] = {
+    KEYSTATE_INIT_DEF,
+    KEYSTATE_INIT_DEF,
+};
+
+// ISR statistics, only updated and read under the port spinlock
+static DRAM_ATTR i2c_slave_stats_t isr_stats[I2C_NUM_MAX];
+
+// INT line of each port, -1 if none. int_asserted_us is when the last frame
+// was signalled, 0 once the master has read it. Both are only touched
+// under the port spinlock.
+#ifdef CONFIG_MILIGHT_INT_ACTIVE_LOW
+#define INT_ACTIVE 0
+#else
+#define INT_ACTIVE 1
+#endif
+
+static DRAM_ATTR gpio_num_t int_pin[I2C_NUM_MAX] = {-1, -1};
+static DRAM_ATTR int64_t int_asserted_us[I2C_NUM_MAX];
+
+static inline void IRAM_ATTR int_set(int i2c_num, bool active) {
+    gpio_ll_set_level(GPIO_LL_GET_HW(GPIO_PORT_0), int_pin[i2c_num],
+                      active ? INT_ACTIVE : !INT_ACTIVE);
+}
+
+#ifdef CONFIG_MILIGHT_INT_PULSE
+// Ends the pulses, unless the ISR already released the line because the
+// master read the frame
+static esp_timer_handle_t int_timer[I2C_NUM_MAX];
+
+static void int_timer_cb(void *arg) {
+    int i2c_num = (intptr_t)arg;
+    I2C_ENTER_CRITICAL(&(i2c_context[i2c_num].spinlock));
+    int_set(i2c_num, false);
+    I2C_EXIT_CRITICAL(&(i2c_context[i2c_num].spinlock));
+}
+#endif
+
+void i2c_slave_set_int_pin(i2c_port_t i2c_num, gpio_num_t gpio_num) {
+#ifndef CONFIG_MILIGHT_INT_NONE
+    int_pin[i2c_num] = gpio_num;
+    if (gpio_num >= 0) int_set(i2c_num, false);
+#endif
+#ifdef CONFIG_MILIGHT_INT_PULSE
+    if (gpio_num >= 0 && int_timer[i2c_num] == NULL) {
+        const esp_timer_create_args_t timer_args = {
+            .callback = &int_timer_cb,
+            .arg = (void *)(intptr_t)i2c_num,
+            .name = i2c_num == I2C_NUM_0 ? "int_0" : "int_1"};
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &int_timer[i2c_num]));
+    }
+#endif
+}
+
+// Tells the master a new frame is ready. Called after the frame is
+// published: a read racing with it only costs the master an extra read,
+// whereas asserting first could let it clear the line on the old frame.
+static void int_notify(i2c_port_t i2c_num) {
+#ifndef CONFIG_MILIGHT_INT_NONE
+    if (int_pin[i2c_num] < 0) return;
+    I2C_ENTER_CRITICAL(&(i2c_context[i2c_num].spinlock));
+    int_asserted_us[i2c_num] = esp_timer_get_time();
+    isr_stats[i2c_num].int_notified++;
+    int_set(i2c_num, true);
+    I2C_EXIT_CRITICAL(&(i2c_context[i2c_num].spinlock));
+#ifdef CONFIG_MILIGHT_INT_PULSE
+    // Restarted if the previous pulse is still running
+    esp_timer_stop(int_timer[i2c_num]);
+    esp_timer_start_once(int_timer[i2c_num], CONFIG_MILIGHT_INT_PULSE_US);
+#endif
+#endif
+}
+
+void i2c_slave_set_frame(i2c_port_t i2c_num, const uint8_t *frame) {
+    keystate_t *state = &keystate[i2c_num];
+    state->seq++;
+    __sync_synchronize();
+    memcpy(state->frame, frame, I2C_SLAVE_FRAME_SIZE);
+    __sync_synchronize();
+    state->seq++;
+    int_notify(i2c_num);
+}
 
-uint8_t* get_keystate(i2c_port_t i2c_num) {
-    return i2c_num == I2C_NUM_0 ? &keystate_0[0] : &keystate_1[0];
+void i2c_slave_get_frame(i2c_port_t i2c_num, uint8_t *frame) {
+    memcpy(frame, keystate[i2c_num].frame, I2C_SLAVE_FRAME_SIZE);
+}
+
+// Task to notify each time the master polls a port
+static TaskHandle_t poll_notify[I2C_NUM_MAX] = {0};
+
+void i2c_slave_set_poll_notify(i2c_port_t i2c_num, TaskHandle_t task) {
+    poll_notify[i2c_num] = task;
+}
+
+// Copies the current frame of i2c_num in the ISR private buffer. If the task
+// side is in the middle of a publish, the previous frame is kept and will be
+// sent instead: it is stale by at most one publish, but never torn. Returns
+// false in that case.
+static bool IRAM_ATTR keystate_fetch(i2c_obj_t *p_i2c) {
+    const keystate_t *state = &keystate[p_i2c->i2c_num];
+    uint8_t frame[I2C_SLAVE_FRAME_SIZE];
+
+    uint32_t seq = state->seq;
+    __sync_synchronize();
+    if (seq & 1) return false;
+    for (int i = 0; i < I2C_SLAVE_FRAME_SIZE; i++) frame[i] = state->frame[i];
+    __sync_synchronize();
+    if (state->seq != seq) return false;
+
+    for (int i = 0; i < I2C_SLAVE_FRAME_SIZE; i++) {
+        p_i2c->tx_frame[i] = frame[i];
+    }
+    return true;
+}
+
+// Histogram bucket of a duration: below 64, then one per power of two
+static inline int IRAM_ATTR stats_bucket(uint32_t value) {
+    uint32_t scaled = value >> 6;
+    int bucket = scaled == 0 ? 0 : 32 - __builtin_clz(scaled);
+    return bucket < I2C_SLAVE_ISR_HIST_LENGTH ? bucket
+                                              : I2C_SLAVE_ISR_HIST_LENGTH - 1;
+}
+
+static inline void IRAM_ATTR isr_stats_add(int i2c_num,
+                                           i2c_intr_event_t evt_type,
+                                           uint32_t start) {
+    i2c_slave_stats_t *stats = &isr_stats[i2c_num];
+    if (evt_type < I2C_SLAVE_EVENT_LENGTH) stats->events[evt_type]++;
+    uint32_t cycles = xthal_get_ccount() - start;
+    stats->isr_cycles[stats_bucket(cycles)]++;
+    if (cycles > stats->isr_cycles_max) stats->isr_cycles_max = cycles;
+}
+
+static inline void IRAM_ATTR int_stats_add(int i2c_num) {
+    i2c_slave_stats_t *stats = &isr_stats[i2c_num];
+    uint32_t delay = esp_timer_get_time() - int_asserted_us[i2c_num];
+    int_asserted_us[i2c_num] = 0;
+    stats->int_delay_us[stats_bucket(delay)]++;
+    if (delay > stats->int_delay_max_us) stats->int_delay_max_us = delay;
+}
+
+#ifdef CONFIG_MILIGHT_I2C_CAPTURE
+// Capture rings, only updated and read under the port spinlock. head counts
+// every record ever written.
+#define CAPTURE_LENGTH CONFIG_MILIGHT_I2C_CAPTURE_LENGTH
+
+static DRAM_ATTR i2c_capture_record_t capture[I2C_NUM_MAX][CAPTURE_LENGTH];
+static DRAM_ATTR uint32_t capture_head[I2C_NUM_MAX];
+
+static void IRAM_ATTR capture_add(int i2c_num, uint8_t dir,
+                                  const uint8_t *data, int len) {
+    i2c_capture_record_t *record =
+        &capture[i2c_num][capture_head[i2c_num]++ % CAPTURE_LENGTH];
+    record->time_us = esp_timer_get_time();
+    record->port = i2c_num;
+    record->dir = dir;
+    record->len = len;
+    for (int i = 0; i < len; i++) record->data[i] = data[i];
+}
+
+// Records what the master wrote, draining the RX FIFO
+static void IRAM_ATTR capture_rxfifo(i2c_obj_t *p_i2c) {
+    i2c_hal_context_t *hal = &(i2c_context[p_i2c->i2c_num].hal);
+    uint32_t count = 0;
+    i2c_hal_get_rxfifo_cnt(hal, &count);
+    if (count > SOC_I2C_FIFO_LEN) count = SOC_I2C_FIFO_LEN;
+    i2c_hal_read_rxfifo(hal, p_i2c->data_buf, count);
+    for (uint32_t i = 0; i < count; i += I2C_SLAVE_FRAME_SIZE) {
+        int len = count - i < I2C_SLAVE_FRAME_SIZE ? count - i
+                                                   : I2C_SLAVE_FRAME_SIZE;
+        capture_add(p_i2c->i2c_num, I2C_CAPTURE_WRITE, p_i2c->data_buf + i,
+                    len);
+    }
+}
+
+size_t i2c_slave_capture_read(i2c_port_t i2c_num,
+                              i2c_capture_record_t *records, size_t length) {
+    I2C_ENTER_CRITICAL(&(i2c_context[i2c_num].spinlock));
+    uint32_t head = capture_head[i2c_num];
+    uint32_t count = head < CAPTURE_LENGTH ? head : CAPTURE_LENGTH;
+    if (count > length) count = length;
+    for (uint32_t i = 0; i < count; i++) {
+        records[i] = capture[i2c_num][(head - count + i) % CAPTURE_LENGTH];
+    }
+    I2C_EXIT_CRITICAL(&(i2c_context[i2c_num].spinlock));
+    return count;
+}
+#endif
+
+void i2c_slave_get_stats(i2c_port_t i2c_num, i2c_slave_stats_t *stats) {
+    I2C_ENTER_CRITICAL(&(i2c_context[i2c_num].spinlock));
+    *stats = isr_stats[i2c_num];
+    I2C_EXIT_CRITICAL(&(i2c_context[i2c_num].spinlock));
 }
 
 static void IRAM_ATTR i2c_isr_handler(void *arg) {
+    uint32_t start = xthal_get_ccount();
     // Get back contextual data
     i2c_obj_t *p_i2c = (i2c_obj_t *)arg;
     int i2c_num = p_i2c->i2c_num;
@@ -138,13 +339,36 @@ static void IRAM_ATTR i2c_isr_handler(void *arg) {
     // - I2C_INTR_EVENT_RXFIFO_FULL,  /*!< I2C rxfifo full event */
     // + I2C_INTR_EVENT_TXFIFO_EMPTY, /*!< I2C txfifo empty event */
     if (evt_type == I2C_INTR_EVENT_TXFIFO_EMPTY) {
-        i2c_hal_write_txfifo(&(i2c_context[i2c_num].hal), &keystate_0[0], DATA_SIZE);
+        if (!keystate_fetch(p_i2c)) {
+            isr_stats[i2c_num].stale++;
+        } else if (int_asserted_us[i2c_num] != 0) {
+            // The signalled frame is on its way, the line can go back
+            int_set(i2c_num, false);
+            int_stats_add(i2c_num);
+        }
+        i2c_hal_write_txfifo(&(i2c_context[i2c_num].hal), p_i2c->tx_frame,
+                             I2C_SLAVE_FRAME_SIZE);
+        latency_fifo_written(i2c_num);
+#ifdef CONFIG_MILIGHT_I2C_CAPTURE
+        capture_add(i2c_num, I2C_CAPTURE_READ, p_i2c->tx_frame,
+                    I2C_SLAVE_FRAME_SIZE);
+    } else if (evt_type == I2C_INTR_EVENT_TRANS_DONE ||
+               evt_type == I2C_INTR_EVENT_RXFIFO_FULL) {
+        capture_rxfifo(p_i2c);
+#endif
     }
 
     // Re-enable interrupts
     i2c_hal_clr_intsts_mask(&(i2c_context[i2c_num].hal), I2C_INTR_MASK);
     i2c_hal_enable_intr_mask(&(i2c_context[i2c_num].hal), I2C_INTR_MASK);
+    isr_stats_add(i2c_num, evt_type, start);
     I2C_EXIT_CRITICAL_ISR(&(i2c_context[i2c_num].spinlock));
+
+    if (evt_type == I2C_INTR_EVENT_TXFIFO_EMPTY && poll_notify[i2c_num]) {
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveFromISR(poll_notify[i2c_num], &woken);
+        if (woken == pdTRUE) portYIELD_FROM_ISR();
+    }
 }
 
 static esp_err_t i2c_slave_set_pin(i2c_port_t i2c_num, int sda_io_num,
@@ -219,8 +443,10 @@ esp_err_t i2c_slave_driver_install(i2c_port_t i2c_num) {
     i2c_hal_clr_intsts_mask(&(i2c_context[i2c_num].hal), I2C_INTR_MASK);
 
     // Give first data to write
-    for (int i=0; i<5; i++)
-        i2c_hal_write_txfifo(&(i2c_context[i2c_num].hal), &keystate_0[0], DATA_SIZE);
+    i2c_slave_get_frame(i2c_num, p_i2c->tx_frame);
+    for (int i = 0; i < 5; i++)
+        i2c_hal_write_txfifo(&(i2c_context[i2c_num].hal), p_i2c->tx_frame,
+                             I2C_SLAVE_FRAME_SIZE);
 
     // Hook isr handler
     esp_intr_alloc(i2c_periph_signal[i2c_num].irq, 0, i2c_isr_handler,
@@ -2,7 +2,73 @@
 
 #include <esp_types.h>
 
+#include "driver/i2c.h"
+#include "frame.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "hal/i2c_hal.h"
+
 esp_err_t i2c_slave_driver_install(i2c_port_t);
-esp_err_t i2c_slave_param_config(i2c_port_t, i2c_config_t*);
+esp_err_t i2c_slave_param_config(i2c_port_t, const i2c_config_t*);
+
+// Publish the frame the master reads on a port. It is picked up atomically
+// by the ISR on the next TX FIFO refill. Each port must have a single writer.
+void i2c_slave_set_frame(i2c_port_t, const uint8_t*);
+void i2c_slave_get_frame(i2c_port_t, uint8_t*);
+
+// Give a task notification to task each time the master polls i2c_num.
+void i2c_slave_set_poll_notify(i2c_port_t i2c_num, TaskHandle_t task);
+
+// Signals each new frame of i2c_num on the INT line gpio_num, an output, as
+// set by CONFIG_MILIGHT_INT_MODE: a pulse, or a level held until the master
+// reads the frame. The line is released right away. Does nothing with
+// CONFIG_MILIGHT_INT_NONE.
+void i2c_slave_set_int_pin(i2c_port_t i2c_num, gpio_num_t gpio_num);
+
+// Interrupt statistics of a port, counted since the driver was installed.
+// isr_cycles is a histogram of the ISR duration in CPU cycles: bucket 0
+// counts ISRs under 64 cycles, bucket i those in [32 << i, 64 << i), and
+// the last one everything above. stale counts the polls served with the
+// previous frame because a new one was being published. int_delay_us is the
+// same histogram, in microseconds, of the time from the INT line signalling
+// a frame to the master reading it, for the int_notified frames.
+#define I2C_SLAVE_EVENT_LENGTH (I2C_INTR_EVENT_TXFIFO_EMPTY + 1)
+#define I2C_SLAVE_ISR_HIST_LENGTH 16
+
+typedef struct {
+    uint32_t events[I2C_SLAVE_EVENT_LENGTH];  // Indexed by i2c_intr_event_t
+    uint32_t stale;
+    uint32_t isr_cycles[I2C_SLAVE_ISR_HIST_LENGTH];
+    uint32_t isr_cycles_max;
+    uint32_t int_notified;
+    uint32_t int_delay_us[I2C_SLAVE_ISR_HIST_LENGTH];
+    uint32_t int_delay_max_us;
+} i2c_slave_stats_t;
+
+void i2c_slave_get_stats(i2c_port_t i2c_num, i2c_slave_stats_t *stats);
+
+#ifdef CONFIG_MILIGHT_I2C_CAPTURE
+// Bus capture
+// ===========
+//
+// Every frame the master reads (I2C_CAPTURE_READ, the frame put in the TX
+// FIFO) and every byte it writes (I2C_CAPTURE_WRITE, up to
+// I2C_SLAVE_FRAME_SIZE per record) is timestamped and kept in a ring of
+// CONFIG_MILIGHT_I2C_CAPTURE_LENGTH records per port.
+enum i2c_capture_dir {
+    I2C_CAPTURE_READ,
+    I2C_CAPTURE_WRITE,
+};
+
+typedef struct {
+    uint32_t time_us;  // esp_timer_get_time(), truncated
+    uint8_t port;
+    uint8_t dir;
+    uint8_t len;
+    uint8_t data[I2C_SLAVE_FRAME_SIZE];
+} i2c_capture_record_t;
 
-uint8_t* get_keystate(i2c_port_t);
+// Copies the records of i2c_num, oldest first, returns how many were copied
+size_t i2c_slave_capture_read(i2c_port_t i2c_num,
+                              i2c_capture_record_t *records, size_t length);
+#endif
@@ -0,0 +1,335 @@
+#include "ibox.h"
+
+#include <string.h>
+
+#include "esp_system.h"
+#include "frame.h"
+
+// The decoders and the replies only depend on the frame codec and the MAC
+// address, the listener needs the rest
+#ifdef CONFIG_MILIGHT_IBOX
+// FreeRTOS includes
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+// ESP specific includes
+#include "esp_log.h"
+#include "lwip/sockets.h"
+
+// Other
+#include "milight.h"
+#include "queues.h"
+
+static const char *TAG = "IBOX";
+#endif
+
+// v6 packets
+#define V6_HANDSHAKE 0x20
+#define V6_COMMAND 0x80
+#define V6_KEEPALIVE 0xD0
+#define V6_COMMAND_SIZE 22
+#define V6_BULB_RGBW 0x07
+
+// Offsets in a v6 command packet: header, session, sequence number, then
+// the command, the zone and a checksum of both
+#define V6_SEQUENCE 8
+#define V6_CMD 10
+#define V6_ZONE 19
+#define V6_CHECKSUM 21
+
+// v6 RGBW commands, at V6_CMD + 4, and their argument at V6_CMD + 5
+#define V6_COLOR 0x01
+#define V6_BRIGHTNESS 0x02
+#define V6_KEY 0x03
+#define V6_MODE 0x04
+#define V6_KEY_ON 0x01
+#define V6_KEY_OFF 0x02
+#define V6_KEY_SPEED_PLUS 0x03
+#define V6_KEY_SPEED_MINUS 0x04
+
+// v5 RGBW commands, the first byte of a packet
+#define V5_ALL_OFF 0x41
+#define V5_ALL_ON 0x42
+#define V5_SPEED_MINUS 0x43
+#define V5_SPEED_PLUS 0x44
+#define V5_ZONE_ON(zone) (0x45 + 2 * ((zone)-1))
+#define V5_ZONE_OFF(zone) (0x46 + 2 * ((zone)-1))
+#define V5_COLOR 0x40
+#define V5_MODE 0x4D
+#define V5_BRIGHTNESS 0x4E
+#define V5_BRIGHTNESS_MIN 0x02
+#define V5_BRIGHTNESS_MAX 0x1B
+#define V5_SUFFIX 0x55
+
+// Bridge colour byte of red
+#define IBOX_COLOR_RED 0xB0
+
+#define IBOX_PACKET_SIZE 64
+_Static_assert(IBOX_PACKET_SIZE >= IBOX_V6_REPLY_MAX,
+               "v6 replies are built in the packet buffer");
+
+static ibox_command_t ibox_key(int bus, uint8_t keys) {
+    return (ibox_command_t){.kind = IBOX_KEY, .bus = bus, .keys = keys};
+}
+
+static ibox_command_t ibox_zone_key(uint8_t zone, bool on) {
+    uint8_t keycode;
+    int bus = frame_zone_key(zone, on, &keycode);
+    return ibox_key(bus, keycode);
+}
+
+static ibox_command_t ibox_slider(enum milight_slider slider,
+                                  uint8_t value) {
+    return (ibox_command_t){
+        .kind = IBOX_SLIDER, .slider = slider, .value = value};
+}
+
+static uint8_t wheel_from_color(uint8_t color) {
+    return frame_wheel_from_hue((uint8_t)(IBOX_COLOR_RED - color) * 360 /
+                                256);
+}
+
+int ibox_decode_v5(const uint8_t *packet, int len, ibox_command_t *cmds) {
+    if (len < 2 || len > 3 || (len == 3 && packet[2] != V5_SUFFIX)) {
+        return -1;
+    }
+    uint8_t value = packet[1];
+
+    switch (packet[0]) {
+        case V5_ALL_ON:
+            cmds[0] = ibox_key(I2C_NUM_0, GENERAL_ON);
+            return 1;
+        case V5_ALL_OFF:
+            cmds[0] = ibox_key(I2C_NUM_0, GENERAL_OFF);
+            return 1;
+        case V5_SPEED_MINUS:
+            cmds[0] = ibox_key(I2C_NUM_0, SPEED_MINUS);
+            return 1;
+        case V5_SPEED_PLUS:
+            cmds[0] = ibox_key(I2C_NUM_0, SPEED_PLUS);
+            return 1;
+        case V5_MODE:
+            cmds[0] = ibox_key(I2C_NUM_0, MODE);
+            return 1;
+        case V5_COLOR:
+            cmds[0] = ibox_slider(SLIDER_WHEEL, wheel_from_color(value));
+            return 1;
+        case V5_BRIGHTNESS:
+            if (value < V5_BRIGHTNESS_MIN) value = V5_BRIGHTNESS_MIN;
+            if (value > V5_BRIGHTNESS_MAX) value = V5_BRIGHTNESS_MAX;
+            cmds[0] = ibox_slider(SLIDER_LUMINOSITY,
+                             (value - V5_BRIGHTNESS_MIN) * 0x7F /
+                                 (V5_BRIGHTNESS_MAX - V5_BRIGHTNESS_MIN));
+            return 1;
+    }
+    for (int zone = 1; zone <= FRAME_ZONES; zone++) {
+        if (packet[0] == V5_ZONE_ON(zone)) {
+            cmds[0] = ibox_zone_key(zone, true);
+            return 1;
+        }
+        if (packet[0] == V5_ZONE_OFF(zone)) {
+            cmds[0] = ibox_zone_key(zone, false);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int ibox_decode_v6(const uint8_t *packet, int len, ibox_command_t *cmds) {
+    if (len != V6_COMMAND_SIZE || packet[0] != V6_COMMAND) return -1;
+    uint8_t checksum = 0;
+    for (int i = V6_CMD; i < V6_CHECKSUM; i++) checksum += packet[i];
+    if (checksum != packet[V6_CHECKSUM]) return -1;
+
+    const uint8_t *cmd = packet + V6_CMD;
+    uint8_t zone = packet[V6_ZONE];
+    if (cmd[3] != V6_BULB_RGBW || zone > FRAME_ZONES) return 0;
+
+    // Colour and brightness apply to the zone, which is selected first
+    ibox_command_t on = ibox_zone_key(zone, true);
+    ibox_command_t off = ibox_zone_key(zone, false);
+    uint8_t value = cmd[5];
+    int count = 0;
+    switch (cmd[4]) {
+        case V6_COLOR:
+            cmds[count++] = on;
+            cmds[count++] = ibox_slider(SLIDER_WHEEL, wheel_from_color(value));
+            break;
+        case V6_BRIGHTNESS:
+            if (value > 100) value = 100;
+            cmds[count++] = on;
+            cmds[count++] = ibox_slider(SLIDER_LUMINOSITY, value * 0x7F / 100);
+            break;
+        case V6_MODE:
+            cmds[count++] = ibox_key(I2C_NUM_0, MODE);
+            break;
+        case V6_KEY:
+            if (value == V6_KEY_ON) {
+                cmds[count++] = on;
+            } else if (value == V6_KEY_OFF) {
+                cmds[count++] = off;
+            } else if (value == V6_KEY_SPEED_PLUS) {
+                cmds[count++] = ibox_key(I2C_NUM_0, SPEED_PLUS);
+            } else if (value == V6_KEY_SPEED_MINUS) {
+                cmds[count++] = ibox_key(I2C_NUM_0, SPEED_MINUS);
+            }
+            break;
+    }
+    return count;
+}
+
+int ibox_reply_v6(uint8_t *packet, int valid) {
+    static const uint8_t handshake[] = {0x28, 0x00, 0x00, 0x00, 0x11,
+                                        0x00, 0x02};
+    static const uint8_t handshake_tail[] = {0x69, 0xF0, 0x3C, 0x23, 0x00,
+                                             0x01};
+    static const uint8_t keepalive[] = {0xD8, 0x00, 0x00, 0x00, 0x07};
+    static const uint8_t ack[] = {0x88, 0x00, 0x00, 0x00, 0x03, 0x00};
+    static uint16_t session;
+    uint8_t mac[6];
+
+    switch (packet[0]) {
+        case V6_HANDSHAKE:
+            // Any session is accepted afterwards, the id is only echoed
+            if (session == 0) session = esp_random() | 1;
+            esp_read_mac(mac, ESP_MAC_WIFI_STA);
+            memcpy(packet, handshake, sizeof(handshake));
+            memcpy(packet + 7, mac, sizeof(mac));
+            memcpy(packet + 13, handshake_tail, sizeof(handshake_tail));
+            packet[19] = session >> 8;
+            packet[20] = session & 0xFF;
+            packet[21] = 0x00;
+            return IBOX_V6_REPLY_MAX;
+        case V6_KEEPALIVE:
+            esp_read_mac(mac, ESP_MAC_WIFI_STA);
+            memcpy(packet, keepalive, sizeof(keepalive));
+            memcpy(packet + 5, mac, sizeof(mac));
+            packet[11] = 0x01;
+            return 12;
+        case V6_COMMAND: {
+            if (valid < 0) return 0;
+            uint8_t sequence = packet[V6_SEQUENCE];
+            memcpy(packet, ack, sizeof(ack));
+            packet[6] = sequence;
+            packet[7] = 0x00;
+            return 8;
+        }
+    }
+    return 0;
+}
+
+#ifdef CONFIG_MILIGHT_IBOX
+// A zone key followed by a slider is played as one sequence: through the
+// dispatcher queues, the slider could be shown before the key selects its
+// zone. Lone commands go through the queues like MQTT ones.
+static void ibox_dispatch(const ibox_command_t *cmds, int count,
+                          latency_trace_t *trace) {
+    if (count > 1) {
+        milight_sequence_step_t steps[2 * IBOX_COMMANDS_MAX];
+        uint8_t steps_count = 0;
+        uint32_t queued_ms[I2C_NUM_MAX] = {0, 0};
+        for (int i = 0; i < count; i++) {
+            uint8_t frame[I2C_SLAVE_FRAME_SIZE];
+            if (cmds[i].kind == IBOX_KEY) {
+                frame_encode_key(cmds[i].bus, cmds[i].keys, frame);
+                milight_sequence_add(steps, &steps_count, queued_ms,
+                                     cmds[i].bus, frame, CLICK_HOLD_MS);
+            } else {
+                int bus = frame_encode_slider(cmds[i].slider, cmds[i].value,
+                                              frame);
+                milight_sequence_add(steps, &steps_count, queued_ms, bus,
+                                     frame, CONFIG_MILIGHT_ANIM_FRAME_MS);
+            }
+        }
+        latency_mark(trace, LATENCY_DISPATCHED);
+        milight_sequence_play(steps, steps_count, trace);
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (cmds[i].kind == IBOX_KEY) {
+            struct key_command cmd = {
+                .bus = cmds[i].bus, .keycode = cmds[i].keys, .trace = *trace};
+            if (xQueueSend(dispatcher_queues[QUEUE_KEY], &cmd, 0) != pdTRUE) {
+                ESP_LOGI(TAG, "Key queue is full, ignoring command");
+            }
+        } else {
+            struct slider_command cmd = {.slider = cmds[i].slider,
+                                         .value = cmds[i].value,
+                                         .trace = *trace};
+            queues_post_slider(&cmd);
+        }
+    }
+}
+
+static int ibox_bind(uint16_t port) {
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) return -1;
+    struct sockaddr_in addr = {.sin_family = AF_INET,
+                               .sin_port = htons(port),
+                               .sin_addr.s_addr = htonl(INADDR_ANY)};
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        ESP_LOGE(TAG, "Cannot bind UDP port %u: errno %d", port, errno);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+#define IBOX_STACK_SIZE 3072
+StaticTask_t ibox_buffer;
+StackType_t ibox_stack[IBOX_STACK_SIZE];
+static void ibox_task(void *pvParameter) {
+    // Only this task receives, packets are parsed in place
+    static uint8_t packet[IBOX_PACKET_SIZE];
+    int v6 = ibox_bind(CONFIG_MILIGHT_IBOX_V6_PORT);
+    int v5 = ibox_bind(CONFIG_MILIGHT_IBOX_V5_PORT);
+    if (v6 < 0 && v5 < 0) vTaskDelete(NULL);
+
+    while (1) {
+        fd_set readable;
+        FD_ZERO(&readable);
+        if (v6 >= 0) FD_SET(v6, &readable);
+        if (v5 >= 0) FD_SET(v5, &readable);
+        if (select((v6 > v5 ? v6 : v5) + 1, &readable, NULL, NULL, NULL) <=
+            0) {
+            continue;
+        }
+
+        for (int i = 0; i < 2; i++) {
+            int sock = i == 0 ? v6 : v5;
+            if (sock < 0 || !FD_ISSET(sock, &readable)) continue;
+
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            int len = recvfrom(sock, packet, sizeof(packet), 0,
+                               (struct sockaddr *)&from, &from_len);
+            if (len <= 0) continue;
+            latency_trace_t trace = {0};
+            latency_mark(&trace, LATENCY_MQTT_RX);
+
+            ibox_command_t cmds[IBOX_COMMANDS_MAX];
+            int count = sock == v6 ? ibox_decode_v6(packet, len, cmds)
+                                   : ibox_decode_v5(packet, len, cmds);
+            // Handshakes and keep-alives are only answered
+            bool control = sock == v6 && packet[0] != V6_COMMAND;
+            if (count < 0 && !control) {
+                ESP_LOGD(TAG, "Invalid packet of %d bytes", len);
+            }
+            if (count > 0) ibox_dispatch(cmds, count, &trace);
+
+            int reply = sock == v6 ? ibox_reply_v6(packet, count) : 0;
+            if (reply > 0) {
+                sendto(sock, packet, reply, 0, (struct sockaddr *)&from,
+                       from_len);
+            }
+        }
+    }
+}
+
+void ibox_init(void) {
+    xTaskCreateStatic(&ibox_task, "ibox", IBOX_STACK_SIZE, NULL,
+                      tskIDLE_PRIORITY + 3, ibox_stack, &ibox_buffer);
+}
+#endif  // CONFIG_MILIGHT_IBOX
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+
+// iBox UDP listener
+// =================
+//
+// Lets Milight apps and LAN controllers drive the remote without the MQTT
+// broker, through the UDP protocols of the Milight WiFi bridges:
+// - v6 (iBox1/iBox2), on CONFIG_MILIGHT_IBOX_V6_PORT: a session handshake,
+//   then 22 byte command packets with a sequence number and a checksum,
+//   each one acknowledged. Only the RGBW bulb commands (type 0x07) are
+//   understood.
+// - v5 and older (legacy bridges), on CONFIG_MILIGHT_IBOX_V5_PORT: 2 or 3
+//   byte RGBW packets, unacknowledged.
+//
+// Commands go through the same dispatcher queues as the MQTT ones. Colour
+// bytes follow the bridge convention (red at 0xB0, the hue decreasing as
+// the byte grows) and are converted with frame_wheel_from_hue(). Commands
+// without an equivalent on the remote (white, night mode) are ignored.
+#define IBOX_COMMANDS_MAX 2
+
+enum ibox_kind {
+    IBOX_KEY,     // A key press on bus, keys being its key code
+    IBOX_SLIDER,  // slider (enum milight_slider) moved to value
+};
+
+typedef struct {
+    uint8_t kind;
+    uint8_t bus;
+    uint8_t keys;
+    uint8_t slider;
+    uint8_t value;
+} ibox_command_t;
+
+// Decode a packet into at most IBOX_COMMANDS_MAX commands, played in order:
+// a slider on a given zone first selects it. Return the number of commands,
+// 0 if there is nothing to play, or -1 if the packet is invalid.
+int ibox_decode_v5(const uint8_t *packet, int len, ibox_command_t *cmds);
+int ibox_decode_v6(const uint8_t *packet, int len, ibox_command_t *cmds);
+
+// Replies to a v6 packet in place, packet having room for
+// IBOX_V6_REPLY_MAX bytes: handshakes get the session id, keep-alives the
+// MAC address, and valid commands an ack of their sequence number. valid
+// is what ibox_decode_v6() returned. Returns the length of the reply, 0 for
+// none.
+#define IBOX_V6_REPLY_MAX 22
+int ibox_reply_v6(uint8_t *packet, int valid);
+
+#ifdef CONFIG_MILIGHT_IBOX
+// Starts the listener task, the TCP/IP stack must be up.
+void ibox_init(void);
+#else
+static inline void ibox_init(void) {}
+#endif
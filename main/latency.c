@@ -0,0 +1,137 @@
+#include "latency.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+
+#ifdef CONFIG_MILIGHT_LATENCY_TRACE
+
+static const char *TAG = "LATENCY";
+
+// Log-linear histogram: exact below 8us, then 4 buckets per power of two,
+// which keeps the error on a percentile under 25% up to ~70 minutes.
+#define HIST_SUB_BITS 2
+#define HIST_BUCKETS (32 << HIST_SUB_BITS)
+
+// One histogram per pair of consecutive stages, plus the end-to-end one
+#define SPAN_TOTAL (LATENCY_STAGE_LENGTH - 1)
+#define SPAN_LENGTH (SPAN_TOTAL + 1)
+
+static const char *span_names[SPAN_LENGTH] = {
+    "mqtt->dispatch", "dispatch->commit", "commit->fifo", "end-to-end"};
+
+typedef struct {
+    uint32_t bucket[HIST_BUCKETS];
+    uint32_t count;
+    uint32_t max;
+} latency_hist_t;
+
+static DRAM_ATTR latency_hist_t hists[SPAN_LENGTH];
+
+// Last committed command on each port, waiting for the master to read it
+static DRAM_ATTR volatile bool pending_valid[I2C_NUM_MAX];
+static DRAM_ATTR latency_trace_t pending[I2C_NUM_MAX];
+
+// Throughput, counted as the number of commands reaching the FIFO
+static DRAM_ATTR volatile uint32_t completed;
+static uint32_t completed_last;
+static uint32_t max_rate;
+
+static esp_timer_handle_t report_timer;
+
+static inline int IRAM_ATTR hist_index(uint32_t us) {
+    if (us < (2 << HIST_SUB_BITS)) return us;
+    int e = 31 - __builtin_clz(us);
+    return ((e - HIST_SUB_BITS) << HIST_SUB_BITS) +
+           (us >> (e - HIST_SUB_BITS));
+}
+
+static uint32_t hist_lower_bound(int i) {
+    if (i < (2 << HIST_SUB_BITS)) return i;
+    uint32_t m = (1 << HIST_SUB_BITS) | (i & ((1 << HIST_SUB_BITS) - 1));
+    return m << ((i >> HIST_SUB_BITS) - 1);
+}
+
+static inline void IRAM_ATTR hist_add(latency_hist_t *hist, uint32_t us) {
+    hist->bucket[hist_index(us)]++;
+    hist->count++;
+    if (us > hist->max) hist->max = us;
+}
+
+// Returns the lower bound of the bucket holding the permille-th value
+static uint32_t hist_percentile(const latency_hist_t *hist,
+                                uint32_t permille) {
+    uint64_t rank = ((uint64_t)hist->count * permille + 999) / 1000;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->bucket[i];
+        if (seen >= rank && seen > 0) return hist_lower_bound(i);
+    }
+    return hist->max;
+}
+
+void latency_commit(i2c_port_t i2c_num, const latency_trace_t *trace) {
+    // The ISR only looks at the trace once pending_valid is set again
+    pending_valid[i2c_num] = false;
+    __sync_synchronize();
+    // Frames that are not commands (animation frames, waits in a sequence)
+    // replace the pending one without being counted
+    if (trace->stamp[LATENCY_MQTT_RX] == 0) return;
+    pending[i2c_num] = *trace;
+    pending[i2c_num].stamp[LATENCY_COMMITTED] = latency_now();
+    __sync_synchronize();
+    pending_valid[i2c_num] = true;
+}
+
+void IRAM_ATTR latency_fifo_written(i2c_port_t i2c_num) {
+    if (!pending_valid[i2c_num]) return;
+    pending_valid[i2c_num] = false;
+
+    latency_trace_t *trace = &pending[i2c_num];
+    trace->stamp[LATENCY_FIFO] = latency_now();
+
+    uint32_t first = 0;
+    for (int stage = 0; stage < LATENCY_STAGE_LENGTH; stage++) {
+        uint32_t stamp = trace->stamp[stage];
+        if (stamp == 0) continue;
+        if (first == 0) first = stamp;
+        if (stage > 0 && trace->stamp[stage - 1] != 0) {
+            hist_add(&hists[stage - 1], stamp - trace->stamp[stage - 1]);
+        }
+    }
+    hist_add(&hists[SPAN_TOTAL], trace->stamp[LATENCY_FIFO] - first);
+    completed++;
+}
+
+static void latency_report(void *arg) {
+    uint32_t done = completed;
+    uint32_t rate = (done - completed_last) * 1000 /
+                    CONFIG_MILIGHT_LATENCY_REPORT_INTERVAL_MS;
+    completed_last = done;
+    if (rate > max_rate) max_rate = rate;
+
+    for (int span = 0; span < SPAN_LENGTH; span++) {
+        const latency_hist_t *hist = &hists[span];
+        if (hist->count == 0) continue;
+        ESP_LOGI(TAG, "%s: n=%u p50=%uus p99=%uus p999=%uus max=%uus",
+                 span_names[span], hist->count, hist_percentile(hist, 500),
+                 hist_percentile(hist, 990), hist_percentile(hist, 999),
+                 hist->max);
+    }
+    ESP_LOGI(TAG, "Throughput: %u cmd/s, max sustained %u cmd/s", rate,
+             max_rate);
+}
+
+void latency_init(void) {
+    memset(hists, 0, sizeof(hists));
+
+    const esp_timer_create_args_t report_args = {.callback = &latency_report,
+                                                 .name = "latency_report"};
+    ESP_ERROR_CHECK(esp_timer_create(&report_args, &report_timer));
+    ESP_ERROR_CHECK(esp_timer_start_periodic(
+        report_timer, CONFIG_MILIGHT_LATENCY_REPORT_INTERVAL_MS * 1000ULL));
+}
+
+#endif  // CONFIG_MILIGHT_LATENCY_TRACE
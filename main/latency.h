@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "driver/i2c.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+
+// Stages a command goes through, from the broker to the I2C TX FIFO.
+enum latency_stage {
+    LATENCY_MQTT_RX,     // MQTT or iBox message received, or rule fired
+    LATENCY_DISPATCHED,  // Command was taken out of dispatcher_queues
+    LATENCY_COMMITTED,   // New frame was committed to the keystate
+    LATENCY_FIFO,        // i2c_isr_handler wrote the frame in the TX FIFO
+};
+#define LATENCY_STAGE_LENGTH (LATENCY_FIFO + 1)
+
+// Timestamps (in us, truncated to 32 bits) carried along with a command.
+// A zero timestamp means the stage was not traced.
+typedef struct {
+    uint32_t stamp[LATENCY_STAGE_LENGTH];
+} latency_trace_t;
+
+static inline uint32_t latency_now(void) {
+    uint32_t now = (uint32_t)esp_timer_get_time();
+    return now ? now : 1;
+}
+
+static inline void latency_mark(latency_trace_t *trace,
+                                enum latency_stage stage) {
+#ifdef CONFIG_MILIGHT_LATENCY_TRACE
+    trace->stamp[stage] = latency_now();
+#endif
+}
+
+#ifdef CONFIG_MILIGHT_LATENCY_TRACE
+void latency_init(void);
+// Called right before a frame is published to the ISR of i2c_num, so that
+// its first TX FIFO refill is never missed. Only traces with a
+// LATENCY_MQTT_RX stamp are counted, once each.
+void latency_commit(i2c_port_t i2c_num, const latency_trace_t *trace);
+// Called from i2c_isr_handler when it refilled the TX FIFO of i2c_num.
+void IRAM_ATTR latency_fifo_written(i2c_port_t i2c_num);
+#else
+static inline void latency_init(void) {}
+static inline void latency_commit(i2c_port_t i2c_num,
+                                  const latency_trace_t *trace) {}
+static inline void latency_fifo_written(i2c_port_t i2c_num) {}
+#endif
@@ -0,0 +1,133 @@
+#include "logs.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// FreeRTOS includes
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
+
+// ESP specific includes
+#include "esp_log.h"
+
+// Other
+#include "mqtt.h"
+
+// Log ring
+// ========
+//
+// Bounded multi-producer ring (after D. Vyukov's MPMC queue): each slot holds
+// one line and a sequence number telling whether it is free for the ticket
+// of a producer (seq == ticket) or holds a line for the shipper
+// (seq == ticket + 1). Producers claim a ticket with a CAS on head and
+// never wait: if the slot is still in use the ring is full and the line is
+// dropped. LOG_RING_LENGTH must be a power of two.
+#define LOG_RING_LENGTH 32
+#define LOG_LINE_SIZE 128
+#define LOG_BATCH_SIZE 1024
+
+typedef struct {
+    volatile uint32_t seq;
+    uint16_t len;
+    char line[LOG_LINE_SIZE];
+} log_slot_t;
+
+static log_slot_t ring[LOG_RING_LENGTH];
+static volatile uint32_t head;
+static uint32_t tail;
+static volatile uint32_t dropped;
+
+static vprintf_like_t serial_vprintf;
+static TaskHandle_t shipper;
+
+static int logs_vprintf(const char *fmt, va_list ap) {
+    // Whatever the MQTT client logs while publishing goes to the serial
+    // port, otherwise each batch would generate the next one.
+    if (xTaskGetCurrentTaskHandle() == shipper) {
+        return serial_vprintf(fmt, ap);
+    }
+
+    uint32_t pos = head;
+    log_slot_t *slot;
+    while (1) {
+        slot = &ring[pos % LOG_RING_LENGTH];
+        int32_t diff = (int32_t)(slot->seq - pos);
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&head, pos, pos + 1)) break;
+            pos = head;
+        } else if (diff < 0) {
+            __sync_fetch_and_add(&dropped, 1);
+            return 0;
+        } else {
+            pos = head;
+        }
+    }
+
+    int len = vsnprintf(slot->line, LOG_LINE_SIZE, fmt, ap);
+    if (len < 0) len = 0;
+    slot->len = len < LOG_LINE_SIZE ? len : LOG_LINE_SIZE - 1;
+    __sync_synchronize();
+    slot->seq = pos + 1;
+
+    // Wake the shipper up early when the ring gets half full
+    if (pos - tail == LOG_RING_LENGTH / 2) xTaskNotifyGive(shipper);
+    return len;
+}
+
+// Moves as many lines as fit from the ring to batch, returns the batch size
+static int logs_fill(char *batch) {
+    int len = 0;
+    while (1) {
+        log_slot_t *slot = &ring[tail % LOG_RING_LENGTH];
+        if (slot->seq != tail + 1) break;
+        if (len + slot->len > LOG_BATCH_SIZE) break;
+        memcpy(batch + len, slot->line, slot->len);
+        len += slot->len;
+        __sync_synchronize();
+        slot->seq = tail + LOG_RING_LENGTH;
+        tail++;
+    }
+    return len;
+}
+
+#define LOGS_STACK_SIZE 3072
+StaticTask_t logs_buffer;
+StackType_t logs_stack[LOGS_STACK_SIZE];
+static void logs_task(void *pvParameter) {
+    static char batch[LOG_BATCH_SIZE];
+    uint32_t reported_dropped = 0;
+
+    while (1) {
+        ulTaskNotifyTake(pdTRUE,
+                         pdMS_TO_TICKS(CONFIG_MQTT_LOG_FLUSH_INTERVAL_MS));
+        xEventGroupWaitBits(mqtt_event_group, MQTT_CONNECTED_BIT, false, true,
+                            portMAX_DELAY);
+
+        int len;
+        while ((len = logs_fill(batch)) > 0) {
+            mqtt_publish(TOPIC_LOGS, batch, len, 0, 0);
+        }
+
+        uint32_t lost = dropped;
+        if (lost != reported_dropped) {
+            len = snprintf(batch, LOG_BATCH_SIZE, "%u log lines dropped\n",
+                           lost - reported_dropped);
+            mqtt_publish(TOPIC_LOGS, batch, len, 0, 0);
+            reported_dropped = lost;
+        }
+    }
+}
+
+void logs_redirect(void) {
+    if (serial_vprintf != NULL) return;
+    serial_vprintf = esp_log_set_vprintf(logs_vprintf);
+}
+
+void logs_init(void) {
+    for (int i = 0; i < LOG_RING_LENGTH; i++) ring[i].seq = i;
+
+    shipper = xTaskCreateStatic(&logs_task, "logs", LOGS_STACK_SIZE, NULL,
+                                tskIDLE_PRIORITY + 1, logs_stack,
+                                &logs_buffer);
+}
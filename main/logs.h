@@ -0,0 +1,8 @@
+#pragma once
+
+// Starts the task shipping logs to TOPIC_LOGS.
+void logs_init(void);
+
+// Redirects ESP_LOGx to the log ring. Lines are published in batches by the
+// shipper task, and counted as dropped when the ring is full.
+void logs_redirect(void);
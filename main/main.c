@@ -3,7 +3,6 @@
 
 // FreeRTOS includes
 #include "freertos/FreeRTOS.h"
-#include "freertos/event_groups.h"
 
 // ESP specific includes
 #include "esp_event.h"
@@ -12,9 +11,18 @@
 #include "nvs_flash.h"
 
 // Other
+#include "anim.h"
+#include "boot.h"
+#include "ibox.h"
+#include "latency.h"
 #include "milight.h"
 #include "mqtt.h"
 #include "ota.h"
+#include "queues.h"
+#include "scene.h"
+#include "schedule.h"
+#include "shadow.h"
+#include "telemetry.h"
 #include "wifi.h"
 
 static const char *TAG = "MAIN_APP";
@@ -33,9 +41,7 @@ void init_logging() {
     esp_log_level_set("MQTT_CLIENT", ESP_LOG_VERBOSE);
 }
 
-void app_main() {
-    init_logging();
-
+static void nvs_init(void) {
     esp_err_t err = nvs_flash_init();
     if (err == ESP_ERR_NVS_NO_FREE_PAGES ||
         err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
@@ -47,18 +53,63 @@ void app_main() {
         err = nvs_flash_init();
     }
     ESP_ERROR_CHECK(err);
+}
 
-    // Initialize milight device simulator
-    milight_init();
+static void dispatch_init(void) {
+    latency_init();
+    queues_init();
+}
 
-    // Wifi init initalizes net_event_group and tcpip stack!
-    wifi_init();
+enum boot_stage {
+    STAGE_NVS,
+    STAGE_DISPATCH,
+    STAGE_MILIGHT,
+    STAGE_ANIM,
+    STAGE_OTA_DETAILS,
+    STAGE_WIFI,
+    STAGE_SCENE,
+    STAGE_SCHEDULE,
+    STAGE_MQTT,
+    STAGE_OTA,
+    STAGE_TELEMETRY,
+    STAGE_SHADOW,
+    STAGE_IBOX,
+};
 
-    mqtt_init();
+// The remote must answer on I2C as early as possible, so the simulator only
+// waits for its queues. The network side and the partition hashing of
+// ota_details run alongside.
+static const boot_stage_t stages[] = {
+    [STAGE_NVS] = {"nvs", nvs_init, 0},
+    [STAGE_DISPATCH] = {"dispatch", dispatch_init, 0},
+    [STAGE_MILIGHT] = {"milight", milight_init, BOOT_DEP(STAGE_DISPATCH)},
+    [STAGE_ANIM] = {"anim", anim_init, BOOT_DEP(STAGE_MILIGHT)},
+    [STAGE_OTA_DETAILS] = {"ota_details", ota_details, 0},
+    // Wifi init initalizes net_event_group and tcpip stack!
+    [STAGE_WIFI] = {"wifi", wifi_init, BOOT_DEP(STAGE_NVS)},
+    [STAGE_SCENE] = {"scene", scene_init, BOOT_DEP(STAGE_NVS)},
+    // Both play steps directly on the key schedulers. The stages posting
+    // slider or animation commands wait for anim, which can only add empty
+    // mailboxes to its queue set.
+    [STAGE_SCHEDULE] = {"schedule", schedule_init,
+                        BOOT_DEP(STAGE_WIFI) | BOOT_DEP(STAGE_MILIGHT) |
+                            BOOT_DEP(STAGE_ANIM) | BOOT_DEP(STAGE_SCENE)},
+    [STAGE_MQTT] = {"mqtt", mqtt_init,
+                    BOOT_DEP(STAGE_WIFI) | BOOT_DEP(STAGE_MILIGHT) |
+                        BOOT_DEP(STAGE_ANIM) | BOOT_DEP(STAGE_SCENE) |
+                        BOOT_DEP(STAGE_SCHEDULE)},
+    [STAGE_OTA] = {"ota", ota_init,
+                   BOOT_DEP(STAGE_MQTT) | BOOT_DEP(STAGE_NVS) |
+                       BOOT_DEP(STAGE_OTA_DETAILS)},
+    [STAGE_TELEMETRY] = {"telemetry", telemetry_init,
+                         BOOT_DEP(STAGE_MQTT) | BOOT_DEP(STAGE_MILIGHT)},
+    [STAGE_SHADOW] = {"shadow", shadow_init, BOOT_DEP(STAGE_MQTT)},
+    [STAGE_IBOX] = {"ibox", ibox_init,
+                    BOOT_DEP(STAGE_WIFI) | BOOT_DEP(STAGE_MILIGHT) |
+                        BOOT_DEP(STAGE_ANIM)},
+};
 
-    // Depends on MQTT (and so, WiFi)
-    ESP_LOGI("MQTT", "Waiting for mqtt");
-    xEventGroupWaitBits(mqtt_event_group, MQTT_CONNECTED_BIT, false, true,
-                        portMAX_DELAY);
-    ota_init();
+void app_main() {
+    init_logging();
+    boot_run(stages, sizeof(stages) / sizeof(stages[0]));
 }
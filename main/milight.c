@@ -5,93 +5,303 @@
 // FreeRTOS includes
 #include "driver/gpio.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "ack.h"
+#include "frame.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
 #include "freertos/task.h"
 #include "i2c_slave.h"
-#include "soc/dport_reg.h"
-#include "soc/i2c_reg.h"
-#include "soc/i2c_struct.h"
+#include "queues.h"
+#include "shadow.h"
 
-// General command buffer is 5 bytes long, MSB is defined as the class.
-//
-// KEYS
-// ====
-//
-// To press a key, the command is
-// {0x02, 0x00, DATA, 0x00, 0x00}
-// The third byte is defined as a set of flags:
-// I2C 1                |  I2C 2
-// ------------------------------------------
-// MSB                  |  MSB
-// 7   - SPEED PLUS     |  7   - ZONE 04 OFF
-// 6   - MODE           |  6   - ZONE 04 ON
-// 5   - SPEED MINUS    |  5   - ZONE 01 OFF
-// 4   - GENERAL OFF    |  4   - ZONE 01 ON
-// 3   - GENERAL ON     |  3   - ZONE 03 OFF
-// 2   - Unused         |  2   - ZONE 03 ON
-// 1   - Unused         |  1   - ZONE 02 OFF
-// 0   - Unused         |  0   - ZONE 02 ON
-// LSB                  |  LSB
-// Set the byte to 0x00 to release the key
-//
-// SLIDERS
-// =======
-//
-// Colour wheel
-// ------------
-// On I2C 1
-// Command {0x03, DATA, 0x00, 0x00, 0x99}
-// DATA is ranged on 0x00 - 0xFF
-// 0x00 is blue
-// 0x22
-// 0x3C is red
-// 0x5E
-// 0x73 is yellow
-// 0x9F
-// 0xC3 is green
-// 0xE1
+// Frames are built by the codec in frame.c, which describes the protocol.
+
+static const char *TAG = "I2C";
+
+// Key scheduler
+// =============
 //
-// Temperature
-// -----------
-// On I2C 1
-// Class 2 also?
-// Command {0x06, 0x00, 0x00, 0x00, DATA}
-// DATA is ranged on (left) 0xA0 --- 0x00 (middle) --- 0x99 (right)
+// Each bus owns a queue of steps and an esp_timer. A step shows a frame for
+// hold_ms, then (if gap_ms is set) releases it with frame_release for gap_ms.
+// Callers only queue steps: the timer callback chains them, so that a burst
+// of clicks is played back to back without blocking anybody.
 //
-// Saturation + Luminosity
-// ----------
-// On I2C 2
-// The two sliders are two half sliders
-// Command {0x03, DATA, 0x00, 0x00, 0x00}
-// Saturation is ranged on 0x00 --- 0x7F
-// Temperature is ranged on 0X80 --- 0xFF
+// The bus is owned by whoever sets the busy flag: either the caller that
+// found the scheduler idle, or the timer callback. Only the owner publishes
+// frames, which keeps a single writer per I2C port.
 //
-static uint8_t no_touch[] = {0x02, 0x00, 0x00, 0x00, 0x00};
-// static int slider_template[] = {0x03, 0x00, 0x00, 0x00, 0x00};
+// Room in the queue is reserved through pending before a step is sent, so
+// that a sequence can claim all its slots at once, see scheduler_reserve().
 
-static const char *TAG = "I2C";
+typedef struct {
+    i2c_port_t i2c_num;
+    QueueHandle_t queue;
+    esp_timer_handle_t timer;
+    volatile uint32_t busy;
+    bool releasing;
+    milight_step_t current;
+    volatile UBaseType_t in_flight;
+    volatile uint32_t pending;  // Steps reserved or queued, not shown yet
+} key_scheduler_t;
+
+static key_scheduler_t schedulers[I2C_NUM_MAX];
+
+static StaticQueue_t scheduler_queues_struct[I2C_NUM_MAX];
+static uint8_t scheduler_queues_storage[I2C_NUM_MAX]
+                                       [CONFIG_MILIGHT_KEY_QUEUE_LENGTH *
+                                        sizeof(milight_step_t)];
+
+static bool is_click(const milight_step_t *step) {
+    return frame_is_key(step->frame) && step->gap_ms != 0;
+}
+
+#ifdef CONFIG_MILIGHT_MERGE_KEYS
+// Zone keys on bus 2 can be pressed together, as long as the same zone is
+// not switched on and off at once (ON/OFF pairs are bits 2n and 2n+1).
+static bool can_merge(const key_scheduler_t *sched, const milight_step_t *a,
+                      const milight_step_t *b) {
+    if (sched->i2c_num != I2C_NUM_1) return false;
+    if (!is_click(a) || !is_click(b) || a->hold_ms != b->hold_ms) return false;
+    uint8_t keys = a->frame[2] | b->frame[2];
+    if (a->frame[2] & b->frame[2]) return false;
+    return ((keys >> 1) & keys & 0x55) == 0;
+}
+#endif
+
+// Takes the next step out of the queue and publishes it. Must be called by
+// the owner of the bus. Returns false when there is nothing left to play.
+static bool scheduler_next(key_scheduler_t *sched) {
+    milight_step_t *step = &sched->current;
+    if (xQueueReceive(sched->queue, step, 0) != pdTRUE) return false;
+    UBaseType_t clicks = is_click(step) ? 1 : 0;
+    uint32_t steps = 1;
 
-static void send_click(i2c_port_t i2c_num, uint8_t button) {
-    uint8_t* keystate = get_keystate(i2c_num);
-    keystate[2] |= button;
-    vTaskDelay(10 / portTICK_PERIOD_MS);
-    keystate[2] ^= button;
-    vTaskDelay(10 / portTICK_PERIOD_MS);
+#ifdef CONFIG_MILIGHT_MERGE_KEYS
+    milight_step_t next;
+    while (xQueuePeek(sched->queue, &next, 0) == pdTRUE &&
+           can_merge(sched, step, &next)) {
+        xQueueReceive(sched->queue, &next, 0);
+        step->frame[2] |= next.frame[2];
+        clicks++;
+        steps++;
+    }
+#endif
+
+    sched->in_flight = clicks;
+    sched->releasing = false;
+    // The ISR on the other core may refill the FIFO as soon as the frame is
+    // published, the trace must be pending by then
+    latency_commit(sched->i2c_num, &step->trace);
+    i2c_slave_set_frame(sched->i2c_num, step->frame);
+    shadow_apply(sched->i2c_num, step->frame);
+    __atomic_sub_fetch(&sched->pending, steps, __ATOMIC_SEQ_CST);
+    // Intermediate slider frames are not commands of their own
+    if (step->gap_ms != 0) ack_expect(sched->i2c_num, step);
+    esp_timer_start_once(sched->timer, step->hold_ms * 1000ULL);
+    return true;
+}
+
+// Plays steps until the queue is drained, then gives the bus back. A step
+// queued right after the queue was found empty is picked up either here or
+// by its caller, whichever wins the busy flag.
+static void scheduler_run(key_scheduler_t *sched) {
+    while (!scheduler_next(sched)) {
+        sched->in_flight = 0;
+        __atomic_store_n(&sched->busy, 0, __ATOMIC_SEQ_CST);
+        if (uxQueueMessagesWaiting(sched->queue) == 0) return;
+        if (!__sync_bool_compare_and_swap(&sched->busy, 0, 1)) return;
+    }
 }
 
+static void scheduler_timer_cb(void *arg) {
+    key_scheduler_t *sched = (key_scheduler_t *)arg;
+
+    if (!sched->releasing && sched->current.gap_ms != 0) {
+        sched->releasing = true;
+        i2c_slave_set_frame(sched->i2c_num, frame_release);
+        esp_timer_start_once(sched->timer, sched->current.gap_ms * 1000ULL);
+        return;
+    }
+    scheduler_run(sched);
+}
+
+static void scheduler_init(i2c_port_t i2c_num) {
+    key_scheduler_t *sched = &schedulers[i2c_num];
+    sched->i2c_num = i2c_num;
+    sched->queue = xQueueCreateStatic(
+        CONFIG_MILIGHT_KEY_QUEUE_LENGTH, sizeof(milight_step_t),
+        scheduler_queues_storage[i2c_num], &scheduler_queues_struct[i2c_num]);
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = &scheduler_timer_cb,
+        .arg = sched,
+        .name = i2c_num == I2C_NUM_0 ? "keys_0" : "keys_1"};
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &sched->timer));
+}
+
+// Reserves room for count steps. pending is only decreased once steps are
+// out of the queue, so it never counts less than the queue holds: reserved
+// steps are always accepted.
+static bool scheduler_reserve(key_scheduler_t *sched, uint32_t count) {
+    uint32_t pending = __atomic_load_n(&sched->pending, __ATOMIC_SEQ_CST);
+    do {
+        if (pending + count > CONFIG_MILIGHT_KEY_QUEUE_LENGTH) return false;
+    } while (!__atomic_compare_exchange_n(&sched->pending, &pending,
+                                          pending + count, false,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+    return true;
+}
+
+// Queues a step the caller reserved room for
+static void scheduler_push(key_scheduler_t *sched,
+                           const milight_step_t *step) {
+    xQueueSend(sched->queue, step, 0);
+    if (__sync_bool_compare_and_swap(&sched->busy, 0, 1)) {
+        scheduler_run(sched);
+    }
+}
+
+esp_err_t send_step(int i2c_bus, const milight_step_t *step) {
+    key_scheduler_t *sched = &schedulers[i2c_bus];
+    if (!scheduler_reserve(sched, 1)) {
+        ESP_LOGW(TAG, "Key queue of bus %d is full, dropping frame", i2c_bus);
+        return ESP_ERR_TIMEOUT;
+    }
+    scheduler_push(sched, step);
+    return ESP_OK;
+}
+
+esp_err_t send_key(int i2c_bus, uint8_t keycode) {
+    milight_step_t step = {.hold_ms = CLICK_HOLD_MS, .gap_ms = CLICK_GAP_MS};
+    esp_err_t err = frame_encode_key(i2c_bus, keycode, step.frame);
+    if (err != ESP_OK) return err;
+    return send_step(i2c_bus, &step);
+}
+
+void milight_sequence_add(milight_sequence_step_t *steps, uint8_t *count,
+                          uint32_t *queued_ms, int bus, const uint8_t *frame,
+                          uint16_t hold_ms) {
+    uint32_t other_ms = queued_ms[bus == I2C_NUM_0 ? I2C_NUM_1 : I2C_NUM_0];
+    milight_sequence_step_t *step;
+    if (queued_ms[bus] < other_ms) {
+        step = &steps[(*count)++];
+        step->bus = bus;
+        memcpy(step->frame, frame_release, I2C_SLAVE_FRAME_SIZE);
+        step->hold_ms = other_ms - queued_ms[bus];
+        step->gap_ms = 0;
+        queued_ms[bus] = other_ms;
+    }
+    step = &steps[(*count)++];
+    step->bus = bus;
+    memcpy(step->frame, frame, I2C_SLAVE_FRAME_SIZE);
+    step->hold_ms = hold_ms;
+    step->gap_ms = CLICK_GAP_MS;
+    queued_ms[bus] += hold_ms + CLICK_GAP_MS;
+}
+
+esp_err_t milight_sequence_play(const milight_sequence_step_t *steps,
+                                int count, const latency_trace_t *trace) {
+    // Half a sequence would leave the zone and sliders in between states,
+    // so every slot is reserved before the first step is queued
+    uint32_t needed[I2C_NUM_MAX] = {0, 0};
+    for (int i = 0; i < count; i++) needed[steps[i].bus]++;
+    for (int i2c_bus = 0; i2c_bus < I2C_NUM_MAX; i2c_bus++) {
+        if (!scheduler_reserve(&schedulers[i2c_bus], needed[i2c_bus])) {
+            ESP_LOGW(TAG, "Key queue of bus %d is full, dropping sequence",
+                     i2c_bus);
+            for (int i = 0; i < i2c_bus; i++) {
+                __atomic_sub_fetch(&schedulers[i].pending, needed[i],
+                                   __ATOMIC_SEQ_CST);
+            }
+            return ESP_ERR_TIMEOUT;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        milight_step_t step = {.hold_ms = steps[i].hold_ms,
+                               .gap_ms = steps[i].gap_ms};
+        // The sequence is one command, done once its last step is read
+        if (i == count - 1) step.trace = *trace;
+        memcpy(step.frame, steps[i].frame, I2C_SLAVE_FRAME_SIZE);
+        scheduler_push(&schedulers[steps[i].bus], &step);
+    }
+    return ESP_OK;
+}
+
+UBaseType_t milight_queue_depth(int i2c_bus) {
+    return uxQueueMessagesWaiting(schedulers[i2c_bus].queue);
+}
+
+UBaseType_t milight_clicks_in_flight(int i2c_bus) {
+    return schedulers[i2c_bus].in_flight;
+}
+
+bool milight_settled(void) {
+    for (int i2c_bus = 0; i2c_bus < I2C_NUM_MAX; i2c_bus++) {
+        if (__atomic_load_n(&schedulers[i2c_bus].pending,
+                            __ATOMIC_SEQ_CST) != 0) {
+            return false;
+        }
+    }
+    return uxQueueMessagesWaiting(dispatcher_queues[QUEUE_KEY]) == 0;
+}
+
+esp_err_t send_slider(enum milight_slider slider, uint8_t value,
+                      uint16_t hold_ms, bool release,
+                      const latency_trace_t *trace) {
+    milight_step_t step = {.hold_ms = hold_ms,
+                           .gap_ms = release ? CLICK_GAP_MS : 0};
+    int i2c_bus = frame_encode_slider(slider, value, step.frame);
+    if (i2c_bus < 0) return ESP_ERR_INVALID_ARG;
+    if (trace != NULL) step.trace = *trace;
+    return send_step(i2c_bus, &step);
+}
+
+// Plays the key commands coming from dispatcher_queues
+#define MILIGHT_COMMAND_STACK_SIZE 2048
+StaticTask_t milight_command_buffer;
+StackType_t milight_command_stack[MILIGHT_COMMAND_STACK_SIZE];
+static void milight_command_task(void *pvParameter) {
+    while (1) {
+        struct key_command cmd;
+        if (xQueueReceive(dispatcher_queues[QUEUE_KEY], &cmd,
+                          portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        latency_mark(&cmd.trace, LATENCY_DISPATCHED);
+        milight_step_t step = {.hold_ms = CLICK_HOLD_MS,
+                               .gap_ms = CLICK_GAP_MS,
+                               .trace = cmd.trace};
+        if (frame_encode_key(cmd.bus, cmd.keycode, step.frame) != ESP_OK) {
+            ESP_LOGE(TAG, "Key 0x%02x is not on bus %d", cmd.keycode,
+                     cmd.bus);
+            continue;
+        }
+        // Steps still queued are not in the shadow yet
+        if (milight_settled() && shadow_redundant(cmd.bus, step.frame)) {
+            ESP_LOGD(TAG, "Key 0x%02x would not change anything, dropped",
+                     cmd.keycode);
+            continue;
+        }
+        send_step(cmd.bus, &step);
+    }
+}
+
+#ifdef CONFIG_MILIGHT_KEYPRESS_SIMULATOR
 #define KEYPRESS_SIMULATOR_STACK_SIZE 2048
 StaticTask_t keypress_simulator_buffer;
 StackType_t keypress_simulator_stack[KEYPRESS_SIMULATOR_STACK_SIZE];
 static void keypress_simulator(void *pvParameter) {
     while (1) {
         ESP_LOGI(TAG, "GENERAL ON");
-        send_click(0, GENERAL_ON);
+        send_key(I2C_NUM_0, GENERAL_ON);
         vTaskDelay(500 / portTICK_PERIOD_MS);
         ESP_LOGI(TAG, "GENERAL OFF");
-        send_click(0, GENERAL_OFF);
+        send_key(I2C_NUM_0, GENERAL_OFF);
         vTaskDelay(500 / portTICK_PERIOD_MS);
     }
 }
+#endif
 
 void milight_init() {
     // Configure I2C slaves
@@ -120,6 +330,9 @@ void milight_init() {
     ESP_ERROR_CHECK(i2c_slave_driver_install(i2c_slave_1));
     ESP_ERROR_CHECK(i2c_slave_driver_install(i2c_slave_2));
 
+    scheduler_init(i2c_slave_1);
+    scheduler_init(i2c_slave_2);
+
     // Configure Interrupt pins and LED/ACK pin
     gpio_config_t conf_int = {
         .intr_type = GPIO_INTR_DISABLE,
@@ -128,6 +341,8 @@ void milight_init() {
         .pull_down_en = 0,
         .pull_up_en = 1};
     gpio_config(&conf_int);
+    i2c_slave_set_int_pin(i2c_slave_1, PIN_NUM_INT1);
+    i2c_slave_set_int_pin(i2c_slave_2, PIN_NUM_INT2);
 
     gpio_config_t conf_led = {.intr_type = GPIO_INTR_DISABLE,
                               .mode = GPIO_MODE_INPUT,
@@ -135,8 +350,16 @@ void milight_init() {
                               .pull_down_en = 0,
                               .pull_up_en = 0};
     gpio_config(&conf_led);
+    ack_init();
+
+    xTaskCreateStatic(&milight_command_task, "milight_command",
+                      MILIGHT_COMMAND_STACK_SIZE, NULL,
+                      tskIDLE_PRIORITY + 2, milight_command_stack,
+                      &milight_command_buffer);
 
+#ifdef CONFIG_MILIGHT_KEYPRESS_SIMULATOR
     xTaskCreateStatic(&keypress_simulator, "keypress_simulator",
                       KEYPRESS_SIMULATOR_STACK_SIZE, NULL, tskIDLE_PRIORITY + 1,
                       keypress_simulator_stack, &keypress_simulator_buffer);
+#endif
 }
@@ -1,6 +1,10 @@
 #pragma once
 
 #include "driver/i2c.h"
+#include "frame.h"
+#include "freertos/FreeRTOS.h"
+#include "i2c_slave.h"
+#include "latency.h"
 
 #define I2C_MILIGHT_SLAVE_ADDR 0x53
 #define I2C_SLAVE_RX_BUF_LEN 512
@@ -8,7 +12,69 @@
 
 void milight_init();
 
-void send_key(int i2c_bus, uint8_t keycode);
+// Timing of a key click
+#define CLICK_HOLD_MS 10
+#define CLICK_GAP_MS 10
+
+// A frame shown to the remote MCU for hold_ms. If gap_ms is not 0, the keys
+// are released afterwards and the bus stays idle for gap_ms. attempt counts
+// the times the step was played before without being acked, see ack.h.
+typedef struct {
+    uint8_t frame[I2C_SLAVE_FRAME_SIZE];
+    uint8_t attempt;
+    uint16_t hold_ms;
+    uint16_t gap_ms;
+    latency_trace_t trace;
+} milight_step_t;
+
+// Both queue their frames on the bus scheduler and return right away, or
+// fail with ESP_ERR_TIMEOUT if the bus queue is full.
+esp_err_t send_key(int i2c_bus, uint8_t keycode);
+esp_err_t send_step(int i2c_bus, const milight_step_t *step);
+
+// Moves a slider to value for hold_ms. The finger is lifted afterwards if
+// release is set, otherwise the frame stays until the next one on the bus.
+esp_err_t send_slider(enum milight_slider slider, uint8_t value,
+                      uint16_t hold_ms, bool release,
+                      const latency_trace_t *trace);
+
+// A step of a sequence, see milight_sequence_add()
+typedef struct {
+    uint8_t bus;
+    uint8_t frame[I2C_SLAVE_FRAME_SIZE];
+    uint16_t hold_ms;
+    uint16_t gap_ms;
+} milight_sequence_step_t;
+
+// Appends the step showing frame on bus for hold_ms, then releasing the
+// keys, to a sequence of count steps. The buses play their steps
+// independently: when the other bus has more time queued, bus first waits
+// on released keys so that the steps are shown in the order they are
+// appended. queued_ms is the time queued on each bus by the sequence, from
+// {0, 0}. Appends up to 2 steps.
+//
+// The waits assume both buses are idle when the sequence is played: steps
+// already queued on one bus delay the whole sequence there, and may let
+// the other bus show its steps too early.
+void milight_sequence_add(milight_sequence_step_t *steps, uint8_t *count,
+                          uint32_t *queued_ms, int bus, const uint8_t *frame,
+                          uint16_t hold_ms);
+
+// Queues the steps of a sequence on their bus. Fails with ESP_ERR_TIMEOUT,
+// queuing none of them, if either bus queue has no room for all its steps.
+// trace goes with the last step, the sequence counts as one command.
+esp_err_t milight_sequence_play(const milight_sequence_step_t *steps,
+                                int count, const latency_trace_t *trace);
+
+// Number of steps waiting on a bus, and of clicks currently being played.
+UBaseType_t milight_queue_depth(int i2c_bus);
+UBaseType_t milight_clicks_in_flight(int i2c_bus);
+
+// True when no key waits in QUEUE_KEY and every step queued on both buses
+// has been shown to the remote, so that the shadow (see shadow.h) is up to
+// date. Both buses matter: zone keys on one change the zone the sliders
+// of the other act on.
+bool milight_settled(void);
 
 // GPIO Definition
 #define PIN_NUM_SDA1 12
@@ -18,21 +84,3 @@ void send_key(int i2c_bus, uint8_t keycode);
 #define PIN_NUM_INT1 33
 #define PIN_NUM_INT2 26
 #define PIN_NUM_LED 25
-
-#define RELEASE_KEY 0x00
-// Keycode defines for I2C 1
-#define GENERAL_ON (0x01 << 3)
-#define GENERAL_OFF (0x01 << 4)
-#define SPEED_MINUS (0x01 << 5)
-#define MODE (0x01 << 6)
-#define SPEED_PLUS (0x01 << 7)
-
-// Keycode defines for I2C 2
-#define ZONE_01_OFF (0x01 << 5)
-#define ZONE_01_ON (0x01 << 4)
-#define ZONE_02_OFF (0x01 << 1)
-#define ZONE_02_ON (0x01 << 0)
-#define ZONE_03_OFF (0x01 << 3)
-#define ZONE_03_ON (0x01 << 2)
-#define ZONE_04_OFF (0x01 << 7)
-#define ZONE_04_ON (0x01 << 6)
@@ -2,17 +2,27 @@
 
 #include <ctype.h>
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "boot.h"
+#include "capture.h"
 #include "esp_log.h"
 #include "freertos/FreeRTOS.h"
+#include "logs.h"
+#include "milight.h"
 #include "mqtt_client.h"
+#include "ota.h"
 #include "queues.h"
+#include "scene.h"
+#include "schedule.h"
 #include "wifi.h"
 
 static const char *TAG = "MQTT";
 #define MQTT_PAYLOAD_MAX_SIZE_BYTES 256
-#define TOPIC_OTA CONFIG_MQTT_PREFIX "/ota"
-#define TOPIC_LOGS CONFIG_MQTT_PREFIX "/logs"
+#define TOPIC_PREFIX CONFIG_MQTT_PREFIX "/"
+#define TOPIC_PREFIX_LEN (sizeof(TOPIC_PREFIX) - 1)
 
 // MQTT Client
 static esp_mqtt_client_handle_t client;
@@ -20,46 +30,502 @@ static esp_mqtt_client_handle_t client;
 // MQTT event group
 EventGroupHandle_t mqtt_event_group;
 
+// Topic dispatch
+// ==============
+//
+// Every topic handled by the device is a suffix under TOPIC_PREFIX, listed
+// in topics[] with its handler, target queue and two handler arguments.
+// The table is kept sorted by hand so that a topic is found by binary
+// search, and the subscriptions are derived from it: "group/name" suffixes
+// are subscribed to as "group/+", others as is. Payloads:
+// - key/<name>: ignored
+// - slider/<name>: "value[,duration_ms]" in decimal
+// - anim/stop, anim/sweep, anim/crossfade: "", "period_ms" and
+//   "wheel,luminosity,duration_ms"
+// - capture/dump: ignored, publishes the I2C capture
+// - color/hue, color/rgb: "degrees[,duration_ms]" and "r,g,b[,duration_ms]",
+//   moving the colour wheel
+// - firmware/begin: "size,sha256" of an image pushed over MQTT
+// - firmware/chunk: image chunk, see ota.h
+// - ota: firmware URL
+// - raw/<bus>: "frame[,hold_ms]", frame being 5 bytes in hex, sent as is.
+//   Key frames are clicks, released after hold_ms (CLICK_HOLD_MS by
+//   default); other frames stay until the next one on the bus.
+// - scene/define: "id,zone,on[,slider=value...]", zone 0 being every zone
+//   and slider one of the slider/<name> names, e.g. "3,2,1,wheel=60"
+// - scene/delete, scene/recall: "id"
+// - schedule/set: "id,hour,minute,days,action,arg[,arg2]", see
+//   schedule_rule_t, e.g. "0,7,30,62,2,3" recalls scene 3 on weekdays
+// - schedule/delete: "id"
+typedef struct mqtt_topic mqtt_topic_t;
+typedef void (*mqtt_handler_t)(esp_mqtt_event_handle_t event,
+                               const mqtt_topic_t *topic,
+                               const latency_trace_t *trace);
+
+struct mqtt_topic {
+    const char *suffix;
+    mqtt_handler_t handler;
+    enum queue_index queue;
+    uint8_t arg;
+    uint8_t arg2;
+};
+
+static void mqtt_on_anim(esp_mqtt_event_handle_t event,
+                         const mqtt_topic_t *topic,
+                         const latency_trace_t *trace);
+#ifdef CONFIG_MILIGHT_I2C_CAPTURE
+static void mqtt_on_capture(esp_mqtt_event_handle_t event,
+                            const mqtt_topic_t *topic,
+                            const latency_trace_t *trace);
+#endif
+static void mqtt_on_color(esp_mqtt_event_handle_t event,
+                          const mqtt_topic_t *topic,
+                          const latency_trace_t *trace);
+static void mqtt_on_firmware_chunk(esp_mqtt_event_handle_t event,
+                                   const mqtt_topic_t *topic,
+                                   const latency_trace_t *trace);
+static void mqtt_on_key(esp_mqtt_event_handle_t event,
+                        const mqtt_topic_t *topic,
+                        const latency_trace_t *trace);
+static void mqtt_on_ota(esp_mqtt_event_handle_t event,
+                        const mqtt_topic_t *topic,
+                        const latency_trace_t *trace);
+static void mqtt_on_raw(esp_mqtt_event_handle_t event,
+                        const mqtt_topic_t *topic,
+                        const latency_trace_t *trace);
+static void mqtt_on_scene(esp_mqtt_event_handle_t event,
+                          const mqtt_topic_t *topic,
+                          const latency_trace_t *trace);
+#ifdef CONFIG_MILIGHT_SCHEDULE
+static void mqtt_on_schedule(esp_mqtt_event_handle_t event,
+                             const mqtt_topic_t *topic,
+                             const latency_trace_t *trace);
+#endif
+static void mqtt_on_slider(esp_mqtt_event_handle_t event,
+                           const mqtt_topic_t *topic,
+                           const latency_trace_t *trace);
+
+#define ANIM(name, type) {"anim/" name, mqtt_on_anim, QUEUE_ANIM, type, 0}
+#define KEY(name, bus, keycode) \
+    {"key/" name, mqtt_on_key, QUEUE_KEY, bus, keycode}
+#define SCENE(name, action) \
+    {"scene/" name, mqtt_on_scene, QUEUE_NONE, action, 0}
+#define SLIDER(name, slider) \
+    {"slider/" name, mqtt_on_slider, QUEUE_SLIDER(slider), slider, 0}
+
+enum scene_action {
+    SCENE_DEFINE,
+    SCENE_DELETE,
+    SCENE_RECALL,
+};
+
+// Keep sorted (strcmp order): mqtt_init() aborts on an entry out of order,
+// which the binary search would silently miss
+static const mqtt_topic_t topics[] = {
+    ANIM("crossfade", ANIM_CROSSFADE),
+    ANIM("stop", ANIM_STOP),
+    ANIM("sweep", ANIM_SWEEP),
+#ifdef CONFIG_MILIGHT_I2C_CAPTURE
+    {"capture/dump", mqtt_on_capture, QUEUE_NONE, 0, 0},
+#endif
+    {"color/hue", mqtt_on_color, QUEUE_SLIDER(SLIDER_WHEEL), 1, 0},
+    {"color/rgb", mqtt_on_color, QUEUE_SLIDER(SLIDER_WHEEL), 3, 0},
+    {"firmware/begin", mqtt_on_ota, QUEUE_OTA, 1, 0},
+    {"firmware/chunk", mqtt_on_firmware_chunk, QUEUE_NONE, 0, 0},
+    KEY("general_off", I2C_NUM_0, GENERAL_OFF),
+    KEY("general_on", I2C_NUM_0, GENERAL_ON),
+    KEY("mode", I2C_NUM_0, MODE),
+    KEY("speed_minus", I2C_NUM_0, SPEED_MINUS),
+    KEY("speed_plus", I2C_NUM_0, SPEED_PLUS),
+    KEY("zone_01_off", I2C_NUM_1, ZONE_01_OFF),
+    KEY("zone_01_on", I2C_NUM_1, ZONE_01_ON),
+    KEY("zone_02_off", I2C_NUM_1, ZONE_02_OFF),
+    KEY("zone_02_on", I2C_NUM_1, ZONE_02_ON),
+    KEY("zone_03_off", I2C_NUM_1, ZONE_03_OFF),
+    KEY("zone_03_on", I2C_NUM_1, ZONE_03_ON),
+    KEY("zone_04_off", I2C_NUM_1, ZONE_04_OFF),
+    KEY("zone_04_on", I2C_NUM_1, ZONE_04_ON),
+    {"ota", mqtt_on_ota, QUEUE_OTA, 0, 0},
+    {"raw/0", mqtt_on_raw, QUEUE_NONE, I2C_NUM_0, 0},
+    {"raw/1", mqtt_on_raw, QUEUE_NONE, I2C_NUM_1, 0},
+    SCENE("define", SCENE_DEFINE),
+    SCENE("delete", SCENE_DELETE),
+    SCENE("recall", SCENE_RECALL),
+#ifdef CONFIG_MILIGHT_SCHEDULE
+    {"schedule/delete", mqtt_on_schedule, QUEUE_NONE, 0, 0},
+    {"schedule/set", mqtt_on_schedule, QUEUE_NONE, 1, 0},
+#endif
+    SLIDER("luminosity", SLIDER_LUMINOSITY),
+    SLIDER("saturation", SLIDER_SATURATION),
+    SLIDER("temperature", SLIDER_TEMPERATURE),
+    SLIDER("wheel", SLIDER_WHEEL),
+};
+#define TOPICS_LENGTH (sizeof(topics) / sizeof(topics[0]))
+
+// Compares a suffix that is not NUL terminated with a table entry
+static int topic_cmp(const char *suffix, int suffix_len, const char *entry) {
+    int entry_len = strlen(entry);
+    int cmp = memcmp(suffix, entry,
+                     suffix_len < entry_len ? suffix_len : entry_len);
+    return cmp != 0 ? cmp : suffix_len - entry_len;
+}
+
+static const mqtt_topic_t *topic_lookup(const char *topic, int topic_len) {
+    if (topic_len <= (int)TOPIC_PREFIX_LEN ||
+        memcmp(topic, TOPIC_PREFIX, TOPIC_PREFIX_LEN) != 0) {
+        return NULL;
+    }
+    const char *suffix = topic + TOPIC_PREFIX_LEN;
+    int suffix_len = topic_len - TOPIC_PREFIX_LEN;
+
+    int low = 0;
+    int high = TOPICS_LENGTH - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        int cmp = topic_cmp(suffix, suffix_len, topics[mid].suffix);
+        if (cmp == 0) return &topics[mid];
+        if (cmp < 0) {
+            high = mid - 1;
+        } else {
+            low = mid + 1;
+        }
+    }
+    return NULL;
+}
+
 static void mqtt_subscribe() {
-    int msg_id;
-    msg_id = esp_mqtt_client_subscribe(client, TOPIC_OTA, 0);
-    ESP_LOGI(TAG, "Subscribed to (%s), msg_id=%d", TOPIC_OTA, msg_id);
+    char filter[64];
+    int group_len = -1;
+    for (size_t i = 0; i < TOPICS_LENGTH; i++) {
+        const char *suffix = topics[i].suffix;
+        const char *slash = strchr(suffix, '/');
+        if (slash == NULL) {
+            group_len = -1;
+            snprintf(filter, sizeof(filter), "%s%s", TOPIC_PREFIX, suffix);
+        } else if (group_len == slash - suffix &&
+                   memcmp(filter + TOPIC_PREFIX_LEN, suffix, group_len) ==
+                       0) {
+            // Already subscribed to this group
+            continue;
+        } else {
+            group_len = slash - suffix;
+            snprintf(filter, sizeof(filter), "%s%.*s+", TOPIC_PREFIX,
+                     group_len + 1, suffix);
+        }
+        int msg_id = esp_mqtt_client_subscribe(client, filter, 0);
+        ESP_LOGI(TAG, "Subscribed to (%s), msg_id=%d", filter, msg_id);
+    }
 }
 
-static void mqtt_parse_payload(esp_mqtt_event_handle_t event) {
-    printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
-    // Sanity check
-    if (event->data_len >= MQTT_PAYLOAD_MAX_SIZE_BYTES - 1) {
-        ESP_LOGI(TAG, "Payload is larger than buffer!");
+// Parses comma separated decimal numbers from a payload that is not NUL
+// terminated, each one bounded by max. Returns how many were read, or -1 if
+// the payload is invalid.
+static int parse_uints(const char *data, int data_len, uint32_t max,
+                       uint32_t *values, int values_len) {
+    int count = 0;
+    int i = 0;
+    while (i < data_len && count < values_len) {
+        uint32_t value = 0;
+        int digits = 0;
+        for (; i < data_len && isdigit((unsigned char)data[i]); i++) {
+            value = value * 10 + (data[i] - '0');
+            if (++digits > 5 || value > max) return -1;
+        }
+        if (digits == 0) return -1;
+        values[count++] = value;
+        if (i < data_len && data[i++] != ',') return -1;
+    }
+    return i == data_len ? count : -1;
+}
+
+static void mqtt_dispatch(const mqtt_topic_t *topic, const void *cmd) {
+    if (topic->queue == QUEUE_NONE) {
+        ESP_LOGE(TAG, "No queue for %s", topic->suffix);
+        return;
+    }
+    if (xQueueSend(dispatcher_queues[topic->queue], cmd,
+                   500 / portTICK_PERIOD_MS) != pdTRUE) {
+        ESP_LOGI(TAG, "Queue is not available, ignoring message");
+    }
+}
+
+static void mqtt_on_key(esp_mqtt_event_handle_t event,
+                        const mqtt_topic_t *topic,
+                        const latency_trace_t *trace) {
+    struct key_command cmd = {
+        .bus = topic->arg, .keycode = topic->arg2, .trace = *trace};
+    mqtt_dispatch(topic, &cmd);
+}
+
+static void mqtt_on_slider(esp_mqtt_event_handle_t event,
+                           const mqtt_topic_t *topic,
+                           const latency_trace_t *trace) {
+    uint32_t values[2] = {0, 0};
+    int count =
+        parse_uints(event->data, event->data_len, UINT16_MAX, values, 2);
+    if (count < 1 || !frame_slider_valid(topic->arg, values[0])) {
+        ESP_LOGE(TAG, "Invalid %s value \"%.*s\"", topic->suffix,
+                 event->data_len, event->data);
         return;
     }
+    struct slider_command cmd = {.slider = topic->arg,
+                                 .value = values[0],
+                                 .duration_ms = values[1],
+                                 .trace = *trace};
+    queues_post_slider(&cmd);
+}
 
-    if (memcmp(event->topic, TOPIC_OTA, event->topic_len) == 0) {
-        ESP_LOGI(TAG, "OTA update!");
-        char *payload = pvPortMalloc(sizeof(char) * QUEUE_SIZE_OTA);
-        if (payload == NULL) {
-            ESP_LOGE(TAG, "Could not allocate memory to get MQTT payload");
-            return;
+// arg is the number of colour components: 1 for a hue, 3 for RGB
+static void mqtt_on_color(esp_mqtt_event_handle_t event,
+                          const mqtt_topic_t *topic,
+                          const latency_trace_t *trace) {
+    uint32_t values[4] = {0, 0, 0, 0};
+    int count =
+        parse_uints(event->data, event->data_len, UINT16_MAX, values, 4);
+    int wheel = -1;
+    if (count == topic->arg || count == topic->arg + 1) {
+        if (topic->arg == 1) {
+            wheel = frame_wheel_from_hue(values[0]);
+        } else if (values[0] <= 0xFF && values[1] <= 0xFF &&
+                   values[2] <= 0xFF) {
+            wheel = frame_wheel_from_rgb(values[0], values[1], values[2]);
         }
-        memcpy(payload, event->data, sizeof(char) * event->data_len);
-        payload[event->data_len] = '\0';
-        if (xQueueSend(dispatcher_queues[QUEUE_OTA], (void *)payload,
-                       500 / portTICK_PERIOD_MS) != pdTRUE) {
-            ESP_LOGI(TAG, "Queue is not available, ignoring message");
+    }
+    if (wheel < 0) {
+        ESP_LOGE(TAG, "Invalid %s value \"%.*s\"", topic->suffix,
+                 event->data_len, event->data);
+        return;
+    }
+    struct slider_command cmd = {.slider = SLIDER_WHEEL,
+                                 .value = wheel,
+                                 .duration_ms = values[topic->arg],
+                                 .trace = *trace};
+    queues_post_slider(&cmd);
+}
+
+static void mqtt_on_anim(esp_mqtt_event_handle_t event,
+                         const mqtt_topic_t *topic,
+                         const latency_trace_t *trace) {
+    struct anim_command cmd = {.type = topic->arg};
+    uint32_t values[3] = {0, 0, 0};
+    int count =
+        parse_uints(event->data, event->data_len, UINT16_MAX, values, 3);
+
+    bool valid = count >= 0;
+    if (cmd.type == ANIM_SWEEP) {
+        valid = count == 1;
+        cmd.period_ms = values[0];
+    } else if (cmd.type == ANIM_CROSSFADE) {
+        valid = count == 3 && values[0] <= 0xFF && values[1] <= 0x7F;
+        cmd.wheel = values[0];
+        cmd.luminosity = values[1];
+        cmd.period_ms = values[2];
+    }
+    if (!valid) {
+        ESP_LOGE(TAG, "Invalid %s parameters \"%.*s\"", topic->suffix,
+                 event->data_len, event->data);
+        return;
+    }
+    mqtt_dispatch(topic, &cmd);
+}
+
+// arg is set for images pushed over MQTT, which are queued with their size
+// and hash behind OTA_MQTT_SCHEME
+static void mqtt_on_ota(esp_mqtt_event_handle_t event,
+                        const mqtt_topic_t *topic,
+                        const latency_trace_t *trace) {
+    ESP_LOGI(TAG, "OTA update!");
+    // Only the MQTT task gets here, a single static buffer is enough
+    static char payload[QUEUE_SIZE_OTA];
+    int len = snprintf(payload, sizeof(payload), "%s%.*s",
+                       topic->arg ? OTA_MQTT_SCHEME : "", event->data_len,
+                       event->data);
+    if (len >= (int)sizeof(payload)) return;
+    mqtt_dispatch(topic, payload);
+}
+
+// Raw frames bypass QUEUE_KEY: they go straight to the key scheduler of
+// the bus, which never blocks
+static void mqtt_on_raw(esp_mqtt_event_handle_t event,
+                        const mqtt_topic_t *topic,
+                        const latency_trace_t *trace) {
+    milight_step_t step = {.hold_ms = 0, .trace = *trace};
+    bool hold_set = false;
+    int len = event->data_len;
+    bool valid = len >= I2C_SLAVE_FRAME_SIZE * 2;
+    for (int i = 0; valid && i < I2C_SLAVE_FRAME_SIZE * 2; i++) {
+        char c = tolower((unsigned char)event->data[i]);
+        int nibble = isdigit((unsigned char)c) ? c - '0'
+                     : c >= 'a' && c <= 'f'     ? c - 'a' + 10
+                                                : -1;
+        valid = nibble >= 0;
+        step.frame[i / 2] = step.frame[i / 2] << 4 | nibble;
+    }
+    if (valid && len > I2C_SLAVE_FRAME_SIZE * 2) {
+        uint32_t hold_ms = 0;
+        valid = event->data[I2C_SLAVE_FRAME_SIZE * 2] == ',' &&
+                parse_uints(event->data + I2C_SLAVE_FRAME_SIZE * 2 + 1,
+                            len - I2C_SLAVE_FRAME_SIZE * 2 - 1, UINT16_MAX,
+                            &hold_ms, 1) == 1;
+        step.hold_ms = hold_ms;
+        hold_set = true;
+    }
+    frame_command_t cmd;
+    if (!valid || !frame_decode(topic->arg, step.frame, &cmd)) {
+        ESP_LOGE(TAG, "Invalid %s frame \"%.*s\"", topic->suffix,
+                 event->data_len, event->data);
+        return;
+    }
+    // A latched key would be a long press
+    if (cmd.kind == FRAME_KEY) {
+        if (!hold_set) step.hold_ms = CLICK_HOLD_MS;
+        step.gap_ms = CLICK_GAP_MS;
+    }
+    latency_mark(&step.trace, LATENCY_DISPATCHED);
+    send_step(topic->arg, &step);
+}
+
+// Parses the "slider=value" fields following "id,zone,on". Returns false if
+// one of them is invalid, values being checked by scene_define().
+static bool parse_scene_sliders(const char *data, int data_len,
+                                scene_spec_t *spec) {
+    int i = 0;
+    while (i < data_len) {
+        int end = i;
+        while (end < data_len && data[end] != ',') end++;
+        const char *eq = memchr(data + i, '=', end - i);
+        if (eq == NULL) return false;
+        int name_len = eq - (data + i);
+        int slider = 0;
+        for (; slider < SLIDER_LENGTH; slider++) {
+            if (topic_cmp(data + i, name_len,
+                          frame_slider_names[slider]) == 0) {
+                break;
+            }
+        }
+        uint32_t value;
+        if (slider == SLIDER_LENGTH ||
+            parse_uints(eq + 1, data + end - eq - 1, INT16_MAX, &value,
+                        1) != 1) {
+            return false;
         }
-        vPortFree(payload);
-    } else {
-        ESP_LOGE(TAG, "Error, unhandled message from topic \"%s\"",
-                 event->topic);
+        spec->slider[slider] = value;
+        i = end + 1;
+    }
+    return true;
+}
+
+// Scenes are played from the MQTT task: recalling one only queues its
+// steps on the bus schedulers, which never blocks
+static void mqtt_on_scene(esp_mqtt_event_handle_t event,
+                          const mqtt_topic_t *topic,
+                          const latency_trace_t *trace) {
+    uint32_t values[3] = {0, 0, 0};
+    int len = event->data_len;
+    esp_err_t err = ESP_ERR_INVALID_ARG;
+    if (topic->arg == SCENE_DEFINE) {
+        // The numbers end at the first named field
+        const char *eq = memchr(event->data, '=', len);
+        int numbers_len = len;
+        if (eq != NULL) {
+            const char *comma = eq;
+            while (comma > event->data && *comma != ',') comma--;
+            numbers_len = comma - event->data;
+        }
+        scene_spec_t spec;
+        for (int i = 0; i < SLIDER_LENGTH; i++) spec.slider[i] = -1;
+        if (parse_uints(event->data, numbers_len, UINT8_MAX, values, 3) ==
+                3 &&
+            values[2] <= 1 &&
+            (numbers_len == len ||
+             parse_scene_sliders(event->data + numbers_len + 1,
+                                 len - numbers_len - 1, &spec))) {
+            spec.zone = values[1];
+            spec.on = values[2];
+            err = scene_define(values[0], &spec);
+        }
+    } else if (parse_uints(event->data, len, UINT8_MAX, values, 1) == 1) {
+        if (topic->arg == SCENE_DELETE) {
+            err = scene_delete(values[0]);
+        } else {
+            latency_trace_t recall = *trace;
+            latency_mark(&recall, LATENCY_DISPATCHED);
+            err = scene_recall(values[0], &recall);
+        }
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Cannot %s \"%.*s\": %s", topic->suffix, len,
+                 event->data, esp_err_to_name(err));
+    }
+}
+
+#ifdef CONFIG_MILIGHT_SCHEDULE
+// arg is set for schedule/set
+static void mqtt_on_schedule(esp_mqtt_event_handle_t event,
+                             const mqtt_topic_t *topic,
+                             const latency_trace_t *trace) {
+    uint32_t values[7] = {0, 0, 0, 0, 0, 0, 0};
+    int count =
+        parse_uints(event->data, event->data_len, UINT8_MAX, values, 7);
+    esp_err_t err = ESP_ERR_INVALID_ARG;
+    if (!topic->arg && count == 1) {
+        err = schedule_delete(values[0]);
+    } else if (topic->arg && count >= 6 && values[1] < 24 &&
+               values[2] < 60) {
+        schedule_rule_t rule = {.minute = values[1] * 60 + values[2],
+                                .days = values[3],
+                                .action = values[4],
+                                .arg = values[5],
+                                .arg2 = values[6]};
+        err = schedule_set(values[0], &rule);
     }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Cannot %s \"%.*s\": %s", topic->suffix,
+                 event->data_len, event->data, esp_err_to_name(err));
+    }
+}
+#endif
+
+#ifdef CONFIG_MILIGHT_I2C_CAPTURE
+static void mqtt_on_capture(esp_mqtt_event_handle_t event,
+                            const mqtt_topic_t *topic,
+                            const latency_trace_t *trace) {
+    capture_dump();
+}
+#endif
+
+static void mqtt_on_firmware_chunk(esp_mqtt_event_handle_t event,
+                                   const mqtt_topic_t *topic,
+                                   const latency_trace_t *trace) {
+    ota_mqtt_chunk((const uint8_t *)event->data, event->data_len);
+}
+
+static void mqtt_parse_payload(esp_mqtt_event_handle_t event) {
+    latency_trace_t trace = {0};
+    latency_mark(&trace, LATENCY_MQTT_RX);
+    ESP_LOGD(TAG, "TOPIC=%.*s", event->topic_len, event->topic);
+
+    const mqtt_topic_t *topic = topic_lookup(event->topic, event->topic_len);
+    if (topic == NULL) {
+        ESP_LOGE(TAG, "Error, unhandled message from topic \"%.*s\"",
+                 event->topic_len, event->topic);
+        return;
+    }
+
+    // Sanity check, firmware chunks are the only large payloads
+    int max_len = topic->handler == mqtt_on_firmware_chunk
+                      ? OTA_MQTT_HEADER_SIZE + OTA_MQTT_CHUNK_SIZE
+                      : MQTT_PAYLOAD_MAX_SIZE_BYTES - 2;
+    if (event->data_len > max_len || event->data_len != event->total_data_len) {
+        ESP_LOGI(TAG, "Payload is larger than buffer!");
+        return;
+    }
+    topic->handler(event, topic, &trace);
 }
 
-static int mqtt_vprintf(const char *fmt, va_list ap) {
-    // Get the formatted string
-    char buf[256];
-    int bufsz = vsprintf(buf, fmt, ap);
-    esp_mqtt_client_publish(client, TOPIC_LOGS, buf, bufsz, 1, 0);
-    return bufsz;
+int mqtt_publish(const char *topic, const char *data, int len, int qos,
+                 int retain) {
+    return esp_mqtt_client_publish(client, topic, data, len, qos, retain);
 }
 
 // MQTT event handler
@@ -79,10 +545,12 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event) {
                 TAG,
                 "Connected to MQTT broker, redirecting logs to topic %s. Bye!",
                 TOPIC_LOGS);
-            esp_log_set_vprintf(mqtt_vprintf);
+            logs_redirect();
             ESP_LOGI(TAG,
                      "Connected to MQTT broker, logs redirected to topic %s",
                      TOPIC_LOGS);
+            boot_report();
+            wifi_report();
 
             break;
 
@@ -127,11 +595,7 @@ static void mqtt_init_async(void *pvParameter) {
     xEventGroupWaitBits(net_event_group, WIFI_CONNECTED_BIT, false, false,
                         portMAX_DELAY);
     esp_mqtt_client_start(client);
-
-    // XXX Ugly hack
-    while (1) {
-        vTaskDelay(portMAX_DELAY);
-    }
+    vTaskDelete(NULL);
 }
 
 void mqtt_init() {
@@ -142,9 +606,20 @@ void mqtt_init() {
         .client_id = CONFIG_MQTT_CLIENT_ID,
         .username = CONFIG_MQTT_CLIENT_ID,
         .password = CONFIG_MQTT_CLIENT_ID,
+        // Room for a firmware chunk and its topic
+        .buffer_size = 2048,
         .event_handle = mqtt_event_handler};
 
+    for (size_t i = 1; i < TOPICS_LENGTH; i++) {
+        if (strcmp(topics[i - 1].suffix, topics[i].suffix) >= 0) {
+            ESP_LOGE(TAG, "Topic %s is out of order in topics[]",
+                     topics[i].suffix);
+            abort();
+        }
+    }
+
     client = esp_mqtt_client_init(&mqtt_cfg);
+    logs_init();
 
     xTaskCreateStatic(&mqtt_init_async, "mqtt_init", MQTT_INIT_STACK_SIZE, NULL,
                       tskIDLE_PRIORITY + 1, mqtt_init_stack, &mqtt_init_buffer);
@@ -4,8 +4,14 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
 
+#define TOPIC_LOGS CONFIG_MQTT_PREFIX "/logs"
+
 void mqtt_init(void);
 
+// Thin wrapper over esp_mqtt_client_publish for the other modules
+int mqtt_publish(const char *topic, const char *data, int len, int qos,
+                 int retain);
+
 extern EventGroupHandle_t mqtt_event_group;
 #define MQTT_CONNECTED_BIT BIT0
 #define MQTT_OTA_BIT BIT1
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdio.h>
+
+// Appends to msg, keeping len within size. Once the message is truncated
+// (len >= size) further appends do nothing, so callers check len once the
+// message is built.
+#define msg_append(msg, len, size, ...)                                    \
+    do {                                                                   \
+        if ((len) < (size)) {                                              \
+            (len) += snprintf((msg) + (len), (size) - (len), __VA_ARGS__); \
+        }                                                                  \
+    } while (0)
@@ -1,23 +1,117 @@
 #include "ota.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 // FreeRTOS includes
 #include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
 
 // ESP specific includes
 #include "esp_flash_partitions.h"
 #include "esp_http_client.h"
+#include "esp_image_format.h"
 #include "esp_log.h"
 #include "esp_ota_ops.h"
 #include "esp_partition.h"
+#include "esp_spi_flash.h"
+#include "esp_timer.h"
+#include "esp32/rom/crc.h"
+#include "mbedtls/sha256.h"
+#include "nvs.h"
+#ifdef CONFIG_OTA_COMPRESSED
+#include "esp32/rom/miniz.h"
+#endif
 
 // Other
+#include "mqtt.h"
 #include "queues.h"
 
 #define HASH_LEN 32
-#define BUFFSIZE 1024
-// OTA data write buffer ready to write to the flash
-static char ota_write_data[BUFFSIZE + 1] = {0};
+#define TOPIC_OTA_PROGRESS CONFIG_MQTT_PREFIX "/ota/progress"
+#define TOPIC_OTA_ACK CONFIG_MQTT_PREFIX "/ota/ack"
+
+// Download pipeline
+// =================
+//
+// The reader task fills buffers from HTTP while the writer task erases and
+// writes the previous ones to flash. Buffers are one flash sector long and
+// cycle between the free and the full queues, so the reader blocks (and
+// stops reading from the socket) when the flash falls behind.
+//
+// The writer fills the update partition sector by sector with
+// esp_partition_write rather than esp_ota_write, so that a transfer can be
+// resumed where it stopped: the partition, image size, ETag and number of
+// bytes written are checkpointed in NVS, and the next attempt (or the next
+// boot) asks the server for the rest with a Range request. Checkpoints are
+// rounded down to a sector boundary: the sector holding the last bytes
+// written may be partly programmed already, and flash can only clear bits,
+// so a resumed transfer erases it and writes it again whole. The image is
+// verified by esp_ota_set_boot_partition once complete.
+#define OTA_BUFFER_SIZE SPI_FLASH_SEC_SIZE
+#define OTA_BUFFER_COUNT 4
+#define OTA_CHECKPOINT_SIZE (16 * OTA_BUFFER_SIZE)
+#define OTA_ETAG_SIZE 64
+#define OTA_NVS_NAMESPACE "ota"
+#define ALIGN_SECTOR(offset) \
+    (((offset) + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1))
+#define ALIGN_SECTOR_DOWN(offset) ((offset) & ~(SPI_FLASH_SEC_SIZE - 1))
+
+// A chunk of len bytes in buffer index, or one of the end markers below.
+// The full queue has room for a marker besides every buffer: a marker may
+// come without a buffer, index being OTA_NO_BUFFER.
+typedef struct {
+    uint8_t index;
+    int16_t len;
+} ota_chunk_t;
+
+#define OTA_CHUNK_END 0           // Transfer complete
+#define OTA_CHUNK_INTERRUPTED -1  // Transfer stopped, may be resumed
+#define OTA_CHUNK_CORRUPTED -2    // Image received whole but corrupted
+#define OTA_NO_BUFFER 0xFF
+
+static WORD_ALIGNED_ATTR uint8_t ota_buffers[OTA_BUFFER_COUNT][OTA_BUFFER_SIZE];
+
+static QueueHandle_t ota_free_queue;
+static QueueHandle_t ota_full_queue;
+static StaticQueue_t ota_free_queue_struct;
+static StaticQueue_t ota_full_queue_struct;
+static uint8_t ota_free_queue_storage[OTA_BUFFER_COUNT * sizeof(ota_chunk_t)];
+static uint8_t
+    ota_full_queue_storage[(OTA_BUFFER_COUNT + 1) * sizeof(ota_chunk_t)];
+
+static TaskHandle_t ota_reader;
+
+// Set by the writer on failure, so that the reader stops downloading
+static volatile bool ota_failed;
+
+// Transfer state, persisted in NVS along with the URL
+typedef struct {
+    uint32_t partition;  // Address of the update partition
+    uint32_t size;       // Image size, 0 if unknown
+    uint32_t written;    // Bytes already written to the partition
+    char etag[OTA_ETAG_SIZE];
+} ota_progress_t;
+
+static ota_progress_t ota_progress;
+static const esp_partition_t *ota_partition;
+
+// Transfer statistics, in bytes and microseconds
+typedef struct {
+    int64_t start;
+    uint32_t received;
+    int64_t net_stall;    // Writer waiting for the network
+    int64_t flash_stall;  // Reader waiting for the flash
+} ota_stats_t;
+
+static ota_stats_t ota_stats;
+
+// Response headers of the current request
+static char ota_etag[OTA_ETAG_SIZE];
+static uint32_t ota_range_total;
 
 void print_sha256(const uint8_t *image_hash, const char *label) {
     char hash_print[HASH_LEN * 2 + 1];
@@ -28,22 +122,483 @@ void print_sha256(const uint8_t *image_hash, const char *label) {
     ESP_LOGI("OTA", "%s: %s", label, hash_print);
 }
 
+// Returns true if NVS holds an unfinished transfer of url
+static bool ota_progress_load(const char *url) {
+    nvs_handle_t handle;
+    if (nvs_open(OTA_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return false;
+    }
+    static char saved_url[QUEUE_SIZE_OTA];
+    size_t url_len = sizeof(saved_url);
+    size_t progress_len = sizeof(ota_progress);
+    bool found =
+        nvs_get_str(handle, "url", saved_url, &url_len) == ESP_OK &&
+        nvs_get_blob(handle, "progress", &ota_progress, &progress_len) ==
+            ESP_OK &&
+        progress_len == sizeof(ota_progress) &&
+        (url == NULL || strcmp(url, saved_url) == 0);
+    nvs_close(handle);
+    if (found && url == NULL) {
+        // Called at boot, queue the transfer again
+        xQueueSend(dispatcher_queues[QUEUE_OTA], saved_url, 0);
+    }
+    return found;
+}
+
+// Saves the progress, up to the last sector boundary reached
+static void ota_progress_save(const char *url) {
+    nvs_handle_t handle;
+    if (nvs_open(OTA_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return;
+    }
+    ota_progress_t checkpoint = ota_progress;
+    checkpoint.written = ALIGN_SECTOR_DOWN(checkpoint.written);
+    if (url != NULL) nvs_set_str(handle, "url", url);
+    nvs_set_blob(handle, "progress", &checkpoint, sizeof(checkpoint));
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+static void ota_progress_clear(void) {
+    nvs_handle_t handle;
+    if (nvs_open(OTA_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return;
+    }
+    nvs_erase_key(handle, "url");
+    nvs_erase_key(handle, "progress");
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+// Publishes the transfer statistics, and the result once done
+static void ota_publish_progress(bool done, esp_err_t result) {
+    char msg[192];
+    int64_t elapsed = esp_timer_get_time() - ota_stats.start;
+    uint32_t rate =
+        elapsed > 0 ? ota_stats.received * 1000000LL / elapsed : 0;
+    int len = snprintf(
+        msg, sizeof(msg),
+        "{\"received\":%u,\"written\":%u,\"total\":%u,\"bytes_per_s\":%u,"
+        "\"net_stall_ms\":%u,\"flash_stall_ms\":%u,\"done\":%s,"
+        "\"result\":\"%s\"}",
+        ota_stats.received, ota_progress.written, ota_progress.size, rate,
+        (uint32_t)(ota_stats.net_stall / 1000),
+        (uint32_t)(ota_stats.flash_stall / 1000), done ? "true" : "false",
+        done ? esp_err_to_name(result) : "");
+    mqtt_publish(TOPIC_OTA_PROGRESS, msg, len, 0, 0);
+}
+
+static esp_err_t ota_http_event(esp_http_client_event_t *evt) {
+    if (evt->event_id != HTTP_EVENT_ON_HEADER) return ESP_OK;
+    if (strcasecmp(evt->header_key, "ETag") == 0) {
+        strlcpy(ota_etag, evt->header_value, sizeof(ota_etag));
+    } else if (strcasecmp(evt->header_key, "Content-Range") == 0) {
+        // bytes <first>-<last>/<total>
+        const char *total = strchr(evt->header_value, '/');
+        if (total != NULL) ota_range_total = strtoul(total + 1, NULL, 10);
+    }
+    return ESP_OK;
+}
+
 static void http_cleanup(esp_http_client_handle_t client) {
     esp_http_client_close(client);
     esp_http_client_cleanup(client);
 }
 
+// Reads until buffer is full or the connection is closed, returns the
+// number of bytes read or -1 on error.
+static int ota_read_buffer(esp_http_client_handle_t client, uint8_t *buffer) {
+    int len = 0;
+    while (len < OTA_BUFFER_SIZE) {
+        int data_read = esp_http_client_read(client, (char *)buffer + len,
+                                             OTA_BUFFER_SIZE - len);
+        if (data_read < 0) return -1;
+        if (data_read == 0) break;
+        len += data_read;
+    }
+    return len;
+}
+
+// Opens ota_url in *client, from where the previous attempt stopped if the
+// server allows it. Fails with ESP_ERR_TIMEOUT if the connection failed and
+// may be retried, or ESP_ERR_INVALID_RESPONSE if the server refused the
+// request.
+static esp_err_t ota_open(const char *ota_url,
+                          esp_http_client_handle_t *client_out) {
+    esp_http_client_config_t config = {
+        .url = ota_url,
+        .event_handler = ota_http_event,
+    };
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    if (client == NULL) {
+        ESP_LOGE("OTA", "Failed to initialise HTTP connection");
+        return ESP_ERR_TIMEOUT;
+    }
+
+    char range[32];
+    if (ota_progress.written > 0) {
+        snprintf(range, sizeof(range), "bytes=%u-", ota_progress.written);
+        esp_http_client_set_header(client, "Range", range);
+        // The server sends the whole image again if it changed
+        if (ota_progress.etag[0] != '\0') {
+            esp_http_client_set_header(client, "If-Range", ota_progress.etag);
+        }
+    }
+
+    ota_etag[0] = '\0';
+    ota_range_total = 0;
+    esp_err_t err = esp_http_client_open(client, 0);
+    if (err != ESP_OK) {
+        ESP_LOGE("OTA", "Failed to open HTTP connection: %s",
+                 esp_err_to_name(err));
+        esp_http_client_cleanup(client);
+        return ESP_ERR_TIMEOUT;
+    }
+    int content_length = esp_http_client_fetch_headers(client);
+    int status = esp_http_client_get_status_code(client);
+
+    if (status == 206 && ota_progress.written > 0) {
+        ESP_LOGI("OTA", "Resuming at %u/%u bytes", ota_progress.written,
+                 ota_range_total);
+        if (ota_range_total != 0) ota_progress.size = ota_range_total;
+    } else if (status == 200) {
+        if (ota_progress.written > 0) {
+            ESP_LOGW("OTA", "Server did not resume, restarting transfer");
+        }
+        ota_progress.written = 0;
+        ota_progress.size = content_length > 0 ? content_length : 0;
+        strlcpy(ota_progress.etag, ota_etag, sizeof(ota_progress.etag));
+    } else {
+        // 404, 416 and the like will not go away by asking again, only a
+        // server error may
+        ESP_LOGE("OTA", "Unexpected HTTP status %d", status);
+        http_cleanup(client);
+        return status >= 500 ? ESP_ERR_TIMEOUT : ESP_ERR_INVALID_RESPONSE;
+    }
+    *client_out = client;
+    return ESP_OK;
+}
+
+// Streams the image at ota_url to the writer task. Returns ESP_OK once the
+// writer has validated the image, ESP_ERR_TIMEOUT if the transfer was
+// interrupted and can be resumed, or another error if it must restart.
+static esp_err_t ota_download(const char *ota_url) {
+    const esp_partition_t *next = esp_ota_get_next_update_partition(NULL);
+    assert(next != NULL);
+    if (!ota_progress_load(ota_url) ||
+        ota_progress.partition != next->address) {
+        memset(&ota_progress, 0, sizeof(ota_progress));
+        ota_progress.partition = next->address;
+    }
+    // Checkpoints saved by older firmware may stop mid-sector
+    ota_progress.written = ALIGN_SECTOR_DOWN(ota_progress.written);
+    ota_partition = next;
+
+    esp_http_client_handle_t client;
+    esp_err_t err = ota_open(ota_url, &client);
+    if (err != ESP_OK) return err;
+    ota_progress_save(ota_url);
+
+    memset(&ota_stats, 0, sizeof(ota_stats));
+    ota_stats.start = esp_timer_get_time();
+    ota_failed = false;
+    int64_t last_progress = ota_stats.start;
+
+    ota_chunk_t chunk;
+    do {
+        int64_t wait_start = esp_timer_get_time();
+        xQueueReceive(ota_free_queue, &chunk, portMAX_DELAY);
+        int64_t now = esp_timer_get_time();
+        ota_stats.flash_stall += now - wait_start;
+
+        if (ota_failed) {
+            chunk.len = OTA_CHUNK_INTERRUPTED;
+        } else {
+            chunk.len = ota_read_buffer(client, ota_buffers[chunk.index]);
+            if (chunk.len < 0) {
+                ESP_LOGE("OTA", "Error: data read error");
+            } else {
+                ota_stats.received += chunk.len;
+            }
+        }
+        xQueueSend(ota_full_queue, &chunk, portMAX_DELAY);
+
+        if (now - last_progress >= 1000000) {
+            ota_publish_progress(false, ESP_OK);
+            last_progress = now;
+        }
+    } while (chunk.len > 0);
+    http_cleanup(client);
+
+    // Wait for the writer to flush everything and validate the image
+    uint32_t result = 0;
+    xTaskNotifyWait(0, UINT32_MAX, &result, portMAX_DELAY);
+    ota_publish_progress(true, result);
+    ESP_LOGI("OTA", "Received %u bytes in %u ms (network stall %u ms, flash "
+             "stall %u ms)",
+             ota_stats.received,
+             (uint32_t)((esp_timer_get_time() - ota_stats.start) / 1000),
+             (uint32_t)(ota_stats.net_stall / 1000),
+             (uint32_t)(ota_stats.flash_stall / 1000));
+    return result;
+}
+
+// MQTT transport
+// ==============
+//
+// The image can also be pushed on the firmware/chunk topic, as announced on
+// firmware/begin with its size and SHA-256. Each chunk carries its sequence
+// number and the CRC-32 of its data (see ota.h); chunks go straight into the
+// pipeline buffers, in place of the HTTP reader. Flow control is a sliding
+// window of CONFIG_OTA_MQTT_WINDOW chunks: the device publishes on
+// TOPIC_OTA_ACK the number of the next chunk it expects every half window.
+// When a chunk is missing or corrupted it publishes that number once as a
+// nack, "seq,nack", for the publisher to go back to it, and again every
+// second without progress. Acks are published with QoS 1, and repeated when
+// chunks already received come again: the publisher sends them after
+// missing acks. Chunks are refused rather than waited for while the flash
+// writer holds every buffer, and the end marker goes without a buffer, so
+// that the MQTT task never blocks.
+typedef struct {
+    bool active;
+    bool holding;        // chunk is a buffer being filled
+    bool nacked;         // next_seq was requested again already
+    uint32_t size;       // Announced image size
+    uint32_t next_seq;   // Next chunk expected
+    int64_t last_us;     // Time of the last chunk accepted
+    int64_t ack_us;      // Time of the last ack
+    ota_chunk_t chunk;
+    uint8_t sha256[HASH_LEN];
+    mbedtls_sha256_context sha;
+} ota_mqtt_t;
+
+static ota_mqtt_t ota_mqtt;
+
+// Acks go out every half window
+_Static_assert(CONFIG_OTA_MQTT_WINDOW % 2 == 0,
+               "CONFIG_OTA_MQTT_WINDOW must be even");
+// A chunk spans at most two buffers, see ota_mqtt_chunk()
+_Static_assert(OTA_MQTT_CHUNK_SIZE <= OTA_BUFFER_SIZE,
+               "OTA chunks must fit in a buffer");
+
+// Shared between the MQTT task, which receives the chunks, and the upgrade
+// task, which times the transfer out
+static SemaphoreHandle_t ota_mqtt_lock;
+static StaticSemaphore_t ota_mqtt_lock_buffer;
+
+// Duplicates are answered with an ack at most this often
+#define OTA_MQTT_REACK_US 500000
+
+static void ota_mqtt_ack(uint32_t seq, bool nack) {
+    char msg[16];
+    int len = snprintf(msg, sizeof(msg), "%u%s", seq, nack ? ",nack" : "");
+    ota_mqtt.ack_us = esp_timer_get_time();
+    mqtt_publish(TOPIC_OTA_ACK, msg, len, 1, 0);
+}
+
+static bool ota_mqtt_hold(TickType_t timeout) {
+    if (ota_mqtt.holding) return true;
+    int64_t wait_start = esp_timer_get_time();
+    if (xQueueReceive(ota_free_queue, &ota_mqtt.chunk, timeout) != pdTRUE) {
+        return false;
+    }
+    ota_stats.flash_stall += esp_timer_get_time() - wait_start;
+    ota_mqtt.chunk.len = 0;
+    ota_mqtt.holding = true;
+    return true;
+}
+
+static void ota_mqtt_send(int16_t len) {
+    ota_mqtt.chunk.len = len;
+    xQueueSend(ota_full_queue, &ota_mqtt.chunk, portMAX_DELAY);
+    ota_mqtt.holding = false;
+}
+
+// Ends the transfer with an end marker, flushing the data left if it is
+// complete. The marker hands back the buffer held if any, and has room in
+// the full queue either way.
+static void ota_mqtt_end(int16_t end) {
+    if (end == OTA_CHUNK_END && ota_mqtt.holding && ota_mqtt.chunk.len > 0) {
+        ota_mqtt_send(ota_mqtt.chunk.len);
+    }
+    if (!ota_mqtt.holding) ota_mqtt.chunk.index = OTA_NO_BUFFER;
+    ota_mqtt_send(end);
+    ota_mqtt.active = false;
+}
+
+static bool ota_mqtt_verify(void) {
+    uint8_t sha256[HASH_LEN];
+    mbedtls_sha256_finish_ret(&ota_mqtt.sha, sha256);
+    if (memcmp(sha256, ota_mqtt.sha256, HASH_LEN) != 0) {
+        print_sha256(sha256, "SHA-256 mismatch, received");
+        return false;
+    }
+    return true;
+}
+
+static uint32_t read_le32(const uint8_t *data) {
+    return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+void ota_mqtt_chunk(const uint8_t *data, int len) {
+    if (ota_mqtt_lock == NULL || len < OTA_MQTT_HEADER_SIZE) return;
+    uint32_t seq = read_le32(data);
+    uint32_t crc = read_le32(data + 4);
+    data += OTA_MQTT_HEADER_SIZE;
+    len -= OTA_MQTT_HEADER_SIZE;
+
+    xSemaphoreTake(ota_mqtt_lock, portMAX_DELAY);
+    if (!ota_mqtt.active) {
+        xSemaphoreGive(ota_mqtt_lock);
+        return;
+    }
+    if (seq < ota_mqtt.next_seq) {
+        // Duplicate, the publisher may have missed the last acks
+        if (esp_timer_get_time() - ota_mqtt.ack_us >= OTA_MQTT_REACK_US) {
+            ota_mqtt_ack(ota_mqtt.next_seq, false);
+        }
+        xSemaphoreGive(ota_mqtt_lock);
+        return;
+    }
+    // This is the MQTT task, it must not wait for the flash writer: a chunk
+    // needing a buffer while none is free is refused like a lost one. Only
+    // this task takes free buffers during the transfer, and a chunk needs
+    // at most one.
+    int room = ota_mqtt.holding ? OTA_BUFFER_SIZE - ota_mqtt.chunk.len : 0;
+    bool full = room < len && uxQueueMessagesWaiting(ota_free_queue) == 0;
+    if (seq != ota_mqtt.next_seq || crc32_le(0, data, len) != crc ||
+        ota_stats.received + len > ota_mqtt.size || full) {
+        if (!ota_mqtt.nacked) {
+            ESP_LOGW("OTA", "Chunk %u rejected%s, expecting %u", seq,
+                     full ? " (flash writer behind)" : "", ota_mqtt.next_seq);
+            ota_mqtt_ack(ota_mqtt.next_seq, true);
+            ota_mqtt.nacked = true;
+        }
+        xSemaphoreGive(ota_mqtt_lock);
+        return;
+    }
+
+    mbedtls_sha256_update_ret(&ota_mqtt.sha, data, len);
+    ota_stats.received += len;
+    ota_mqtt.next_seq++;
+    ota_mqtt.nacked = false;
+    ota_mqtt.last_us = esp_timer_get_time();
+
+    while (len > 0 && !ota_failed) {
+        if (!ota_mqtt_hold(0)) {
+            ESP_LOGE("OTA", "No free buffer");
+            ota_failed = true;
+            break;
+        }
+        int n = OTA_BUFFER_SIZE - ota_mqtt.chunk.len;
+        if (n > len) n = len;
+        memcpy(ota_buffers[ota_mqtt.chunk.index] + ota_mqtt.chunk.len, data,
+               n);
+        ota_mqtt.chunk.len += n;
+        data += n;
+        len -= n;
+        if (ota_mqtt.chunk.len == OTA_BUFFER_SIZE) {
+            ota_mqtt_send(OTA_BUFFER_SIZE);
+        }
+    }
+
+    if (ota_failed) {
+        ota_mqtt_end(OTA_CHUNK_INTERRUPTED);
+    } else if (ota_stats.received == ota_mqtt.size) {
+        ota_mqtt_end(ota_mqtt_verify() ? OTA_CHUNK_END : OTA_CHUNK_CORRUPTED);
+    } else if (ota_mqtt.next_seq % (CONFIG_OTA_MQTT_WINDOW / 2) == 0) {
+        ota_mqtt_ack(ota_mqtt.next_seq, false);
+    }
+    xSemaphoreGive(ota_mqtt_lock);
+}
+
+// Receives the image announced by params ("size,sha256" with the hash in
+// hex) over MQTT, returns once the writer is done with it.
+static esp_err_t ota_receive(const char *params) {
+    uint32_t size = 0;
+    char hash[HASH_LEN * 2 + 1] = {0};
+    if (sscanf(params, "%u,%64s", &size, hash) != 2 ||
+        strlen(hash) != HASH_LEN * 2 || size == 0) {
+        ESP_LOGE("OTA", "Invalid firmware announce \"%s\"", params);
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (int i = 0; i < HASH_LEN; i++) {
+        sscanf(&hash[i * 2], "%2hhx", &ota_mqtt.sha256[i]);
+    }
+
+    // Nothing to resume from over MQTT
+    ota_progress_clear();
+    ota_partition = esp_ota_get_next_update_partition(NULL);
+    assert(ota_partition != NULL);
+    memset(&ota_progress, 0, sizeof(ota_progress));
+    ota_progress.partition = ota_partition->address;
+    ota_progress.size = size;
+    memset(&ota_stats, 0, sizeof(ota_stats));
+    ota_stats.start = esp_timer_get_time();
+    ota_failed = false;
+
+    xSemaphoreTake(ota_mqtt_lock, portMAX_DELAY);
+    ota_mqtt.active = true;
+    ota_mqtt.holding = false;
+    ota_mqtt.nacked = false;
+    ota_mqtt.size = size;
+    ota_mqtt.next_seq = 0;
+    ota_mqtt.last_us = ota_stats.start;
+    mbedtls_sha256_init(&ota_mqtt.sha);
+    mbedtls_sha256_starts_ret(&ota_mqtt.sha, 0);
+    ota_mqtt_ack(0, false);
+    xSemaphoreGive(ota_mqtt_lock);
+    ESP_LOGI("OTA", "Receiving %u bytes over MQTT", size);
+
+    uint32_t result = 0;
+    while (xTaskNotifyWait(0, UINT32_MAX, &result, pdMS_TO_TICKS(1000)) !=
+           pdTRUE) {
+        xSemaphoreTake(ota_mqtt_lock, portMAX_DELAY);
+        if (ota_mqtt.active) {
+            if (esp_timer_get_time() - ota_mqtt.last_us >
+                CONFIG_OTA_MQTT_TIMEOUT_MS * 1000LL) {
+                ESP_LOGE("OTA", "No chunk received for %d ms, aborting",
+                         CONFIG_OTA_MQTT_TIMEOUT_MS);
+                ota_mqtt_end(OTA_CHUNK_INTERRUPTED);
+            } else {
+                // Chunks or acks were lost, or chunks were refused while
+                // the flash writer was behind: ask for them again
+                if (esp_timer_get_time() - ota_mqtt.ack_us >= 1000000) {
+                    ota_mqtt_ack(ota_mqtt.next_seq, true);
+                }
+                ota_publish_progress(false, ESP_OK);
+            }
+        }
+        xSemaphoreGive(ota_mqtt_lock);
+    }
+    mbedtls_sha256_free(&ota_mqtt.sha);
+    ota_publish_progress(true, result);
+    return result;
+}
+
+// Downloads ota_url, resuming the transfer when it gets interrupted
+static esp_err_t ota_fetch(const char *ota_url) {
+    esp_err_t err = ESP_ERR_TIMEOUT;
+    for (int attempt = 0;
+         err == ESP_ERR_TIMEOUT && attempt <= CONFIG_OTA_RESUME_RETRIES;
+         attempt++) {
+        if (attempt > 0) {
+            ESP_LOGW("OTA", "Transfer interrupted, retry %d/%d", attempt,
+                     CONFIG_OTA_RESUME_RETRIES);
+            vTaskDelay((1000 << (attempt < 5 ? attempt : 5)) /
+                       portTICK_PERIOD_MS);
+        }
+        err = ota_download(ota_url);
+    }
+    return err;
+}
+
 // Simple routine that waits for a publish in MQTT ota topic to upgrade
 // firmware.
 #define STACK_SIZE 4096
 StaticTask_t ota_upgrade_task_buffer;
 StackType_t ota_upgrade_task_stack[STACK_SIZE];
 static void ota_upgrade_task(void *pvParameter) {
-    esp_err_t err;
-    // update handle : set by esp_ota_begin(), must be freed via esp_ota_end()
-    esp_ota_handle_t update_handle = 0;
-    const esp_partition_t *update_partition = NULL;
-
     // Wait for an OTA upgrade request to come.
     while (true) {
         static char ota_url[QUEUE_SIZE_OTA + 1] = {0};
@@ -53,79 +608,239 @@ static void ota_upgrade_task(void *pvParameter) {
             ESP_LOGI("OTA", "Queue is not available, ignoring message");
             continue;
         }
+        // A transfer resumed at boot may come before the network
+        xEventGroupWaitBits(mqtt_event_group, MQTT_CONNECTED_BIT, false, true,
+                            portMAX_DELAY);
 
-        esp_http_client_config_t config = {
-            .url = ota_url,
-        };
-        esp_http_client_handle_t client = esp_http_client_init(&config);
-        if (client == NULL) {
-            ESP_LOGE("OTA", "Failed to initialise HTTP connection");
-            continue;
-        }
-        err = esp_http_client_open(client, 0);
-        if (err != ESP_OK) {
-            ESP_LOGE("OTA", "Failed to open HTTP connection: %s",
-                     esp_err_to_name(err));
-            esp_http_client_cleanup(client);
-            continue;
+        esp_err_t err;
+        if (strncmp(ota_url, OTA_MQTT_SCHEME, sizeof(OTA_MQTT_SCHEME) - 1) ==
+            0) {
+            err = ota_receive(ota_url + sizeof(OTA_MQTT_SCHEME) - 1);
+        } else {
+            err = ota_fetch(ota_url);
+            if (err == ESP_ERR_TIMEOUT) {
+                // Keep the checkpoint, the transfer resumes on the next
+                // request or at the next boot.
+                ESP_LOGE("OTA", "Giving up for now at %u bytes",
+                         ota_progress.written);
+                continue;
+            }
         }
-        esp_http_client_fetch_headers(client);
+        ota_progress_clear();
+        if (err != ESP_OK) continue;
 
-        update_partition = esp_ota_get_next_update_partition(NULL);
-        ESP_LOGI("OTA", "Writing to partition subtype %d at offset 0x%x",
-                 update_partition->subtype, update_partition->address);
-        assert(update_partition != NULL);
+        ESP_LOGI("OTA", "Prepare to restart system!");
+        esp_restart();
+        return;
+    }
+}
 
-        err = esp_ota_begin(update_partition, OTA_SIZE_UNKNOWN, &update_handle);
-        if (err != ESP_OK) {
-            ESP_LOGE("OTA", "esp_ota_begin failed (%s)", esp_err_to_name(err));
-            http_cleanup(client);
-            continue;
-        }
-        ESP_LOGI("OTA", "esp_ota_begin succeeded");
+// Appends data to the update partition, erasing sectors as it reaches them
+static esp_err_t ota_write_data(const uint8_t *data, size_t len) {
+    uint32_t offset = ota_progress.written;
+    if (offset == 0 && data[0] != ESP_IMAGE_HEADER_MAGIC) {
+        ESP_LOGE("OTA", "Not a firmware image (magic 0x%02x)", data[0]);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (offset + len > ota_partition->size) {
+        ESP_LOGE("OTA", "Image does not fit in the partition");
+        return ESP_ERR_INVALID_SIZE;
+    }
 
-        int binary_file_length = 0;
-        // deal with all receive packet
-        while (1) {
-            int data_read =
-                esp_http_client_read(client, ota_write_data, BUFFSIZE);
-            if (data_read < 0) {
-                ESP_LOGE("OTA", "Error: data read error");
-                http_cleanup(client);
-                continue;
-            } else if (data_read > 0) {
-                err = esp_ota_write(update_handle, (const void *)ota_write_data,
-                                    data_read);
-                if (err != ESP_OK) {
-                    http_cleanup(client);
-                    continue;
-                }
-                binary_file_length += data_read;
-                ESP_LOGD("OTA", "Written image length %d", binary_file_length);
-            } else if (data_read == 0) {
-                ESP_LOGI("OTA", "Connection closed, all data received");
-                break;
-            }
+    // offset is not sector aligned after an inflated block ended
+    // mid-sector. The sector holding offset was erased when the transfer
+    // first reached it, so erasing resumes at the next boundary; erasing
+    // from offset itself would fail with ESP_ERR_INVALID_ARG. A resumed
+    // transfer starts on a boundary, and erases its first sector again.
+    uint32_t erased = ALIGN_SECTOR(offset);
+    uint32_t end = ALIGN_SECTOR(offset + len);
+    esp_err_t err = ESP_OK;
+    if (end > erased) {
+        err = esp_partition_erase_range(ota_partition, erased, end - erased);
+    }
+    if (err == ESP_OK) {
+        err = esp_partition_write(ota_partition, offset, data, len);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE("OTA", "Flash write failed (%s)", esp_err_to_name(err));
+        return err;
+    }
+
+    ota_progress.written += len;
+    ESP_LOGD("OTA", "Written image length %d", ota_progress.written);
+    return ESP_OK;
+}
+
+#ifdef CONFIG_OTA_COMPRESSED
+// Compressed images
+// =================
+//
+// An image starting with OTA_MLZ_MAGIC is a zlib stream (as produced by
+// tools/ota_compress.py) preceded by the size of the raw image. It is
+// inflated with the miniz copy in ROM, straight into a dictionary-sized
+// circular window that is written to flash as it fills up, so RAM use is
+// bounded by the window whatever the image size. The decompressor state
+// cannot be checkpointed: interrupted compressed transfers start over.
+#define OTA_MLZ_MAGIC "MLZ1"
+#define OTA_MLZ_HEADER_SIZE 8
+
+typedef struct {
+    bool active;
+    bool done;
+    uint32_t raw_size;
+    size_t window_ofs;
+    tinfl_decompressor inflator;
+} ota_inflate_t;
+
+static ota_inflate_t ota_inflate;
+static uint8_t ota_window[TINFL_LZ_DICT_SIZE];
+
+// Starts inflating if a transfer begins with a compressed image header,
+// returns the size of the header.
+static size_t ota_inflate_begin(const uint8_t *data, size_t len) {
+    ota_inflate.active = false;
+    if (ota_progress.written != 0 || len < OTA_MLZ_HEADER_SIZE ||
+        memcmp(data, OTA_MLZ_MAGIC, 4) != 0) {
+        return 0;
+    }
+    ota_inflate.active = true;
+    ota_inflate.done = false;
+    ota_inflate.raw_size = data[4] | data[5] << 8 | data[6] << 16 |
+                           (uint32_t)data[7] << 24;
+    ota_inflate.window_ofs = 0;
+    tinfl_init(&ota_inflate.inflator);
+    ESP_LOGI("OTA", "Compressed image, %u bytes once inflated",
+             ota_inflate.raw_size);
+    return OTA_MLZ_HEADER_SIZE;
+}
+
+static esp_err_t ota_inflate_data(const uint8_t *data, size_t len) {
+    const int flags = TINFL_FLAG_PARSE_ZLIB_HEADER |
+                      TINFL_FLAG_COMPUTE_ADLER32 | TINFL_FLAG_HAS_MORE_INPUT;
+    tinfl_status status;
+    do {
+        if (ota_inflate.done) {
+            ESP_LOGE("OTA", "Trailing data after compressed image");
+            return ESP_ERR_INVALID_SIZE;
+        }
+        size_t in_size = len;
+        size_t out_size = TINFL_LZ_DICT_SIZE - ota_inflate.window_ofs;
+        status = tinfl_decompress(&ota_inflate.inflator, data, &in_size,
+                                  ota_window,
+                                  ota_window + ota_inflate.window_ofs,
+                                  &out_size, flags);
+        data += in_size;
+        len -= in_size;
+        if (status < TINFL_STATUS_DONE) {
+            ESP_LOGE("OTA", "Corrupted compressed image (%d)", status);
+            return ESP_ERR_INVALID_CRC;
         }
-        ESP_LOGI("OTA", "Total Write binary data length : %d",
-                 binary_file_length);
+        if (out_size > 0) {
+            esp_err_t err =
+                ota_write_data(ota_window + ota_inflate.window_ofs, out_size);
+            if (err != ESP_OK) return err;
+            ota_inflate.window_ofs =
+                (ota_inflate.window_ofs + out_size) & (TINFL_LZ_DICT_SIZE - 1);
+        }
+        ota_inflate.done = status == TINFL_STATUS_DONE;
+    } while (len > 0 || status == TINFL_STATUS_HAS_MORE_OUTPUT);
+    return ESP_OK;
+}
+#endif
 
-        if (esp_ota_end(update_handle) != ESP_OK) {
-            ESP_LOGE("OTA", "esp_ota_end failed!");
-            http_cleanup(client);
-            continue;
+// Writes one buffer received from the reader, first tells whether it is the
+// first one of the transfer.
+static esp_err_t ota_write_chunk(const uint8_t *data, int len, bool first) {
+#ifdef CONFIG_OTA_COMPRESSED
+    size_t header = first ? ota_inflate_begin(data, len) : 0;
+    if (ota_inflate.active) {
+        return ota_inflate_data(data + header, len - header);
+    }
+#endif
+    esp_err_t err = ota_write_data(data, len);
+    // Inflated blocks leave written unaligned, it may never land on a
+    // multiple of OTA_CHECKPOINT_SIZE: save when crossing one
+    uint32_t after = ota_progress.written / OTA_CHECKPOINT_SIZE;
+    uint32_t before = (ota_progress.written - len) / OTA_CHECKPOINT_SIZE;
+    if (err == ESP_OK && before != after) {
+        ota_progress_save(NULL);
+    }
+    return err;
+}
+
+// Keeps what can be resumed of an interrupted transfer
+static void ota_interrupted(void) {
+#ifdef CONFIG_OTA_COMPRESSED
+    if (ota_inflate.active) ota_progress.written = 0;
+#endif
+    ota_progress_save(NULL);
+}
+
+// Validates a complete image and makes it the boot partition
+static esp_err_t ota_finish(void) {
+    uint32_t size = ota_progress.size;
+#ifdef CONFIG_OTA_COMPRESSED
+    if (ota_inflate.active) {
+        size = ota_inflate.done ? ota_inflate.raw_size : UINT32_MAX;
+    }
+#endif
+    if (size != 0 && ota_progress.written != size) {
+        ESP_LOGW("OTA", "Connection closed at %u/%u bytes",
+                 ota_progress.written, size);
+        ota_interrupted();
+        return ESP_ERR_TIMEOUT;
+    }
+    ESP_LOGI("OTA", "Total Write binary data length : %d",
+             ota_progress.written);
+    esp_err_t err = esp_ota_set_boot_partition(ota_partition);
+    if (err != ESP_OK) {
+        ESP_LOGE("OTA", "esp_ota_set_boot_partition failed (%s)!",
+                 esp_err_to_name(err));
+    }
+    return err;
+}
+
+// Writes the chunks of the reader to the update partition. Sectors are
+// erased right before being written, so erases overlap with the download of
+// the next buffers.
+#define WRITER_STACK_SIZE 3072
+StaticTask_t ota_writer_task_buffer;
+StackType_t ota_writer_task_stack[WRITER_STACK_SIZE];
+static void ota_writer_task(void *pvParameter) {
+    esp_err_t err = ESP_OK;
+    bool first = true;
+
+    while (true) {
+        ota_chunk_t chunk;
+        int64_t wait_start = esp_timer_get_time();
+        xQueueReceive(ota_full_queue, &chunk, portMAX_DELAY);
+        ota_stats.net_stall += esp_timer_get_time() - wait_start;
+
+        if (chunk.len > 0 && err == ESP_OK) {
+            err = ota_write_chunk(ota_buffers[chunk.index], chunk.len,
+                                  first);
+            if (err != ESP_OK) ota_failed = true;
+        }
+        first = chunk.len <= 0;
+        int16_t len = chunk.len;
+        if (chunk.index != OTA_NO_BUFFER) {
+            xQueueSend(ota_free_queue, &chunk, portMAX_DELAY);
         }
+        if (len > 0) continue;
 
-        err = esp_ota_set_boot_partition(update_partition);
-        if (err != ESP_OK) {
-            ESP_LOGE("OTA", "esp_ota_set_boot_partition failed (%s)!",
-                     esp_err_to_name(err));
-            http_cleanup(client);
-            continue;
+        // End of the transfer
+        if (err == ESP_OK) {
+            if (len == OTA_CHUNK_CORRUPTED) {
+                err = ESP_ERR_INVALID_CRC;
+            } else if (len < 0) {
+                ota_interrupted();
+                err = ESP_ERR_TIMEOUT;
+            } else {
+                err = ota_finish();
+            }
         }
-        ESP_LOGI("OTA", "Prepare to restart system!");
-        esp_restart();
-        return;
+        xTaskNotify(ota_reader, err, eSetValueWithOverwrite);
+        err = ESP_OK;
     }
 }
 
@@ -168,9 +883,25 @@ void ota_details() {
 }
 
 void ota_init() {
-    ota_details();
+    ota_mqtt_lock = xSemaphoreCreateMutexStatic(&ota_mqtt_lock_buffer);
+    ota_free_queue = xQueueCreateStatic(OTA_BUFFER_COUNT, sizeof(ota_chunk_t),
+                                        ota_free_queue_storage,
+                                        &ota_free_queue_struct);
+    ota_full_queue = xQueueCreateStatic(
+        OTA_BUFFER_COUNT + 1, sizeof(ota_chunk_t), ota_full_queue_storage,
+        &ota_full_queue_struct);
+    for (int i = 0; i < OTA_BUFFER_COUNT; i++) {
+        ota_chunk_t chunk = {.index = i, .len = 0};
+        xQueueSend(ota_free_queue, &chunk, 0);
+    }
+
+    xTaskCreateStatic(&ota_writer_task, "ota_writer_task", WRITER_STACK_SIZE,
+                      NULL, tskIDLE_PRIORITY + 2, ota_writer_task_stack,
+                      &ota_writer_task_buffer);
+    ota_reader = xTaskCreateStatic(
+        &ota_upgrade_task, "ota_upgrade_task", STACK_SIZE, NULL,
+        tskIDLE_PRIORITY + 1, ota_upgrade_task_stack, &ota_upgrade_task_buffer);
 
-    xTaskCreateStatic(&ota_upgrade_task, "ota_upgrade_task", STACK_SIZE, NULL,
-                      tskIDLE_PRIORITY + 1, ota_upgrade_task_stack,
-                      &ota_upgrade_task_buffer);
+    // Resume an update interrupted by a reboot
+    ota_progress_load(NULL);
 }
@@ -1,3 +1,23 @@
 #pragma once
 
+#include <stdint.h>
+
 void ota_init(void);
+
+// Logs the partitions and their SHA-256, takes a while as it hashes them
+void ota_details(void);
+
+// OTA over MQTT
+// =============
+//
+// A QUEUE_OTA request starting with OTA_MQTT_SCHEME is followed by the size
+// and SHA-256 of an image to receive over MQTT rather than by a URL. Each
+// chunk of the image starts with its sequence number and the CRC-32 of its
+// data, both 32 bits little endian, followed by at most OTA_MQTT_CHUNK_SIZE
+// bytes of data.
+#define OTA_MQTT_SCHEME "mqtt:"
+#define OTA_MQTT_HEADER_SIZE 8
+#define OTA_MQTT_CHUNK_SIZE 1024
+
+// Hands a chunk received on the MQTT task to the OTA writer
+void ota_mqtt_chunk(const uint8_t *data, int len);
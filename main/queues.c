@@ -5,17 +5,38 @@ QueueHandle_t dispatcher_queues[QUEUE_INDEX_LENGTH] = {0};
 
 static StaticQueue_t queues_struct[QUEUE_INDEX_LENGTH];
 
-#define create_static_queue(queue_idx, name, elt_size)        \
-    static uint8_t uc_storage_area_##name[elt_size];          \
-    dispatcher_queues[queue_idx] =                            \
-        xQueueCreateStatic(1, sizeof(uc_storage_area_##name), \
-                           uc_storage_area_##name, &queues_struct[queue_idx])
+#define create_static_queue(queue_idx, name, length, elt_size)       \
+    static uint8_t uc_storage_area_##name[(length) * (elt_size)];    \
+    dispatcher_queues[queue_idx] =                                   \
+        xQueueCreateStatic(length, elt_size, uc_storage_area_##name, \
+                           &queues_struct[queue_idx])
+
+static volatile uint32_t slider_coalesced[SLIDER_LENGTH];
 
 void queues_init(void) {
-    create_static_queue(QUEUE_OTA, ota, QUEUE_SIZE_OTA);
-    create_static_queue(QUEUE_ANIM, anim, QUEUE_SIZE_ANIM);
-    create_static_queue(QUEUE_BRIG, brig, QUEUE_SIZE_BRIG);
-    create_static_queue(QUEUE_COLO, colo, QUEUE_SIZE_COLO);
-    create_static_queue(QUEUE_LED_BRIG, led_brig, QUEUE_SIZE_LED_BRIG);
-    create_static_queue(QUEUE_LED_COLO, led_colo, QUEUE_SIZE_LED_COLO);
+    static uint8_t slider_storage[SLIDER_LENGTH]
+                                 [QUEUE_LENGTH_SLIDER * QUEUE_SIZE_SLIDER];
+
+    create_static_queue(QUEUE_OTA, ota, 1, QUEUE_SIZE_OTA);
+    create_static_queue(QUEUE_KEY, key, QUEUE_LENGTH_KEY, QUEUE_SIZE_KEY);
+    create_static_queue(QUEUE_ANIM, anim, QUEUE_LENGTH_ANIM, QUEUE_SIZE_ANIM);
+    for (int slider = 0; slider < SLIDER_LENGTH; slider++) {
+        dispatcher_queues[QUEUE_SLIDER(slider)] = xQueueCreateStatic(
+            QUEUE_LENGTH_SLIDER, QUEUE_SIZE_SLIDER, slider_storage[slider],
+            &queues_struct[QUEUE_SLIDER(slider)]);
+    }
+}
+
+void queues_post_slider(const struct slider_command *cmd) {
+    QueueHandle_t mailbox = dispatcher_queues[QUEUE_SLIDER(cmd->slider)];
+    // The consumer may take the previous command in between, in which case
+    // it is counted although it was played: good enough for a statistic.
+    if (uxQueueMessagesWaiting(mailbox) != 0) {
+        __sync_fetch_and_add(&slider_coalesced[cmd->slider], 1);
+    }
+    xQueueOverwrite(mailbox, cmd);
+}
+
+uint32_t queues_slider_coalesced(enum milight_slider slider) {
+    return slider_coalesced[slider];
 }
@@ -1,25 +1,70 @@
 #pragma once
 
 #include "freertos/FreeRTOS.h"
+#include "frame.h"
 #include "freertos/queue.h"
+#include "latency.h"
 
 enum queue_index {
+    QUEUE_NONE = -1,  // Handled in place, without a dispatcher queue
     QUEUE_OTA,
+    QUEUE_KEY,
     QUEUE_ANIM,
-    QUEUE_BRIG,
-    QUEUE_COLO,
-    QUEUE_LED_BRIG,
-    QUEUE_LED_COLO,
+    // Slider mailboxes, one per enum milight_slider, see QUEUE_SLIDER()
+    QUEUE_SLIDER_FIRST,
+};
+#define QUEUE_INDEX_LENGTH (QUEUE_SLIDER_FIRST + SLIDER_LENGTH)
+
+// Key press, pushed on QUEUE_KEY
+struct key_command {
+    uint8_t bus;
+    uint8_t keycode;
+    latency_trace_t trace;
+};
+
+// Slider position, posted with queues_post_slider(). slider is an enum
+// milight_slider. The slider fades to value over duration_ms, 0 meaning
+// right away.
+struct slider_command {
+    uint8_t slider;
+    uint8_t value;
+    uint16_t duration_ms;
+    latency_trace_t trace;
+};
+
+// Animation, pushed on QUEUE_ANIM
+enum anim_type {
+    ANIM_STOP,       // Stop every running animation
+    ANIM_SWEEP,      // Turn the colour wheel once every period_ms, forever
+    ANIM_CROSSFADE,  // Fade wheel and luminosity together over period_ms
+};
+
+struct anim_command {
+    uint8_t type;
+    uint8_t wheel;
+    uint8_t luminosity;
+    uint16_t period_ms;
 };
-#define QUEUE_INDEX_LENGTH (QUEUE_LED_COLO + 1)
 
 #define QUEUE_SIZE_OTA 1024
-#define QUEUE_SIZE_ANIM 1
-#define QUEUE_SIZE_BRIG 1
-#define QUEUE_SIZE_COLO 6
-#define QUEUE_SIZE_LED_BRIG 1
-#define QUEUE_SIZE_LED_COLO 6
+#define QUEUE_SIZE_KEY sizeof(struct key_command)
+#define QUEUE_SIZE_ANIM sizeof(struct anim_command)
+#define QUEUE_SIZE_SLIDER sizeof(struct slider_command)
+
+#define QUEUE_LENGTH_KEY 8
+#define QUEUE_LENGTH_SLIDER 1  // Mailbox, see queues_post_slider()
+#define QUEUE_LENGTH_ANIM 1
+
+#define QUEUE_SLIDER(slider) (QUEUE_SLIDER_FIRST + (slider))
 
 extern QueueHandle_t dispatcher_queues[QUEUE_INDEX_LENGTH];
 
 void queues_init(void);
+
+// Slider commands are targets, only the newest one matters: posting
+// replaces the command the consumer has not taken yet, and never blocks.
+// Keys keep going through the QUEUE_KEY FIFO.
+void queues_post_slider(const struct slider_command *cmd);
+
+// Number of slider commands replaced before the consumer took them
+uint32_t queues_slider_coalesced(enum milight_slider slider);
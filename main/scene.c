@@ -0,0 +1,131 @@
+#include "scene.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+// FreeRTOS includes
+#include "freertos/FreeRTOS.h"
+
+// ESP specific includes
+#include "esp_log.h"
+#include "nvs.h"
+
+// Other
+#include "milight.h"
+
+static const char *TAG = "SCENE";
+
+#define SCENE_NVS_NAMESPACE "scene"
+
+// One zone key, then one step per slider, each possibly preceded by a wait
+#define SCENE_STEPS_MAX (1 + 2 * SLIDER_LENGTH)
+
+// Stored in NVS as is, up to the last step
+typedef struct {
+    uint8_t count;
+    milight_sequence_step_t steps[SCENE_STEPS_MAX];
+} scene_t;
+
+#define SCENE_SIZE(count) \
+    (offsetof(scene_t, steps) + (count) * sizeof(milight_sequence_step_t))
+
+static scene_t scenes[SCENES_MAX];
+static portMUX_TYPE scenes_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// The zone key selects the zone the sliders then act on
+static esp_err_t scene_compile(const scene_spec_t *spec, scene_t *scene) {
+    uint8_t keycode;
+    int bus = frame_zone_key(spec->zone, spec->on, &keycode);
+    if (bus < 0) return ESP_ERR_INVALID_ARG;
+    memset(scene, 0, sizeof(*scene));
+    uint32_t queued_ms[2] = {0, 0};
+    uint8_t frame[I2C_SLAVE_FRAME_SIZE];
+
+    frame_encode_key(bus, keycode, frame);
+    milight_sequence_add(scene->steps, &scene->count, queued_ms, bus, frame,
+                         CLICK_HOLD_MS);
+    if (!spec->on) return ESP_OK;
+
+    for (int slider = 0; slider < SLIDER_LENGTH; slider++) {
+        int16_t value = spec->slider[slider];
+        if (value < 0) continue;
+        if (!frame_slider_valid(slider, value)) return ESP_ERR_INVALID_ARG;
+        bus = frame_encode_slider(slider, value, frame);
+        milight_sequence_add(scene->steps, &scene->count, queued_ms, bus,
+                             frame, CONFIG_MILIGHT_ANIM_FRAME_MS);
+    }
+    return ESP_OK;
+}
+
+static void scene_nvs_key(uint8_t id, char *key) {
+    snprintf(key, NVS_KEY_NAME_MAX_SIZE, "s%u", id);
+}
+
+esp_err_t scene_define(uint8_t id, const scene_spec_t *spec) {
+    if (id >= SCENES_MAX) return ESP_ERR_INVALID_ARG;
+    scene_t scene;
+    esp_err_t err = scene_compile(spec, &scene);
+    if (err != ESP_OK) return err;
+
+    nvs_handle_t handle;
+    err = nvs_open(SCENE_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) return err;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    scene_nvs_key(id, key);
+    err = nvs_set_blob(handle, key, &scene, SCENE_SIZE(scene.count));
+    if (err == ESP_OK) err = nvs_commit(handle);
+    nvs_close(handle);
+    if (err != ESP_OK) return err;
+
+    portENTER_CRITICAL(&scenes_lock);
+    scenes[id] = scene;
+    portEXIT_CRITICAL(&scenes_lock);
+    ESP_LOGI(TAG, "Scene %u defined, %u steps", id, scene.count);
+    return ESP_OK;
+}
+
+esp_err_t scene_delete(uint8_t id) {
+    if (id >= SCENES_MAX) return ESP_ERR_INVALID_ARG;
+    portENTER_CRITICAL(&scenes_lock);
+    scenes[id].count = 0;
+    portEXIT_CRITICAL(&scenes_lock);
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(SCENE_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) return err;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    scene_nvs_key(id, key);
+    nvs_erase_key(handle, key);
+    err = nvs_commit(handle);
+    nvs_close(handle);
+    return err;
+}
+
+esp_err_t scene_recall(uint8_t id, const latency_trace_t *trace) {
+    if (id >= SCENES_MAX) return ESP_ERR_INVALID_ARG;
+    scene_t scene;
+    portENTER_CRITICAL(&scenes_lock);
+    scene = scenes[id];
+    portEXIT_CRITICAL(&scenes_lock);
+    if (scene.count == 0) return ESP_ERR_NOT_FOUND;
+    return milight_sequence_play(scene.steps, scene.count, trace);
+}
+
+void scene_init(void) {
+    nvs_handle_t handle;
+    if (nvs_open(SCENE_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+    for (int id = 0; id < SCENES_MAX; id++) {
+        char key[NVS_KEY_NAME_MAX_SIZE];
+        scene_nvs_key(id, key);
+        scene_t *scene = &scenes[id];
+        size_t len = sizeof(*scene);
+        if (nvs_get_blob(handle, key, scene, &len) != ESP_OK ||
+            scene->count > SCENE_STEPS_MAX || len != SCENE_SIZE(scene->count)) {
+            memset(scene, 0, sizeof(*scene));
+        }
+    }
+    nvs_close(handle);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "frame.h"
+#include "latency.h"
+
+// Scenes
+// ======
+//
+// A scene switches a zone on (or off) and sets some of its sliders. It is
+// compiled once, when defined, into the steps to show the remote, kept in
+// NVS and in a RAM cache: recalling it only queues these steps on the key
+// schedulers, with no NVS access and a single message. A recall queues all
+// the steps or none, and is meant for idle buses, see milight_sequence_add().
+#define SCENES_MAX CONFIG_MILIGHT_SCENES
+
+typedef struct {
+    uint8_t zone;                   // 1 - 4, 0 for every zone
+    uint8_t on;                     // 0 switches the zone off, nothing else
+    int16_t slider[SLIDER_LENGTH];  // Position, -1 to leave the slider as is
+} scene_spec_t;
+
+// Load the scenes from NVS
+void scene_init(void);
+
+// Fail with ESP_ERR_INVALID_ARG for an id over SCENES_MAX - 1 or an
+// invalid spec, ESP_ERR_NOT_FOUND when recalling an undefined scene.
+esp_err_t scene_define(uint8_t id, const scene_spec_t *spec);
+esp_err_t scene_delete(uint8_t id);
+esp_err_t scene_recall(uint8_t id, const latency_trace_t *trace);
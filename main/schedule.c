@@ -0,0 +1,253 @@
+#include "schedule.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+// The minute logic is plain C, the task and the rules need the rest
+#ifdef CONFIG_MILIGHT_SCHEDULE
+// FreeRTOS includes
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+// ESP specific includes
+#include "esp_log.h"
+#include "esp_sntp.h"
+#include "nvs.h"
+
+// Other
+#include "frame.h"
+#include "latency.h"
+#include "queues.h"
+#include "scene.h"
+
+static const char *TAG = "SCHEDULE";
+#endif
+
+// The minute the device boots in only fires within this many seconds
+#define SCHEDULE_BOOT_SECONDS 5
+
+time_t schedule_minutes(time_t now, time_t *last) {
+    time_t minute = now / 60;
+    time_t first = *last + 1;
+    if (*last == 0) {
+        // After a boot, the current minute may have fired before: it only
+        // does if it just started
+        first = now % 60 < SCHEDULE_BOOT_SECONDS ? minute : minute + 1;
+    } else if (*last - minute > SCHEDULE_CATCHUP_MINUTES) {
+        // The clock went far back, resume with the next minute. A short
+        // step back waits for the clock to pass the last minute again.
+        first = minute + 1;
+        *last = minute;
+    } else if (minute - *last > SCHEDULE_CATCHUP_MINUTES) {
+        // Minutes missed because the clock stepped forward are caught up,
+        // unless it went far ahead
+        first = minute;
+    }
+    if (minute > *last) *last = minute;
+    return first;
+}
+
+#ifdef CONFIG_MILIGHT_SCHEDULE
+#define SCHEDULE_NVS_NAMESPACE "schedule"
+
+// Before SNTP sets the clock it starts at the epoch, rules wait for a time
+// after this one (2021-01-01)
+#define SCHEDULE_CLOCK_SET 1609459200
+
+#define NO_RULE (-1)
+
+// Rules with days 0 are not in use. Each slot of the wheel heads a list of
+// the rules hashed to it, chained through next[].
+static schedule_rule_t rules[SCHEDULE_RULES_MAX];
+static int8_t next[SCHEDULE_RULES_MAX];
+static int8_t wheel[SCHEDULE_WHEEL_SLOTS];
+static portMUX_TYPE rules_lock = portMUX_INITIALIZER_UNLOCKED;
+
+#define WHEEL_SLOT(minute) ((minute) % SCHEDULE_WHEEL_SLOTS)
+
+static bool schedule_valid(const schedule_rule_t *rule) {
+    uint8_t frame[I2C_SLAVE_FRAME_SIZE];
+    if (rule->minute >= SCHEDULE_MINUTES_PER_DAY || rule->days == 0 ||
+        rule->days > 0x7F) {
+        return false;
+    }
+    switch (rule->action) {
+        case SCHEDULE_KEY:
+            return rule->arg <= I2C_NUM_1 &&
+                   frame_encode_key(rule->arg, rule->arg2, frame) == ESP_OK;
+        case SCHEDULE_SLIDER:
+            return frame_slider_valid(rule->arg, rule->arg2);
+        case SCHEDULE_SCENE:
+            return rule->arg < SCENES_MAX;
+    }
+    return false;
+}
+
+// Both expect rules_lock to be held
+static void wheel_unlink(uint8_t id) {
+    if (rules[id].days == 0) return;
+    int8_t *link = &wheel[WHEEL_SLOT(rules[id].minute)];
+    while (*link != NO_RULE && *link != id) link = &next[*link];
+    if (*link == id) *link = next[id];
+    rules[id].days = 0;
+}
+
+static void wheel_link(uint8_t id, const schedule_rule_t *rule) {
+    wheel_unlink(id);
+    rules[id] = *rule;
+    int8_t *head = &wheel[WHEEL_SLOT(rule->minute)];
+    next[id] = *head;
+    *head = id;
+}
+
+static void schedule_nvs_key(uint8_t id, char *key) {
+    snprintf(key, NVS_KEY_NAME_MAX_SIZE, "r%u", id);
+}
+
+esp_err_t schedule_set(uint8_t id, const schedule_rule_t *rule) {
+    if (id >= SCHEDULE_RULES_MAX || !schedule_valid(rule)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(SCHEDULE_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) return err;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    schedule_nvs_key(id, key);
+    err = nvs_set_blob(handle, key, rule, sizeof(*rule));
+    if (err == ESP_OK) err = nvs_commit(handle);
+    nvs_close(handle);
+    if (err != ESP_OK) return err;
+
+    portENTER_CRITICAL(&rules_lock);
+    wheel_link(id, rule);
+    portEXIT_CRITICAL(&rules_lock);
+    ESP_LOGI(TAG, "Rule %u set at %02u:%02u", id, rule->minute / 60,
+             rule->minute % 60);
+    return ESP_OK;
+}
+
+esp_err_t schedule_delete(uint8_t id) {
+    if (id >= SCHEDULE_RULES_MAX) return ESP_ERR_INVALID_ARG;
+    portENTER_CRITICAL(&rules_lock);
+    wheel_unlink(id);
+    portEXIT_CRITICAL(&rules_lock);
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(SCHEDULE_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) return err;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    schedule_nvs_key(id, key);
+    nvs_erase_key(handle, key);
+    err = nvs_commit(handle);
+    nvs_close(handle);
+    return err;
+}
+
+static void schedule_load(void) {
+    for (int i = 0; i < SCHEDULE_WHEEL_SLOTS; i++) wheel[i] = NO_RULE;
+    nvs_handle_t handle;
+    if (nvs_open(SCHEDULE_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+    for (int id = 0; id < SCHEDULE_RULES_MAX; id++) {
+        char key[NVS_KEY_NAME_MAX_SIZE];
+        schedule_nvs_key(id, key);
+        schedule_rule_t rule;
+        size_t len = sizeof(rule);
+        if (nvs_get_blob(handle, key, &rule, &len) == ESP_OK &&
+            len == sizeof(rule) && schedule_valid(&rule)) {
+            wheel_link(id, &rule);
+        }
+    }
+    nvs_close(handle);
+}
+
+static void schedule_fire(uint8_t id, const schedule_rule_t *rule) {
+    ESP_LOGI(TAG, "Rule %u fired", id);
+    latency_trace_t trace = {0};
+    latency_mark(&trace, LATENCY_MQTT_RX);
+    if (rule->action == SCHEDULE_KEY) {
+        struct key_command cmd = {
+            .bus = rule->arg, .keycode = rule->arg2, .trace = trace};
+        if (xQueueSend(dispatcher_queues[QUEUE_KEY], &cmd,
+                       500 / portTICK_PERIOD_MS) != pdTRUE) {
+            ESP_LOGW(TAG, "Key queue is full, rule %u dropped", id);
+        }
+    } else if (rule->action == SCHEDULE_SLIDER) {
+        struct slider_command cmd = {
+            .slider = rule->arg, .value = rule->arg2, .trace = trace};
+        queues_post_slider(&cmd);
+    } else {
+        latency_mark(&trace, LATENCY_DISPATCHED);
+        esp_err_t err = scene_recall(rule->arg, &trace);
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "Rule %u cannot recall scene %u: %s", id,
+                     rule->arg, esp_err_to_name(err));
+        }
+    }
+}
+
+// Fires the rules of minute on wday (0 for Sunday). The slot is copied
+// under the lock, commands are sent without it.
+static void schedule_tick(int minute, int wday) {
+    uint8_t ids[SCHEDULE_RULES_MAX];
+    schedule_rule_t due[SCHEDULE_RULES_MAX];
+    int count = 0;
+    portENTER_CRITICAL(&rules_lock);
+    for (int8_t id = wheel[WHEEL_SLOT(minute)]; id != NO_RULE;
+         id = next[id]) {
+        if (rules[id].minute == minute && rules[id].days & (1 << wday)) {
+            ids[count] = id;
+            due[count++] = rules[id];
+        }
+    }
+    portEXIT_CRITICAL(&rules_lock);
+    for (int i = 0; i < count; i++) schedule_fire(ids[i], &due[i]);
+}
+
+#define SCHEDULE_STACK_SIZE 3072
+StaticTask_t schedule_buffer;
+StackType_t schedule_stack[SCHEDULE_STACK_SIZE];
+static void schedule_task(void *pvParameter) {
+    time_t last = 0;  // Last minute ticked, in minutes since the epoch
+    while (1) {
+        time_t now = time(NULL);
+        if (now < SCHEDULE_CLOCK_SET) {
+            vTaskDelay(1000 / portTICK_PERIOD_MS);
+            continue;
+        }
+        for (time_t m = schedule_minutes(now, &last); m <= now / 60; m++) {
+            time_t t = m * 60;
+            struct tm tm;
+            localtime_r(&t, &tm);
+            schedule_tick(tm.tm_hour * 60 + tm.tm_min, tm.tm_wday);
+        }
+
+        // Wake up just after the next minute starts
+        vTaskDelay(((60 - now % 60) * 1000 + 100) / portTICK_PERIOD_MS);
+    }
+}
+
+static void schedule_time_synced(struct timeval *tv) {
+    ESP_LOGI(TAG, "Clock set by SNTP");
+}
+
+void schedule_init(void) {
+    schedule_load();
+
+    setenv("TZ", CONFIG_MILIGHT_SCHEDULE_TZ, 1);
+    tzset();
+    sntp_setoperatingmode(SNTP_OPMODE_POLL);
+    sntp_setservername(0, CONFIG_MILIGHT_SNTP_SERVER);
+    sntp_set_time_sync_notification_cb(schedule_time_synced);
+    sntp_init();
+
+    xTaskCreateStatic(&schedule_task, "schedule", SCHEDULE_STACK_SIZE, NULL,
+                      tskIDLE_PRIORITY + 2, schedule_stack,
+                      &schedule_buffer);
+}
+#endif  // CONFIG_MILIGHT_SCHEDULE
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#include "esp_err.h"
+
+// On-device schedule
+// ==================
+//
+// Rules fire a command at a minute of the day, on some days of the week,
+// without any external controller: the clock is set by SNTP from
+// CONFIG_MILIGHT_SNTP_SERVER (see tools/sntp_server.py for a LAN stand-in)
+// and the rules are kept in NVS, cached in RAM. Keys and sliders go through
+// the dispatcher queues like MQTT commands, scenes are recalled directly,
+// so rules keep firing while the broker is unreachable.
+//
+// Rules are hashed by minute of the day on a timer wheel of
+// SCHEDULE_WHEEL_SLOTS slots. Every minute only the slot of that minute is
+// walked, whatever the number of rules. Minutes missed because the clock
+// stepped forward are caught up, up to SCHEDULE_CATCHUP_MINUTES; neither a
+// clock stepping back nor a reboot fires the current minute again.
+#define SCHEDULE_RULES_MAX CONFIG_MILIGHT_SCHEDULE_RULES
+#define SCHEDULE_WHEEL_SLOTS 64
+#define SCHEDULE_CATCHUP_MINUTES 5
+#define SCHEDULE_MINUTES_PER_DAY (24 * 60)
+
+enum schedule_action {
+    SCHEDULE_KEY,     // Press keycode arg2 on bus arg
+    SCHEDULE_SLIDER,  // Move slider arg (enum milight_slider) to arg2
+    SCHEDULE_SCENE,   // Recall scene arg
+};
+
+typedef struct {
+    uint16_t minute;  // Minute of the day, local time
+    uint8_t days;     // Bit 0 for Sunday to bit 6 for Saturday
+    uint8_t action;   // enum schedule_action
+    uint8_t arg;
+    uint8_t arg2;
+} schedule_rule_t;
+
+// Returns the first minute (since the epoch) to fire when the clock reads
+// now, the minutes up to *last having fired already (0 after a boot), and
+// moves *last on. Every minute from the first one to now / 60 fires, none
+// if the first one is later. *last only goes back when the clock stepped
+// back more than SCHEDULE_CATCHUP_MINUTES.
+time_t schedule_minutes(time_t now, time_t *last);
+
+#ifdef CONFIG_MILIGHT_SCHEDULE
+// Loads the rules from NVS and starts SNTP and the schedule task, the
+// TCP/IP stack must be up.
+void schedule_init(void);
+
+// Fail with ESP_ERR_INVALID_ARG for an id over SCHEDULE_RULES_MAX - 1 or an
+// invalid rule.
+esp_err_t schedule_set(uint8_t id, const schedule_rule_t *rule);
+esp_err_t schedule_delete(uint8_t id);
+#else
+static inline void schedule_init(void) {}
+#endif
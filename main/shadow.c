@@ -0,0 +1,246 @@
+#include "shadow.h"
+
+#include <stdio.h>
+
+// FreeRTOS includes
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
+
+// ESP specific includes
+#include "esp_timer.h"
+
+// Other
+#include "milight.h"
+#include "mqtt.h"
+#include "msg.h"
+
+#define SHADOW_MSG_SIZE 512
+
+// A steady stream of frames (a colour sweep) would hold the publication
+// back forever, so it is delayed by at most this many debounce periods.
+#define SHADOW_DEBOUNCE_MAX 8
+
+#define ZONE_UNKNOWN {.on = -1, .slider = {-1, -1, -1, -1}}
+static shadow_t state = {.zones = {ZONE_UNKNOWN, ZONE_UNKNOWN, ZONE_UNKNOWN,
+                                   ZONE_UNKNOWN}};
+static portMUX_TYPE state_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t publisher;
+
+// Zones the sliders of the remote act on
+static uint8_t selected_zones(const shadow_t *shadow) {
+    if (shadow->selected == 0) return (1 << SHADOW_ZONES) - 1;
+    return 1 << (shadow->selected - 1);
+}
+
+static void zone_set_on(shadow_zone_t *zone, int8_t on, bool *changed) {
+    if (zone->on != on) *changed = true;
+    zone->on = on;
+}
+
+// Applies cmd to shadow, returns the zones it acted on
+static uint8_t shadow_update(shadow_t *shadow, int i2c_bus,
+                             const frame_command_t *cmd, bool *changed) {
+    uint8_t zones = 0;
+    *changed = false;
+
+    if (cmd->kind == FRAME_SLIDER) {
+        zones = selected_zones(shadow);
+        for (int i = 0; i < SHADOW_ZONES; i++) {
+            if (!(zones & (1 << i))) continue;
+            int16_t *slider = &shadow->zones[i].slider[cmd->slider];
+            if (*slider != cmd->value) *changed = true;
+            *slider = cmd->value;
+        }
+        return zones;
+    }
+    if (cmd->kind != FRAME_KEY) return 0;
+
+    if (i2c_bus == I2C_NUM_0) {
+        zones = selected_zones(shadow);
+        if (cmd->keys & (GENERAL_ON | GENERAL_OFF)) {
+            zones = (1 << SHADOW_ZONES) - 1;
+            if (shadow->selected != 0) *changed = true;
+            shadow->selected = 0;
+        }
+        for (int i = 0; i < SHADOW_ZONES; i++) {
+            shadow_zone_t *zone = &shadow->zones[i];
+            if (!(zones & (1 << i))) continue;
+            if (cmd->keys & GENERAL_ON) zone_set_on(zone, 1, changed);
+            if (cmd->keys & GENERAL_OFF) zone_set_on(zone, 0, changed);
+            if (cmd->keys & VOLATILE_KEYS) {
+                zone->slider[SLIDER_WHEEL] = -1;
+                *changed = true;
+            }
+        }
+        return zones;
+    }
+
+    for (int i = 0; i < SHADOW_ZONES; i++) {
+        shadow_zone_t *zone = &shadow->zones[i];
+        uint8_t on, off;
+        frame_zone_key(i + 1, true, &on);
+        frame_zone_key(i + 1, false, &off);
+        if (cmd->keys & on) {
+            zone_set_on(zone, 1, changed);
+            if (shadow->selected != i + 1) *changed = true;
+            shadow->selected = i + 1;
+            zones |= 1 << i;
+        }
+        if (cmd->keys & off) {
+            zone_set_on(zone, 0, changed);
+            zones |= 1 << i;
+        }
+    }
+    return zones;
+}
+
+void shadow_apply(int i2c_bus, const uint8_t *frame) {
+    frame_command_t cmd;
+    if (!frame_decode(i2c_bus, frame, &cmd) || cmd.kind == FRAME_RELEASE) {
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+    bool changed;
+    portENTER_CRITICAL(&state_lock);
+    uint8_t zones = shadow_update(&state, i2c_bus, &cmd, &changed);
+    for (int i = 0; i < SHADOW_ZONES; i++) {
+        if (zones & (1 << i)) state.zones[i].updated_us = now;
+    }
+    portEXIT_CRITICAL(&state_lock);
+
+    if (changed && publisher != NULL) xTaskNotifyGive(publisher);
+}
+
+bool shadow_redundant(int i2c_bus, const uint8_t *frame) {
+#ifdef CONFIG_MILIGHT_SHADOW_DROP_REDUNDANT
+    frame_command_t cmd;
+    if (!frame_decode(i2c_bus, frame, &cmd) || cmd.kind == FRAME_RELEASE) {
+        return false;
+    }
+    if (i2c_bus == I2C_NUM_0 && cmd.kind == FRAME_KEY &&
+        (cmd.keys & VOLATILE_KEYS)) {
+        return false;
+    }
+
+    shadow_t next;
+    portENTER_CRITICAL(&state_lock);
+    next = state;
+    portEXIT_CRITICAL(&state_lock);
+
+    bool changed;
+    uint8_t zones = shadow_update(&next, i2c_bus, &cmd, &changed);
+    if (changed || zones == 0) return false;
+
+    // The lights may have been driven by something else in the meantime
+    int64_t oldest = esp_timer_get_time() -
+                     CONFIG_MILIGHT_SHADOW_TRUST_S * 1000000LL;
+    for (int i = 0; i < SHADOW_ZONES; i++) {
+        if ((zones & (1 << i)) && next.zones[i].updated_us < oldest) {
+            return false;
+        }
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool shadow_slider_redundant(enum milight_slider slider, uint8_t value) {
+    uint8_t frame[I2C_SLAVE_FRAME_SIZE];
+    int i2c_bus = frame_encode_slider(slider, value, frame);
+    return i2c_bus >= 0 && shadow_redundant(i2c_bus, frame);
+}
+
+int16_t shadow_slider_value(enum milight_slider slider) {
+    int16_t value = -1;
+    int64_t updated_us = 0;
+    portENTER_CRITICAL(&state_lock);
+    uint8_t zones = selected_zones(&state);
+    for (int i = 0; i < SHADOW_ZONES; i++) {
+        const shadow_zone_t *zone = &state.zones[i];
+        if (!(zones & (1 << i)) || zone->slider[slider] < 0) continue;
+        if (value < 0 || zone->updated_us > updated_us) {
+            value = zone->slider[slider];
+            updated_us = zone->updated_us;
+        }
+    }
+    portEXIT_CRITICAL(&state_lock);
+    return value;
+}
+
+void shadow_get(shadow_t *shadow) {
+    portENTER_CRITICAL(&state_lock);
+    *shadow = state;
+    portEXIT_CRITICAL(&state_lock);
+}
+
+static void shadow_publish(char *msg) {
+    shadow_t shadow;
+    shadow_get(&shadow);
+
+    int len = 0;
+    msg_append(msg, len, SHADOW_MSG_SIZE, "{\"selected\":%u,\"zones\":[",
+               shadow.selected);
+    for (int i = 0; i < SHADOW_ZONES; i++) {
+        const shadow_zone_t *zone = &shadow.zones[i];
+        if (zone->on < 0) {
+            msg_append(msg, len, SHADOW_MSG_SIZE, "%s{\"on\":null",
+                       i == 0 ? "" : ",");
+        } else {
+            msg_append(msg, len, SHADOW_MSG_SIZE, "%s{\"on\":%s",
+                       i == 0 ? "" : ",", zone->on ? "true" : "false");
+        }
+        for (int slider = 0; slider < SLIDER_LENGTH; slider++) {
+            if (zone->slider[slider] < 0) {
+                msg_append(msg, len, SHADOW_MSG_SIZE, ",\"%s\":null",
+                           frame_slider_names[slider]);
+            } else {
+                msg_append(msg, len, SHADOW_MSG_SIZE, ",\"%s\":%d",
+                           frame_slider_names[slider], zone->slider[slider]);
+            }
+        }
+        msg_append(msg, len, SHADOW_MSG_SIZE, "}");
+    }
+    msg_append(msg, len, SHADOW_MSG_SIZE, "]}");
+    if (len < SHADOW_MSG_SIZE) mqtt_publish(TOPIC_STATE, msg, len, 1, 1);
+}
+
+#define SHADOW_STACK_SIZE 2560
+StaticTask_t shadow_buffer;
+StackType_t shadow_stack[SHADOW_STACK_SIZE];
+static void shadow_task(void *pvParameter) {
+    static char msg[SHADOW_MSG_SIZE];
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        // Wait for the burst of frames to settle
+        for (int i = 0; i < SHADOW_DEBOUNCE_MAX; i++) {
+            if (ulTaskNotifyTake(
+                    pdTRUE, pdMS_TO_TICKS(CONFIG_MILIGHT_SHADOW_DEBOUNCE_MS)) ==
+                0) {
+                break;
+            }
+        }
+        xEventGroupWaitBits(mqtt_event_group, MQTT_CONNECTED_BIT, false, true,
+                            portMAX_DELAY);
+        shadow_publish(msg);
+    }
+}
+
+void shadow_init(void) {
+    publisher = xTaskCreateStatic(&shadow_task, "shadow", SHADOW_STACK_SIZE,
+                                  NULL, tskIDLE_PRIORITY + 1, shadow_stack,
+                                  &shadow_buffer);
+
+    // The remote runs before us, publish what it already did. An untouched
+    // shadow is not published, it would hide the retained state.
+    shadow_t shadow;
+    shadow_get(&shadow);
+    for (int i = 0; i < SHADOW_ZONES; i++) {
+        if (shadow.zones[i].updated_us != 0) {
+            xTaskNotifyGive(publisher);
+            break;
+        }
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "frame.h"
+
+#define TOPIC_STATE CONFIG_MQTT_PREFIX "/state"
+
+// Light state shadow
+// ==================
+//
+// What the lights were last told, per zone, rebuilt from the frames as the
+// key schedulers show them to the remote. Fields stay unknown (-1) until a
+// frame sets them. Every change is published, debounced, as a retained
+// JSON document on TOPIC_STATE.
+#define SHADOW_ZONES FRAME_ZONES
+
+typedef struct {
+    int8_t on;                       // 1 on, 0 off
+    int16_t slider[SLIDER_LENGTH];   // Position, indexed by milight_slider
+    int64_t updated_us;              // Last frame touching the zone
+} shadow_zone_t;
+
+typedef struct {
+    uint8_t selected;  // Zone the sliders act on, 1 - 4, 0 for all zones
+    shadow_zone_t zones[SHADOW_ZONES];
+} shadow_t;
+
+void shadow_init(void);
+
+// Records a frame shown to the remote on i2c_bus. Called by the key
+// schedulers, release frames and invalid frames are ignored.
+void shadow_apply(int i2c_bus, const uint8_t *frame);
+
+// True if showing frame on i2c_bus would not change the shadow of the
+// zones it acts on, and those were all updated recently enough to be
+// trusted. Mode and speed keys are never redundant. Only meaningful once
+// no key or step is pending, see milight_settled().
+bool shadow_redundant(int i2c_bus, const uint8_t *frame);
+bool shadow_slider_redundant(enum milight_slider slider, uint8_t value);
+
+// Last value of slider in the zones the sliders act on (the most recently
+// updated one if they differ), -1 if unknown.
+int16_t shadow_slider_value(enum milight_slider slider);
+
+void shadow_get(shadow_t *shadow);
@@ -0,0 +1,186 @@
+#include "telemetry.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// FreeRTOS includes
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
+
+// ESP specific includes
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_system.h"
+
+// Other
+#include "ack.h"
+#include "i2c_slave.h"
+#include "mqtt.h"
+#include "msg.h"
+#include "queues.h"
+
+static const char *TAG = "TELEMETRY";
+
+#define TOPIC_TELEMETRY_I2C CONFIG_MQTT_PREFIX "/telemetry/i2c"
+#define TOPIC_TELEMETRY_SYSTEM CONFIG_MQTT_PREFIX "/telemetry/system"
+#define TOPIC_TELEMETRY_ACK CONFIG_MQTT_PREFIX "/telemetry/ack"
+#define TELEMETRY_MSG_SIZE 2560
+// The application runs up to 13 tasks with every option enabled, on top of
+// about 11 ESP-IDF ones
+#define TELEMETRY_TASKS_MAX 40
+
+static const char *event_names[I2C_SLAVE_EVENT_LENGTH] = {
+    "err",     "arbit_lost", "nack",        "tout",
+    "end_det", "trans_done", "rxfifo_full", "txfifo_empty"};
+
+static void telemetry_publish_i2c(char *msg) {
+    int len = 0;
+    msg_append(msg, len, TELEMETRY_MSG_SIZE, "[");
+    for (int port = 0; port < I2C_NUM_MAX; port++) {
+        i2c_slave_stats_t stats;
+        i2c_slave_get_stats(port, &stats);
+
+        msg_append(msg, len, TELEMETRY_MSG_SIZE, "%s{\"port\":%d",
+                   port == 0 ? "" : ",", port);
+        for (int i = 0; i < I2C_SLAVE_EVENT_LENGTH; i++) {
+            msg_append(msg, len, TELEMETRY_MSG_SIZE, ",\"%s\":%u",
+                       event_names[i], stats.events[i]);
+        }
+        msg_append(msg, len, TELEMETRY_MSG_SIZE,
+                   ",\"stale\":%u,\"isr_cycles_max\":%u,\"isr_cycles\":[",
+                   stats.stale, stats.isr_cycles_max);
+        for (int i = 0; i < I2C_SLAVE_ISR_HIST_LENGTH; i++) {
+            msg_append(msg, len, TELEMETRY_MSG_SIZE, "%s%u", i == 0 ? "" : ",",
+                       stats.isr_cycles[i]);
+        }
+        msg_append(msg, len, TELEMETRY_MSG_SIZE,
+                   "],\"int_notified\":%u,\"int_delay_max_us\":%u,"
+                   "\"int_delay_us\":[",
+                   stats.int_notified, stats.int_delay_max_us);
+        for (int i = 0; i < I2C_SLAVE_ISR_HIST_LENGTH; i++) {
+            msg_append(msg, len, TELEMETRY_MSG_SIZE, "%s%u", i == 0 ? "" : ",",
+                       stats.int_delay_us[i]);
+        }
+        msg_append(msg, len, TELEMETRY_MSG_SIZE, "]}");
+    }
+    msg_append(msg, len, TELEMETRY_MSG_SIZE, "]");
+    if (len < TELEMETRY_MSG_SIZE) {
+        mqtt_publish(TOPIC_TELEMETRY_I2C, msg, len, 0, 0);
+    }
+}
+
+#ifdef CONFIG_MILIGHT_ACK
+static void telemetry_publish_ack(char *msg) {
+    ack_stats_t stats;
+    ack_get_stats(&stats);
+
+    int len = 0;
+    msg_append(msg, len, TELEMETRY_MSG_SIZE,
+               "{\"acked\":%u,\"retried\":%u,\"timeouts\":%u,\"dropped\":%u,"
+               "\"latency_max_us\":%u,\"latency_ms\":[",
+               stats.acked, stats.retried, stats.timeouts, stats.dropped,
+               stats.latency_max_us);
+    for (int i = 0; i < ACK_HIST_LENGTH; i++) {
+        msg_append(msg, len, TELEMETRY_MSG_SIZE, "%s%u", i == 0 ? "" : ",",
+                   stats.latency_ms[i]);
+    }
+    msg_append(msg, len, TELEMETRY_MSG_SIZE, "]}");
+    if (len < TELEMETRY_MSG_SIZE) {
+        mqtt_publish(TOPIC_TELEMETRY_ACK, msg, len, 0, 0);
+    }
+}
+#endif
+
+// Run time counters of the previous snapshot, to compute the CPU share of
+// each task over the last interval
+typedef struct {
+    UBaseType_t number;
+    uint32_t run_time;
+} task_run_time_t;
+
+static TaskStatus_t tasks[TELEMETRY_TASKS_MAX];
+static task_run_time_t last_run_time[TELEMETRY_TASKS_MAX];
+static UBaseType_t last_task_count;
+static uint32_t last_total_run_time;
+
+static uint32_t task_last_run_time(UBaseType_t number) {
+    for (UBaseType_t i = 0; i < last_task_count; i++) {
+        if (last_run_time[i].number == number) {
+            return last_run_time[i].run_time;
+        }
+    }
+    return 0;
+}
+
+// Heap figures, then for each task its CPU share since the last snapshot
+// (in permille of one core) and the lowest free space its stack ever had,
+// in bytes
+static void telemetry_publish_system(char *msg) {
+    uint32_t total_run_time = 0;
+    UBaseType_t count =
+        uxTaskGetSystemState(tasks, TELEMETRY_TASKS_MAX, &total_run_time);
+    if (count == 0) {
+        ESP_LOGW(TAG, "More than %d tasks, not reporting them (%u)",
+                 TELEMETRY_TASKS_MAX, uxTaskGetNumberOfTasks());
+    }
+    uint32_t elapsed = total_run_time - last_total_run_time;
+
+    int len = 0;
+    msg_append(msg, len, TELEMETRY_MSG_SIZE,
+               "{\"heap\":{\"free\":%u,\"min_free\":%u,\"largest\":%u},"
+               "\"coalesced\":[",
+               esp_get_free_heap_size(),
+               (uint32_t)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT),
+               (uint32_t)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+    for (int slider = 0; slider < SLIDER_LENGTH; slider++) {
+        msg_append(msg, len, TELEMETRY_MSG_SIZE, "%s%u",
+                   slider == 0 ? "" : ",", queues_slider_coalesced(slider));
+    }
+    msg_append(msg, len, TELEMETRY_MSG_SIZE, "],\"tasks\":[");
+    for (UBaseType_t i = 0; i < count; i++) {
+        uint32_t run_time = tasks[i].ulRunTimeCounter -
+                            task_last_run_time(tasks[i].xTaskNumber);
+        uint32_t cpu = elapsed > 0 ? (uint64_t)run_time * 1000 / elapsed : 0;
+        msg_append(msg, len, TELEMETRY_MSG_SIZE,
+                   "%s{\"name\":\"%s\",\"cpu\":%u,\"stack\":%u}",
+                   i == 0 ? "" : ",", tasks[i].pcTaskName, cpu,
+                   tasks[i].usStackHighWaterMark);
+    }
+    msg_append(msg, len, TELEMETRY_MSG_SIZE, "]}");
+    if (len < TELEMETRY_MSG_SIZE) {
+        mqtt_publish(TOPIC_TELEMETRY_SYSTEM, msg, len, 0, 0);
+    }
+
+    for (UBaseType_t i = 0; i < count; i++) {
+        last_run_time[i].number = tasks[i].xTaskNumber;
+        last_run_time[i].run_time = tasks[i].ulRunTimeCounter;
+    }
+    last_task_count = count;
+    last_total_run_time = total_run_time;
+}
+
+#define TELEMETRY_STACK_SIZE 3072
+StaticTask_t telemetry_buffer;
+StackType_t telemetry_stack[TELEMETRY_STACK_SIZE];
+static void telemetry_task(void *pvParameter) {
+    static char msg[TELEMETRY_MSG_SIZE];
+    TickType_t last_wake = xTaskGetTickCount();
+    while (1) {
+        vTaskDelayUntil(&last_wake,
+                        pdMS_TO_TICKS(CONFIG_MILIGHT_TELEMETRY_INTERVAL_MS));
+        xEventGroupWaitBits(mqtt_event_group, MQTT_CONNECTED_BIT, false, true,
+                            portMAX_DELAY);
+        telemetry_publish_i2c(msg);
+        telemetry_publish_system(msg);
+#ifdef CONFIG_MILIGHT_ACK
+        telemetry_publish_ack(msg);
+#endif
+    }
+}
+
+void telemetry_init(void) {
+    xTaskCreateStatic(&telemetry_task, "telemetry", TELEMETRY_STACK_SIZE,
+                      NULL, tskIDLE_PRIORITY + 1, telemetry_stack,
+                      &telemetry_buffer);
+}
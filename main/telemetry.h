@@ -0,0 +1,7 @@
+#pragma once
+
+// Starts the task publishing the I2C slave statistics, the heap usage, the
+// coalesced slider commands (by enum milight_slider) and the CPU and stack
+// usage of every task under CONFIG_MQTT_PREFIX "/telemetry", every
+// CONFIG_MILIGHT_TELEMETRY_INTERVAL_MS.
+void telemetry_init(void);
@@ -1,5 +1,6 @@
 #include "wifi.h"
 
+#include <stdio.h>
 #include <string.h>
 
 // FreeRTOS includes
@@ -10,8 +11,15 @@
 #include "esp_event_loop.h"
 #include "esp_log.h"
 #include "esp_smartconfig.h"
+#include "esp_system.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
 #include "esp_wpa2.h"
+#include "nvs.h"
+
+// Other
+#include "mqtt.h"
+#include "msg.h"
 
 // WiFi
 EventGroupHandle_t net_event_group;
@@ -82,10 +90,179 @@ static void sc_event_handler(void *arg, esp_event_base_t event_base,
     }
 }
 
+// Reconnection
+// ============
+//
+// The channel and BSSID of the last access point we got an IP from are
+// cached in NVS: the first attempt after boot or after losing the link
+// goes straight to it, without scanning. If it fails, the next attempts
+// scan every channel, spaced by an exponential backoff with jitter so that
+// a fleet does not hammer an access point coming back up all at once. The
+// DHCP lease is restored by lwIP itself (CONFIG_LWIP_DHCP_RESTORE_LAST_IP).
+#define WIFI_NVS_NAMESPACE "wifi"
+#define WIFI_ATTEMPTS_MAX 8
+#define TOPIC_WIFI CONFIG_MQTT_PREFIX "/wifi"
+
+typedef struct {
+    uint8_t channel;  // 0 when nothing is cached
+    uint8_t bssid[6];
+} wifi_cache_t;
+
+typedef struct {
+    int64_t start_us;
+    uint32_t duration_us;
+    bool fast;
+    uint8_t reason;  // wifi_err_reason_t, 0 if connected
+} wifi_attempt_t;
+
+static wifi_config_t wifi_config = {
+    .sta =
+        {
+            .ssid = CONFIG_DEFAULT_WIFI_ESSID,
+            .password = CONFIG_DEFAULT_WIFI_PASSWD,
+        },
+};
+static wifi_cache_t wifi_cache;
+
+// Attempts since the link was lost, the first ones are kept for the report
+static wifi_attempt_t attempts[WIFI_ATTEMPTS_MAX];
+static int attempt_count;
+static int64_t link_lost_us;
+static uint32_t time_to_ip_us;
+
+static esp_timer_handle_t reconnect_timer;
+
+static void wifi_cache_load(void) {
+    nvs_handle_t handle;
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+    size_t len = sizeof(wifi_cache);
+    if (nvs_get_blob(handle, "cache", &wifi_cache, &len) != ESP_OK ||
+        len != sizeof(wifi_cache)) {
+        memset(&wifi_cache, 0, sizeof(wifi_cache));
+    }
+    nvs_close(handle);
+}
+
+static void wifi_cache_save(const wifi_event_sta_connected_t *event) {
+    if (wifi_cache.channel == event->channel &&
+        memcmp(wifi_cache.bssid, event->bssid, sizeof(wifi_cache.bssid)) ==
+            0) {
+        return;
+    }
+    wifi_cache.channel = event->channel;
+    memcpy(wifi_cache.bssid, event->bssid, sizeof(wifi_cache.bssid));
+
+    nvs_handle_t handle;
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return;
+    }
+    nvs_set_blob(handle, "cache", &wifi_cache, sizeof(wifi_cache));
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+static void wifi_connect(void) {
+    // Only the first attempt after losing the link goes for the cache
+    bool fast = attempt_count == 0 && wifi_cache.channel != 0;
+    wifi_config_t config = wifi_config;
+    if (fast) {
+        config.sta.channel = wifi_cache.channel;
+        config.sta.bssid_set = true;
+        memcpy(config.sta.bssid, wifi_cache.bssid, sizeof(config.sta.bssid));
+    }
+    esp_wifi_set_config(WIFI_IF_STA, &config);
+
+    if (attempt_count < WIFI_ATTEMPTS_MAX) {
+        wifi_attempt_t *attempt = &attempts[attempt_count];
+        attempt->start_us = esp_timer_get_time();
+        attempt->duration_us = 0;
+        attempt->fast = fast;
+        attempt->reason = 0;
+    }
+    attempt_count++;
+    esp_wifi_connect();
+}
+
+static void wifi_reconnect_cb(void *arg) { wifi_connect(); }
+
+static void wifi_connect_later(uint32_t delay_ms) {
+    esp_timer_stop(reconnect_timer);
+    esp_timer_start_once(reconnect_timer, delay_ms * 1000ULL);
+}
+
+// A rebooted AP sees the whole fleet coming back: even the first attempts
+// are spread over up to CONFIG_WIFI_BACKOFF_MIN_MS
+static uint32_t wifi_jitter_ms(void) {
+    return esp_random() % (CONFIG_WIFI_BACKOFF_MIN_MS + 1);
+}
+
+static void wifi_attempt_done(uint8_t reason) {
+    if (attempt_count == 0 || attempt_count > WIFI_ATTEMPTS_MAX) return;
+    wifi_attempt_t *attempt = &attempts[attempt_count - 1];
+    attempt->duration_us = esp_timer_get_time() - attempt->start_us;
+    attempt->reason = reason;
+    ESP_LOGI("WIFI", "Attempt %d (%s) %s after %u ms", attempt_count,
+             attempt->fast ? "cached AP" : "scan",
+             reason == 0 ? "connected" : "failed",
+             attempt->duration_us / 1000);
+}
+
+static void wifi_retry(uint8_t reason) {
+    wifi_attempt_done(reason);
+    // A failed attempt on the cached AP is retried with a scan shortly
+    if (attempt_count == 1 && attempts[0].fast) {
+        wifi_connect_later(wifi_jitter_ms());
+        return;
+    }
+
+    int shift = attempt_count - 1 < 16 ? attempt_count - 1 : 16;
+    uint32_t backoff = (uint32_t)CONFIG_WIFI_BACKOFF_MIN_MS << shift;
+    if (backoff > CONFIG_WIFI_BACKOFF_MAX_MS) {
+        backoff = CONFIG_WIFI_BACKOFF_MAX_MS;
+    }
+    // Between half and all of the backoff
+    uint32_t delay_ms = backoff / 2 + esp_random() % (backoff / 2 + 1);
+    ESP_LOGI("WIFI", "Reconnecting in %u ms (reason %d)", delay_ms, reason);
+    wifi_connect_later(delay_ms);
+}
+
+void wifi_report(void) {
+    static char msg[512];
+    // Room is kept for the closing "]}", attempts that do not fit are left
+    // out
+    const int size = sizeof(msg) - 2;
+    int len = 0;
+    msg_append(msg, len, size,
+               "{\"time_to_ip_ms\":%u,\"attempt_count\":%d,\"attempts\":[",
+               time_to_ip_us / 1000, attempt_count);
+    for (int i = 0; i < attempt_count && i < WIFI_ATTEMPTS_MAX; i++) {
+        int entry = len;
+        msg_append(msg, len, size,
+                   "%s{\"fast\":%s,\"start_ms\":%u,\"ms\":%u,\"reason\":%d}",
+                   i == 0 ? "" : ",", attempts[i].fast ? "true" : "false",
+                   (uint32_t)(attempts[i].start_us - link_lost_us) / 1000,
+                   attempts[i].duration_us / 1000, attempts[i].reason);
+        if (len >= size) {
+            len = entry;
+            break;
+        }
+    }
+    if (len < size) {
+        msg[len++] = ']';
+        msg[len++] = '}';
+        mqtt_publish(TOPIC_WIFI, msg, len, 0, 1);
+    }
+}
+
 static void ip_event_handler(void *arg, esp_event_base_t event_base,
                              int32_t event_id, void *event_data) {
     switch (event_id) {
-        case SYSTEM_EVENT_STA_GOT_IP:
+        case IP_EVENT_STA_GOT_IP:
+            time_to_ip_us = esp_timer_get_time() - link_lost_us;
+            ESP_LOGI("WIFI", "Got IP %u ms after %d attempt(s)",
+                     time_to_ip_us / 1000, attempt_count);
             xEventGroupSetBits(net_event_group, WIFI_CONNECTED_BIT);
             break;
     }
@@ -96,16 +273,29 @@ static void ip_event_handler(void *arg, esp_event_base_t event_base,
 static void wifi_event_handler(void *arg, esp_event_base_t event_base,
                                int32_t event_id, void *event_data) {
     switch (event_id) {
-        case SYSTEM_EVENT_STA_START:
-            esp_wifi_connect();
+        case WIFI_EVENT_STA_START:
+            link_lost_us = esp_timer_get_time();
+            wifi_connect();
             // XXX Uncomment to reenable smartconfig
             // xTaskCreate(smartconfig_task, "smartconfig_task", 4096, NULL, 3,
             //            NULL);
             xEventGroupSetBits(net_event_group, WIFI_STARTED_BIT);
             break;
-        case SYSTEM_EVENT_STA_DISCONNECTED:
-            esp_wifi_connect();
-            xEventGroupClearBits(net_event_group, WIFI_CONNECTED_BIT);
+        case WIFI_EVENT_STA_CONNECTED:
+            wifi_attempt_done(0);
+            wifi_cache_save((wifi_event_sta_connected_t *)event_data);
+            break;
+        case WIFI_EVENT_STA_DISCONNECTED:
+            if (xEventGroupGetBits(net_event_group) & WIFI_CONNECTED_BIT) {
+                // Link lost, start over from the cached AP
+                link_lost_us = esp_timer_get_time();
+                attempt_count = 0;
+                xEventGroupClearBits(net_event_group, WIFI_CONNECTED_BIT);
+                wifi_connect_later(wifi_jitter_ms());
+            } else {
+                wifi_retry(
+                    ((wifi_event_sta_disconnected_t *)event_data)->reason);
+            }
             break;
         default:
             break;
@@ -131,14 +321,12 @@ void wifi_init(void) {
     ESP_ERROR_CHECK(esp_event_handler_register(SC_EVENT, ESP_EVENT_ANY_ID,
                                                &sc_event_handler, NULL));
 
+    const esp_timer_create_args_t reconnect_args = {
+        .callback = &wifi_reconnect_cb, .name = "wifi_reconnect"};
+    ESP_ERROR_CHECK(esp_timer_create(&reconnect_args, &reconnect_timer));
+    wifi_cache_load();
+
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    wifi_config_t wifi_config = {
-        .sta =
-            {
-                .ssid = CONFIG_DEFAULT_WIFI_ESSID,
-                .password = CONFIG_DEFAULT_WIFI_PASSWD,
-            },
-    };
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
     ESP_ERROR_CHECK(esp_wifi_start());
 }
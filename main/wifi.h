@@ -5,6 +5,10 @@
 
 void wifi_init(void);
 
+// Publishes the connection attempts since the link was last lost, and how
+// long it took to get an IP, on TOPIC_WIFI (retained)
+void wifi_report(void);
+
 extern EventGroupHandle_t net_event_group;
 #define WIFI_STARTED_BIT BIT0
 #define WIFI_CONNECTED_BIT BIT1
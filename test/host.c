@@ -0,0 +1,163 @@
+#include "host.h"
+
+#include <setjmp.h>
+#include <string.h>
+
+#include "esp_timer.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+// FreeRTOS
+// ========
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t length, UBaseType_t item_size,
+                                 uint8_t *storage, StaticQueue_t *queue) {
+    *queue = (StaticQueue_t){
+        .length = length, .item_size = item_size, .storage = storage};
+    return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item,
+                      TickType_t wait) {
+    if (queue->count == queue->length) return pdFALSE;
+    UBaseType_t tail = (queue->head + queue->count++) % queue->length;
+    memcpy(queue->storage + tail * queue->item_size, item, queue->item_size);
+    return pdTRUE;
+}
+
+BaseType_t xQueueOverwrite(QueueHandle_t queue, const void *item) {
+    queue->count = 0;
+    return xQueueSend(queue, item, 0);
+}
+
+BaseType_t xQueuePeek(QueueHandle_t queue, void *item, TickType_t wait) {
+    if (queue->count == 0) {
+        host_task_block(wait);
+        return pdFALSE;
+    }
+    memcpy(item, queue->storage + queue->head * queue->item_size,
+           queue->item_size);
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t wait) {
+    if (xQueuePeek(queue, item, wait) != pdTRUE) return pdFALSE;
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+    return queue->count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue) {
+    return queue->length - queue->count;
+}
+
+// Tasks are recorded, and only run from host_task_run(). A task about to
+// block on an empty queue is abandoned there, and starts over from the top
+// on the next run: fine for the consumer loops, which keep nothing in their
+// locals from one command to the next.
+#define HOST_TASKS_MAX 8
+
+static struct {
+    const char *name;
+    TaskFunction_t task;
+    void *arg;
+} tasks[HOST_TASKS_MAX];
+static int tasks_count;
+static jmp_buf *task_blocked;  // Set while a task runs
+
+TaskHandle_t xTaskCreateStatic(TaskFunction_t task, const char *name,
+                               uint32_t stack_depth, void *arg,
+                               UBaseType_t priority, StackType_t *stack,
+                               StaticTask_t *buffer) {
+    if (tasks_count < HOST_TASKS_MAX) {
+        tasks[tasks_count].name = name;
+        tasks[tasks_count].task = task;
+        tasks[tasks_count++].arg = arg;
+    }
+    return buffer;
+}
+
+void host_task_block(TickType_t wait) {
+    if (wait != 0 && task_blocked != NULL) longjmp(*task_blocked, 1);
+}
+
+void host_task_run(const char *name) {
+    for (int i = 0; i < tasks_count; i++) {
+        if (strcmp(tasks[i].name, name) != 0) continue;
+        jmp_buf blocked;
+        task_blocked = &blocked;
+        if (setjmp(blocked) == 0) tasks[i].task(tasks[i].arg);
+        task_blocked = NULL;
+        return;
+    }
+}
+
+void vTaskDelay(TickType_t ticks) {}
+
+// esp_timer
+// =========
+
+#define HOST_TIMERS_MAX 8
+
+struct esp_timer {
+    esp_timer_create_args_t args;
+    int64_t deadline_us;  // -1 when stopped
+    int64_t period_us;    // 0 for a one-shot timer
+};
+
+static struct esp_timer timers[HOST_TIMERS_MAX];
+static int timers_count;
+static int64_t now_us;
+
+int64_t esp_timer_get_time(void) { return now_us; }
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args,
+                           esp_timer_handle_t *handle) {
+    if (timers_count == HOST_TIMERS_MAX) return ESP_FAIL;
+    *handle = &timers[timers_count++];
+    (*handle)->args = *args;
+    (*handle)->deadline_us = -1;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+    timer->deadline_us = now_us + timeout_us;
+    timer->period_us = 0;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer,
+                                   uint64_t period_us) {
+    timer->deadline_us = now_us + period_us;
+    timer->period_us = period_us;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    timer->deadline_us = -1;
+    return ESP_OK;
+}
+
+void host_timer_run(int64_t until_us) {
+    while (1) {
+        struct esp_timer *next = NULL;
+        for (int i = 0; i < timers_count; i++) {
+            struct esp_timer *timer = &timers[i];
+            if (timer->deadline_us < 0 || timer->deadline_us > until_us) {
+                continue;
+            }
+            if (next == NULL || timer->deadline_us < next->deadline_us) {
+                next = timer;
+            }
+        }
+        if (next == NULL) break;
+        now_us = next->deadline_us;
+        next->deadline_us = next->period_us ? now_us + next->period_us : -1;
+        next->args.callback(next->args.arg);
+    }
+    if (until_us > now_us) now_us = until_us;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+
+// Host runtime of the stubs: FreeRTOS queues without blocking, and
+// esp_timer on a simulated clock. Everything runs on the test thread.
+
+// Moves the clock to until_us, firing the timers due on the way in order
+void host_timer_run(int64_t until_us);
+
+// Runs the task created with name until it would block on an empty queue
+void host_task_run(const char *name);
+
+// Called by the queues when they would block the caller for wait ticks
+void host_task_block(TickType_t wait);
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+#include "latency.h"
+#include "milight.h"
+#include "queues.h"
+#include "shadow.h"
+
+// Latency and throughput of the key path
+// ======================================
+//
+// Key commands are pushed on QUEUE_KEY as the MQTT task would, at random
+// times around an average rate (the same times on every run). They are
+// played by milight_command_task and the key schedulers on the simulated
+// clock, the task running as soon as a command is queued. An emulated
+// master reads each bus every BENCH_POLL_US, which closes the latency trace
+// of the frame it reads like the ISR does. The report is the one of the
+// device, see latency.c. Usage:
+//   latency_bench <commands per second>
+// where 0 sends as fast as QUEUE_KEY takes them: the key schedulers then
+// run at their maximum rate, and drop what they have no room for.
+#define BENCH_SECONDS (CONFIG_MILIGHT_LATENCY_REPORT_INTERVAL_MS / 1000)
+#define BENCH_STEP_US 100
+#ifndef BENCH_POLL_US
+#define BENCH_POLL_US 2000
+#endif
+
+// Hardware and shadow stand-ins. Every key changes the state, none is
+// dropped as redundant.
+static uint32_t published_keys;
+
+void i2c_slave_set_frame(i2c_port_t i2c_num, const uint8_t *frame) {
+    if (memcmp(frame, frame_release, I2C_SLAVE_FRAME_SIZE) != 0) {
+        published_keys++;
+    }
+}
+esp_err_t i2c_slave_param_config(i2c_port_t i2c_num,
+                                 const i2c_config_t *config) {
+    return ESP_OK;
+}
+esp_err_t i2c_slave_driver_install(i2c_port_t i2c_num) { return ESP_OK; }
+void i2c_slave_set_int_pin(i2c_port_t i2c_num, gpio_num_t gpio_num) {}
+esp_err_t gpio_config(const gpio_config_t *config) { return ESP_OK; }
+void shadow_apply(int i2c_bus, const uint8_t *frame) {}
+bool shadow_redundant(int i2c_bus, const uint8_t *frame) { return false; }
+
+// The master reads a frame, the ISR refills the TX FIFO
+static void master_poll(void *arg) {
+    latency_fifo_written((i2c_port_t)(intptr_t)arg);
+}
+
+// Commands alternate between the buses
+static const struct key_command commands[] = {
+    {.bus = I2C_NUM_0, .keycode = GENERAL_ON},
+    {.bus = I2C_NUM_1, .keycode = ZONE_01_ON},
+    {.bus = I2C_NUM_0, .keycode = GENERAL_OFF},
+    {.bus = I2C_NUM_1, .keycode = ZONE_01_OFF},
+};
+#define COMMANDS_LENGTH (sizeof(commands) / sizeof(commands[0]))
+
+// xorshift32, seeded the same on every run
+static uint32_t bench_random(void) {
+    static uint32_t state = 2463534242;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+int main(int argc, char **argv) {
+    int rate = argc > 1 ? atoi(argv[1]) : 0;
+    queues_init();
+    milight_init();
+    latency_init();
+
+    // The buses are read half a period apart
+    for (int i2c_num = 0; i2c_num < I2C_NUM_MAX; i2c_num++) {
+        const esp_timer_create_args_t args = {
+            .callback = &master_poll, .arg = (void *)(intptr_t)i2c_num};
+        esp_timer_handle_t timer;
+        ESP_ERROR_CHECK(esp_timer_create(&args, &timer));
+        host_timer_run(esp_timer_get_time() + BENCH_POLL_US / 2);
+        ESP_ERROR_CHECK(esp_timer_start_periodic(timer, BENCH_POLL_US));
+    }
+
+    uint32_t sent = 0;
+    uint32_t refused = 0;
+    int64_t start = esp_timer_get_time();
+    int64_t end = start + BENCH_SECONDS * 1000000LL;
+    int64_t next = start;
+    for (int64_t now = start; now < end; now += BENCH_STEP_US) {
+        host_timer_run(now);
+        if (now >= next) {
+            struct key_command cmd = commands[sent % COMMANDS_LENGTH];
+            latency_mark(&cmd.trace, LATENCY_MQTT_RX);
+            if (xQueueSend(dispatcher_queues[QUEUE_KEY], &cmd, 0) == pdTRUE) {
+                sent++;
+                // From half to one and a half times the average interval
+                if (rate > 0) {
+                    int interval = 1000000 / rate;
+                    next += interval / 2 + bench_random() % interval;
+                }
+            } else {
+                refused++;
+            }
+        }
+        host_task_run("milight_command");
+    }
+    // Up to the report
+    host_timer_run(end);
+
+    printf("%d s at %d cmd/s, master polling every %d us: %u sent, %u "
+           "refused by QUEUE_KEY, %u keys shown\n",
+           BENCH_SECONDS, rate, BENCH_POLL_US, sent, refused, published_keys);
+    return 0;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "driver/gpio.h"
+
+// Host stand-in for the ESP-IDF I2C port numbers and slave configuration
+typedef enum {
+    I2C_NUM_0,
+    I2C_NUM_1,
+    I2C_NUM_MAX,
+} i2c_port_t;
+
+typedef enum {
+    I2C_MODE_SLAVE,
+    I2C_MODE_MASTER,
+} i2c_mode_t;
+
+typedef struct {
+    i2c_mode_t mode;
+    int sda_io_num;
+    int scl_io_num;
+    int sda_pullup_en;
+    int scl_pullup_en;
+    struct {
+        uint8_t addr_10bit_en;
+        uint16_t slave_addr;
+    } slave;
+} i2c_config_t;
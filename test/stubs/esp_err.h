@@ -0,0 +1,13 @@
+#pragma once
+
+#include <assert.h>
+
+// Host stand-in for the ESP-IDF error codes used by the tested modules
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_TIMEOUT 0x107
+
+#define ESP_ERROR_CHECK(x) assert((x) == ESP_OK)
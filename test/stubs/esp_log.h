@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdio.h>
+
+// Logs are checked for their format, never printed, except for the info
+// ones with HOST_LOG_INFO
+#define ESP_LOG_NONE(tag, ...)      \
+    do {                            \
+        (void)(tag);                \
+        if (0) printf(__VA_ARGS__); \
+    } while (0)
+#define ESP_LOGE ESP_LOG_NONE
+#define ESP_LOGW ESP_LOG_NONE
+#ifdef HOST_LOG_INFO
+#define ESP_LOGI(tag, format, ...) \
+    printf("%s: " format "\n", tag, ##__VA_ARGS__)
+#else
+#define ESP_LOGI ESP_LOG_NONE
+#endif
+#define ESP_LOGD ESP_LOG_NONE
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+// Host stand-in for the ESP-IDF system calls, defined by the tests using
+// them
+typedef enum {
+    ESP_MAC_WIFI_STA,
+    ESP_MAC_WIFI_SOFTAP,
+    ESP_MAC_BT,
+    ESP_MAC_ETH,
+} esp_mac_type_t;
+
+uint32_t esp_random(void);
+esp_err_t esp_read_mac(uint8_t *mac, esp_mac_type_t type);
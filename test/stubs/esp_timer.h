@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+// Host stand-in for esp_timer, on a simulated clock that only moves with
+// host_timer_run(), see host.h
+typedef struct esp_timer *esp_timer_handle_t;
+typedef void (*esp_timer_cb_t)(void *arg);
+
+typedef struct {
+    esp_timer_cb_t callback;
+    void *arg;
+    const char *name;
+} esp_timer_create_args_t;
+
+int64_t esp_timer_get_time(void);
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args,
+                           esp_timer_handle_t *handle);
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us);
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer,
+                                   uint64_t period_us);
+esp_err_t esp_timer_stop(esp_timer_handle_t timer);
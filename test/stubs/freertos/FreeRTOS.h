@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+
+// Host stand-in for the FreeRTOS types, single threaded: nothing ever
+// blocks, see host.c
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef uint8_t StackType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define portMAX_DELAY 0xFFFFFFFF
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) (ms)
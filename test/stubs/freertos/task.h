@@ -0,0 +1,18 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+// Tasks only run when the host code asks for it, see host.h
+typedef struct {
+    int unused;
+} StaticTask_t;
+typedef StaticTask_t *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *arg);
+
+#define tskIDLE_PRIORITY 0
+
+TaskHandle_t xTaskCreateStatic(TaskFunction_t task, const char *name,
+                               uint32_t stack_depth, void *arg,
+                               UBaseType_t priority, StackType_t *stack,
+                               StaticTask_t *buffer);
+void vTaskDelay(TickType_t ticks);
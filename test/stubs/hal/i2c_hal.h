@@ -0,0 +1,13 @@
+#pragma once
+
+// Host stand-in for the I2C interrupt events
+typedef enum {
+    I2C_INTR_EVENT_ERR,
+    I2C_INTR_EVENT_ARBIT_LOST,
+    I2C_INTR_EVENT_NACK,
+    I2C_INTR_EVENT_TOUT,
+    I2C_INTR_EVENT_END_DET,
+    I2C_INTR_EVENT_TRANS_DONE,
+    I2C_INTR_EVENT_RXFIFO_FULL,
+    I2C_INTR_EVENT_TXFIFO_EMPTY,
+} i2c_intr_event_t;
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdio.h>
+
+// Counts and reports failed checks, main() returns the count
+static int failures;
+
+#define CHECK(cond)                                                   \
+    do {                                                              \
+        if (!(cond)) {                                                \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                               \
+        }                                                             \
+    } while (0)
@@ -0,0 +1,134 @@
+#include <string.h>
+
+#include "frame.h"
+#include "test.h"
+
+static void test_sliders(void) {
+    for (int slider = 0; slider < SLIDER_LENGTH; slider++) {
+        for (int value = 0; value <= FRAME_SLIDER_MAX(slider); value++) {
+            uint8_t frame[I2C_SLAVE_FRAME_SIZE];
+            int bus = frame_encode_slider(slider, value, frame);
+            if (!frame_slider_valid(slider, value)) {
+                CHECK(bus == -1);
+                continue;
+            }
+            CHECK(bus == frame_slider_bus(slider));
+            CHECK(!frame_is_key(frame));
+
+            frame_command_t cmd;
+            CHECK(frame_decode(bus, frame, &cmd));
+            CHECK(cmd.kind == FRAME_SLIDER);
+            CHECK(cmd.slider == slider);
+            CHECK(cmd.value == value);
+            // Slider frames are only valid on their bus
+            CHECK(!frame_decode(bus == I2C_NUM_0 ? I2C_NUM_1 : I2C_NUM_0,
+                                frame, &cmd));
+        }
+    }
+}
+
+// The remote never sends the bytes between the two ends of the
+// temperature slider
+static void test_temperature_gap(void) {
+    for (int value = 0x00; value <= 0xFF; value++) {
+        bool gap = value >= 0x9A && value <= 0x9F;
+        CHECK(frame_slider_valid(SLIDER_TEMPERATURE, value) == !gap);
+        uint8_t frame[I2C_SLAVE_FRAME_SIZE] = {0x06, 0x00, 0x00, 0x00, value};
+        frame_command_t cmd;
+        CHECK(frame_decode(I2C_NUM_0, frame, &cmd) == !gap);
+    }
+    uint8_t frame[I2C_SLAVE_FRAME_SIZE];
+    CHECK(frame_encode_slider(SLIDER_TEMPERATURE, 0x99, frame) == I2C_NUM_0);
+    CHECK(frame_encode_slider(SLIDER_TEMPERATURE, 0x9A, frame) == -1);
+    CHECK(frame_encode_slider(SLIDER_TEMPERATURE, 0x9F, frame) == -1);
+    CHECK(frame_encode_slider(SLIDER_TEMPERATURE, 0xA0, frame) == I2C_NUM_0);
+    CHECK(!frame_slider_valid(SLIDER_LUMINOSITY, 0x80));
+    CHECK(!frame_slider_valid(SLIDER_LENGTH, 0x00));
+}
+
+static void test_keys(void) {
+    const uint8_t bus_keys[I2C_NUM_MAX] = {
+        GENERAL_ON | GENERAL_OFF | SPEED_MINUS | MODE | SPEED_PLUS,
+        ZONE_01_OFF | ZONE_01_ON | ZONE_02_OFF | ZONE_02_ON | ZONE_03_OFF |
+            ZONE_03_ON | ZONE_04_OFF | ZONE_04_ON,
+    };
+    for (int bus = 0; bus < I2C_NUM_MAX; bus++) {
+        for (int keys = 0; keys <= 0xFF; keys++) {
+            uint8_t frame[I2C_SLAVE_FRAME_SIZE];
+            frame_command_t cmd;
+            if (keys & ~bus_keys[bus]) {
+                CHECK(frame_encode_key(bus, keys, frame) ==
+                      ESP_ERR_INVALID_ARG);
+                continue;
+            }
+            CHECK(frame_encode_key(bus, keys, frame) == ESP_OK);
+            CHECK(frame_is_key(frame));
+            CHECK(frame_decode(bus, frame, &cmd));
+            CHECK(cmd.kind == (keys == 0 ? FRAME_RELEASE : FRAME_KEY));
+            CHECK(cmd.keys == keys);
+        }
+    }
+    CHECK(memcmp(frame_release, (uint8_t[]){0x02, 0x00, 0x00, 0x00, 0x00},
+                 I2C_SLAVE_FRAME_SIZE) == 0);
+}
+
+// Bits 0 - 2 of bus 1 are not keys, frames pressing them are invalid
+static void test_keys_rejected(void) {
+    uint8_t frame[I2C_SLAVE_FRAME_SIZE];
+    frame_command_t cmd;
+    CHECK(frame_encode_key(I2C_NUM_0, ZONE_02_ON, frame) ==
+          ESP_ERR_INVALID_ARG);
+    CHECK(frame_encode_key(I2C_NUM_0, GENERAL_ON | 0x01, frame) ==
+          ESP_ERR_INVALID_ARG);
+
+    frame_encode_key(I2C_NUM_1, ZONE_02_ON, frame);
+    CHECK(!frame_decode(I2C_NUM_0, frame, &cmd));
+    // Trailing bytes must be clear
+    frame_encode_key(I2C_NUM_0, MODE, frame);
+    frame[4] = 0x01;
+    CHECK(!frame_decode(I2C_NUM_0, frame, &cmd));
+}
+
+static void test_zone_keys(void) {
+    uint8_t keycode;
+    CHECK(frame_zone_key(0, true, &keycode) == I2C_NUM_0);
+    CHECK(keycode == GENERAL_ON);
+    CHECK(frame_zone_key(0, false, &keycode) == I2C_NUM_0);
+    CHECK(keycode == GENERAL_OFF);
+    CHECK(frame_zone_key(3, true, &keycode) == I2C_NUM_1);
+    CHECK(keycode == ZONE_03_ON);
+    CHECK(frame_zone_key(FRAME_ZONES, false, &keycode) == I2C_NUM_1);
+    CHECK(keycode == ZONE_04_OFF);
+    CHECK(frame_zone_key(FRAME_ZONES + 1, true, &keycode) == -1);
+}
+
+static void test_hue(void) {
+    CHECK(frame_wheel_from_hue(0) == 0x3C);    // Red
+    CHECK(frame_wheel_from_hue(60) == 0x73);   // Yellow
+    CHECK(frame_wheel_from_hue(120) == 0xC3);  // Green
+    CHECK(frame_wheel_from_hue(240) == 0x00);  // Blue
+    CHECK(frame_wheel_from_hue(360) == 0x3C);
+
+    CHECK(frame_wheel_from_rgb(255, 0, 0) == 0x3C);
+    CHECK(frame_wheel_from_rgb(255, 255, 0) == 0x73);
+    CHECK(frame_wheel_from_rgb(0, 255, 0) == 0xC3);
+    CHECK(frame_wheel_from_rgb(0, 0, 255) == 0x00);
+}
+
+static void test_greys(void) {
+    for (int level = 0; level <= 0xFF; level++) {
+        CHECK(frame_wheel_from_rgb(level, level, level) == -1);
+    }
+}
+
+int main(void) {
+    test_sliders();
+    test_temperature_gap();
+    test_keys();
+    test_keys_rejected();
+    test_zone_keys();
+    test_hue();
+    test_greys();
+    printf("test_frame: %d failures\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,169 @@
+#include <string.h>
+
+#include "esp_system.h"
+#include "frame.h"
+#include "ibox.h"
+#include "test.h"
+
+// The bridge identity in the v6 replies
+static const uint8_t mac[6] = {0x24, 0x0A, 0xC4, 0x01, 0x02, 0x03};
+static uint32_t random_calls;
+
+uint32_t esp_random(void) {
+    random_calls++;
+    return 0x1234;
+}
+
+esp_err_t esp_read_mac(uint8_t *out, esp_mac_type_t type) {
+    memcpy(out, mac, sizeof(mac));
+    return ESP_OK;
+}
+
+static bool is_key(const ibox_command_t *cmd, int bus, uint8_t keys) {
+    return cmd->kind == IBOX_KEY && cmd->bus == bus && cmd->keys == keys;
+}
+
+static bool is_slider(const ibox_command_t *cmd, int slider, uint8_t value) {
+    return cmd->kind == IBOX_SLIDER && cmd->slider == slider &&
+           cmd->value == value;
+}
+
+static void test_v5(void) {
+    ibox_command_t cmds[IBOX_COMMANDS_MAX];
+
+    CHECK(ibox_decode_v5((uint8_t[]){0x42, 0x00, 0x55}, 3, cmds) == 1);
+    CHECK(is_key(&cmds[0], I2C_NUM_0, GENERAL_ON));
+    CHECK(ibox_decode_v5((uint8_t[]){0x41, 0x00}, 2, cmds) == 1);
+    CHECK(is_key(&cmds[0], I2C_NUM_0, GENERAL_OFF));
+    CHECK(ibox_decode_v5((uint8_t[]){0x47, 0x00, 0x55}, 3, cmds) == 1);
+    CHECK(is_key(&cmds[0], I2C_NUM_1, ZONE_02_ON));
+    CHECK(ibox_decode_v5((uint8_t[]){0x4C, 0x00, 0x55}, 3, cmds) == 1);
+    CHECK(is_key(&cmds[0], I2C_NUM_1, ZONE_04_OFF));
+    CHECK(ibox_decode_v5((uint8_t[]){0x4D, 0x00, 0x55}, 3, cmds) == 1);
+    CHECK(is_key(&cmds[0], I2C_NUM_0, MODE));
+
+    // Red is 0xB0 for the bridges
+    CHECK(ibox_decode_v5((uint8_t[]){0x40, 0xB0, 0x55}, 3, cmds) == 1);
+    CHECK(is_slider(&cmds[0], SLIDER_WHEEL, frame_wheel_from_hue(0)));
+    CHECK(ibox_decode_v5((uint8_t[]){0x4E, 0x1B, 0x55}, 3, cmds) == 1);
+    CHECK(is_slider(&cmds[0], SLIDER_LUMINOSITY, 0x7F));
+    CHECK(ibox_decode_v5((uint8_t[]){0x4E, 0x00, 0x55}, 3, cmds) == 1);
+    CHECK(is_slider(&cmds[0], SLIDER_LUMINOSITY, 0x00));
+
+    // White and night mode have no equivalent
+    CHECK(ibox_decode_v5((uint8_t[]){0xC2, 0x00, 0x55}, 3, cmds) == 0);
+    CHECK(ibox_decode_v5((uint8_t[]){0x42, 0x00, 0x00}, 3, cmds) == -1);
+    CHECK(ibox_decode_v5((uint8_t[]){0x42}, 1, cmds) == -1);
+    CHECK(ibox_decode_v5((uint8_t[]){0x42, 0x00, 0x55, 0x00}, 4, cmds) ==
+          -1);
+}
+
+// Builds a v6 RGBW command packet, its checksum being valid
+static void v6_packet(uint8_t *packet, uint8_t cmd, uint8_t arg,
+                      uint8_t zone) {
+    const uint8_t header[] = {0x80, 0x00, 0x00, 0x00, 0x11, 0x12,
+                              0x34, 0x00, 0x2A, 0x00};
+    const uint8_t body[] = {0x31, 0x00, 0x00, 0x07, cmd, arg,
+                            arg,  arg,  arg,  zone, 0x00};
+    memcpy(packet, header, sizeof(header));
+    memcpy(packet + sizeof(header), body, sizeof(body));
+    uint8_t checksum = 0;
+    for (size_t i = 0; i < sizeof(body); i++) checksum += body[i];
+    packet[21] = checksum;
+}
+
+static void test_v6(void) {
+    ibox_command_t cmds[IBOX_COMMANDS_MAX];
+    uint8_t packet[22];
+
+    // Colour and brightness select their zone first
+    v6_packet(packet, 0x01, 0xB0, 2);
+    CHECK(ibox_decode_v6(packet, sizeof(packet), cmds) == 2);
+    CHECK(is_key(&cmds[0], I2C_NUM_1, ZONE_02_ON));
+    CHECK(is_slider(&cmds[1], SLIDER_WHEEL, frame_wheel_from_hue(0)));
+    v6_packet(packet, 0x02, 100, 0);
+    CHECK(ibox_decode_v6(packet, sizeof(packet), cmds) == 2);
+    CHECK(is_key(&cmds[0], I2C_NUM_0, GENERAL_ON));
+    CHECK(is_slider(&cmds[1], SLIDER_LUMINOSITY, 0x7F));
+
+    v6_packet(packet, 0x03, 0x02, 0);
+    CHECK(ibox_decode_v6(packet, sizeof(packet), cmds) == 1);
+    CHECK(is_key(&cmds[0], I2C_NUM_0, GENERAL_OFF));
+    v6_packet(packet, 0x03, 0x01, 3);
+    CHECK(ibox_decode_v6(packet, sizeof(packet), cmds) == 1);
+    CHECK(is_key(&cmds[0], I2C_NUM_1, ZONE_03_ON));
+    v6_packet(packet, 0x03, 0x03, 1);
+    CHECK(ibox_decode_v6(packet, sizeof(packet), cmds) == 1);
+    CHECK(is_key(&cmds[0], I2C_NUM_0, SPEED_PLUS));
+    v6_packet(packet, 0x04, 0x01, 1);
+    CHECK(ibox_decode_v6(packet, sizeof(packet), cmds) == 1);
+    CHECK(is_key(&cmds[0], I2C_NUM_0, MODE));
+
+    // Valid packets with nothing to play
+    v6_packet(packet, 0x03, 0x01, 5);
+    CHECK(ibox_decode_v6(packet, sizeof(packet), cmds) == 0);
+    v6_packet(packet, 0x03, 0x01, 1);
+    packet[13] = 0x08;  // Not an RGBW bulb
+    packet[21] += 0x01;
+    CHECK(ibox_decode_v6(packet, sizeof(packet), cmds) == 0);
+
+    v6_packet(packet, 0x03, 0x01, 1);
+    packet[21]++;
+    CHECK(ibox_decode_v6(packet, sizeof(packet), cmds) == -1);
+    v6_packet(packet, 0x03, 0x01, 1);
+    CHECK(ibox_decode_v6(packet, sizeof(packet) - 1, cmds) == -1);
+    packet[0] = 0x20;
+    CHECK(ibox_decode_v6(packet, sizeof(packet), cmds) == -1);
+}
+
+static void test_v6_reply(void) {
+    uint8_t packet[IBOX_V6_REPLY_MAX];
+
+    // The handshake gets a session id, the same one every time
+    const uint8_t handshake[] = {0x20, 0x00, 0x00, 0x00, 0x16, 0x02,
+                                 0x62, 0x3A, 0xD5, 0xED, 0xA3, 0x01,
+                                 0xAE, 0x08, 0x2D, 0x46, 0x61, 0x41,
+                                 0xA7, 0xF6, 0xDC, 0xAF};
+    memcpy(packet, handshake, sizeof(handshake));
+    CHECK(ibox_reply_v6(packet, -1) == 22);
+    const uint8_t session[] = {0x28, 0x00, 0x00, 0x00, 0x11, 0x00, 0x02,
+                               0x24, 0x0A, 0xC4, 0x01, 0x02, 0x03, 0x69,
+                               0xF0, 0x3C, 0x23, 0x00, 0x01, 0x12, 0x35,
+                               0x00};
+    CHECK(memcmp(packet, session, sizeof(session)) == 0);
+    memcpy(packet, handshake, sizeof(handshake));
+    CHECK(ibox_reply_v6(packet, -1) == 22);
+    CHECK(memcmp(packet, session, sizeof(session)) == 0);
+    CHECK(random_calls == 1);
+
+    const uint8_t keepalive[] = {0xD0, 0x00, 0x00, 0x00, 0x02, 0x12, 0x35};
+    memcpy(packet, keepalive, sizeof(keepalive));
+    CHECK(ibox_reply_v6(packet, -1) == 12);
+    const uint8_t alive[] = {0xD8, 0x00, 0x00, 0x00, 0x07, 0x24,
+                             0x0A, 0xC4, 0x01, 0x02, 0x03, 0x01};
+    CHECK(memcmp(packet, alive, sizeof(alive)) == 0);
+
+    // Commands are acked with their sequence number, even those with
+    // nothing to play, invalid ones are not
+    const uint8_t ack[] = {0x88, 0x00, 0x00, 0x00, 0x03, 0x00, 0x2A, 0x00};
+    v6_packet(packet, 0x03, 0x01, 1);
+    CHECK(ibox_reply_v6(packet, 1) == 8);
+    CHECK(memcmp(packet, ack, sizeof(ack)) == 0);
+    v6_packet(packet, 0x03, 0x01, 5);
+    packet[8] = 0xFF;
+    CHECK(ibox_reply_v6(packet, 0) == 8);
+    CHECK(packet[6] == 0xFF);
+    v6_packet(packet, 0x03, 0x01, 1);
+    CHECK(ibox_reply_v6(packet, -1) == 0);
+
+    packet[0] = 0x42;
+    CHECK(ibox_reply_v6(packet, -1) == 0);
+}
+
+int main(void) {
+    test_v5();
+    test_v6();
+    test_v6_reply();
+    printf("test_ibox: %d failures\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,106 @@
+#include <stdbool.h>
+
+#include "schedule.h"
+#include "test.h"
+
+// A Monday at 08:00 UTC, in minutes since the epoch
+#define MONDAY_8AM (1609718400 / 60 + 8 * 60)
+
+// The minutes schedule_task() fires when it wakes up with time() at now:
+// fired_count minutes from fired_first
+static time_t last;
+static time_t fired_first;
+static int fired_count;
+
+static void wake(time_t now) {
+    fired_first = schedule_minutes(now, &last);
+    fired_count = now / 60 >= fired_first ? now / 60 - fired_first + 1 : 0;
+}
+
+// Clock reading at second of minute
+static time_t at(time_t minute, int second) { return minute * 60 + second; }
+
+static bool fired(time_t first, int count) {
+    return fired_count == count && (count == 0 || fired_first == first);
+}
+
+// The minute the device boots in only fires if it just started
+static void test_boot(void) {
+    last = 0;
+    wake(at(MONDAY_8AM, 0));
+    CHECK(fired(MONDAY_8AM, 1));
+    last = 0;
+    wake(at(MONDAY_8AM, 30));
+    CHECK(fired(0, 0));
+    wake(at(MONDAY_8AM + 1, 0));
+    CHECK(fired(MONDAY_8AM + 1, 1));
+}
+
+static void test_steady(void) {
+    last = 0;
+    wake(at(MONDAY_8AM, 0));
+    for (int i = 1; i < 10; i++) {
+        wake(at(MONDAY_8AM + i, 0));
+        CHECK(fired(MONDAY_8AM + i, 1));
+    }
+    // Woken up early, nothing to do yet
+    wake(at(MONDAY_8AM + 9, 59));
+    CHECK(fired(0, 0));
+    CHECK(last == MONDAY_8AM + 9);
+}
+
+// A correction right after the wake-up takes the clock back to the
+// previous minute: neither minute fires again
+static void test_step_back(void) {
+    last = 0;
+    wake(at(MONDAY_8AM, 0));
+    wake(at(MONDAY_8AM, 0) - 1);
+    CHECK(fired(0, 0));
+    CHECK(last == MONDAY_8AM);
+    wake(at(MONDAY_8AM, 0));
+    CHECK(fired(0, 0));
+    wake(at(MONDAY_8AM + 1, 0));
+    CHECK(fired(MONDAY_8AM + 1, 1));
+
+    // Back a few minutes, the task waits for the clock to come back
+    wake(at(MONDAY_8AM - 2, 0));
+    CHECK(fired(0, 0));
+    wake(at(MONDAY_8AM - 1, 0));
+    CHECK(fired(0, 0));
+    wake(at(MONDAY_8AM + 1, 0));
+    CHECK(fired(0, 0));
+    wake(at(MONDAY_8AM + 2, 0));
+    CHECK(fired(MONDAY_8AM + 2, 1));
+}
+
+// Far back, the task goes on from the new time without the current minute
+static void test_step_far_back(void) {
+    last = 0;
+    wake(at(MONDAY_8AM, 0));
+    wake(at(MONDAY_8AM - 60, 30));
+    CHECK(fired(0, 0));
+    CHECK(last == MONDAY_8AM - 60);
+    wake(at(MONDAY_8AM - 59, 0));
+    CHECK(fired(MONDAY_8AM - 59, 1));
+}
+
+static void test_step_forward(void) {
+    last = 0;
+    wake(at(MONDAY_8AM, 0));
+    wake(at(MONDAY_8AM + SCHEDULE_CATCHUP_MINUTES, 0));
+    CHECK(fired(MONDAY_8AM + 1, SCHEDULE_CATCHUP_MINUTES));
+    // Far ahead, only the current minute fires
+    wake(at(MONDAY_8AM + 60, 0));
+    CHECK(fired(MONDAY_8AM + 60, 1));
+    CHECK(last == MONDAY_8AM + 60);
+}
+
+int main(void) {
+    test_boot();
+    test_steady();
+    test_step_back();
+    test_step_far_back();
+    test_step_forward();
+    printf("test_schedule: %d failures\n", failures);
+    return failures != 0;
+}
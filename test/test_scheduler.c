@@ -0,0 +1,176 @@
+#include <string.h>
+
+#include "host.h"
+#include "milight.h"
+#include "queues.h"
+#include "shadow.h"
+#include "test.h"
+
+// Frames published on each bus, as the remote would see them
+#define LOG_LENGTH 64
+
+typedef struct {
+    int64_t time_us;
+    uint8_t frame[I2C_SLAVE_FRAME_SIZE];
+} published_t;
+
+static published_t published[I2C_NUM_MAX][LOG_LENGTH];
+static int published_count[I2C_NUM_MAX];
+
+void i2c_slave_set_frame(i2c_port_t i2c_num, const uint8_t *frame) {
+    if (published_count[i2c_num] == LOG_LENGTH) return;
+    published_t *entry = &published[i2c_num][published_count[i2c_num]++];
+    entry->time_us = esp_timer_get_time();
+    memcpy(entry->frame, frame, I2C_SLAVE_FRAME_SIZE);
+}
+
+// Hardware and shadow stand-ins
+esp_err_t i2c_slave_param_config(i2c_port_t i2c_num,
+                                 const i2c_config_t *config) {
+    return ESP_OK;
+}
+esp_err_t i2c_slave_driver_install(i2c_port_t i2c_num) { return ESP_OK; }
+void i2c_slave_set_int_pin(i2c_port_t i2c_num, gpio_num_t gpio_num) {}
+esp_err_t gpio_config(const gpio_config_t *config) { return ESP_OK; }
+void shadow_apply(int i2c_bus, const uint8_t *frame) {}
+bool shadow_redundant(int i2c_bus, const uint8_t *frame) { return false; }
+
+// Plays whatever is queued, and starts the next test on a clean log
+static int64_t drain(void) {
+    host_timer_run(esp_timer_get_time() + 10000000);
+    memset(published_count, 0, sizeof(published_count));
+    return esp_timer_get_time();
+}
+
+static bool is_key(const published_t *entry, int bus, uint8_t keys) {
+    uint8_t frame[I2C_SLAVE_FRAME_SIZE];
+    frame_encode_key(bus, keys, frame);
+    return memcmp(entry->frame, frame, I2C_SLAVE_FRAME_SIZE) == 0;
+}
+
+// A click is the key for CLICK_HOLD_MS, then every key released for
+// CLICK_GAP_MS
+static void test_click(void) {
+    int64_t start = drain();
+    CHECK(send_key(I2C_NUM_0, GENERAL_ON) == ESP_OK);
+    CHECK(published_count[I2C_NUM_0] == 1);
+    CHECK(published[I2C_NUM_0][0].time_us == start);
+    CHECK(is_key(&published[I2C_NUM_0][0], I2C_NUM_0, GENERAL_ON));
+    CHECK(send_key(I2C_NUM_0, ZONE_02_ON) == ESP_ERR_INVALID_ARG);
+
+    host_timer_run(start + 100000);
+    CHECK(published_count[I2C_NUM_0] == 2);
+    CHECK(published[I2C_NUM_0][1].time_us == start + CLICK_HOLD_MS * 1000);
+    CHECK(is_key(&published[I2C_NUM_0][1], I2C_NUM_0, RELEASE_KEY));
+    CHECK(published_count[I2C_NUM_1] == 0);
+    CHECK(milight_settled());
+}
+
+// Clicks queued together are played back to back
+static void test_burst(void) {
+    const uint8_t keys[] = {ZONE_01_ON, ZONE_02_OFF, ZONE_03_ON};
+    int64_t start = drain();
+    for (int i = 0; i < 3; i++) {
+        CHECK(send_key(I2C_NUM_1, keys[i]) == ESP_OK);
+    }
+    CHECK(milight_queue_depth(I2C_NUM_1) == 2);
+    CHECK(!milight_settled());
+
+    host_timer_run(start + 100000);
+    CHECK(published_count[I2C_NUM_1] == 6);
+    for (int i = 0; i < 3; i++) {
+        const published_t *press = &published[I2C_NUM_1][2 * i];
+        const published_t *release = &published[I2C_NUM_1][2 * i + 1];
+        int64_t at = start + i * (CLICK_HOLD_MS + CLICK_GAP_MS) * 1000;
+        CHECK(press->time_us == at);
+        CHECK(is_key(press, I2C_NUM_1, keys[i]));
+        CHECK(release->time_us == at + CLICK_HOLD_MS * 1000);
+        CHECK(is_key(release, I2C_NUM_1, RELEASE_KEY));
+    }
+    CHECK(milight_settled());
+}
+
+// The first step is played right away, the queue holds the next ones
+static void test_queue_full(void) {
+    drain();
+    for (int i = 0; i < CONFIG_MILIGHT_KEY_QUEUE_LENGTH + 1; i++) {
+        CHECK(send_key(I2C_NUM_0, MODE) == ESP_OK);
+    }
+    CHECK(send_key(I2C_NUM_0, MODE) == ESP_ERR_TIMEOUT);
+    CHECK(milight_queue_depth(I2C_NUM_0) == CONFIG_MILIGHT_KEY_QUEUE_LENGTH);
+    drain();
+    CHECK(milight_settled());
+}
+
+// Steps on the other bus wait for the ones appended before them
+static void test_sequence_order(void) {
+    milight_sequence_step_t steps[4];
+    uint8_t count = 0;
+    uint32_t queued_ms[I2C_NUM_MAX] = {0, 0};
+    uint8_t frame[I2C_SLAVE_FRAME_SIZE];
+    frame_encode_key(I2C_NUM_1, ZONE_02_ON, frame);
+    milight_sequence_add(steps, &count, queued_ms, I2C_NUM_1, frame,
+                         CLICK_HOLD_MS);
+    int bus = frame_encode_slider(SLIDER_WHEEL, 0x42, frame);
+    CHECK(bus == I2C_NUM_0);
+    milight_sequence_add(steps, &count, queued_ms, bus, frame, 20);
+    CHECK(count == 3);
+
+    int64_t start = drain();
+    latency_trace_t trace = {0};
+    CHECK(milight_sequence_play(steps, count, &trace) == ESP_OK);
+    host_timer_run(start + 100000);
+
+    CHECK(published_count[I2C_NUM_1] == 2);
+    CHECK(is_key(&published[I2C_NUM_1][0], I2C_NUM_1, ZONE_02_ON));
+    // A wait on released keys, then the slider once the zone is selected
+    CHECK(published_count[I2C_NUM_0] == 3);
+    CHECK(is_key(&published[I2C_NUM_0][0], I2C_NUM_0, RELEASE_KEY));
+    CHECK(memcmp(published[I2C_NUM_0][1].frame, frame,
+                 I2C_SLAVE_FRAME_SIZE) == 0);
+    CHECK(published[I2C_NUM_0][1].time_us ==
+          start + (CLICK_HOLD_MS + CLICK_GAP_MS) * 1000);
+    CHECK(milight_settled());
+}
+
+// A sequence that does not fit is not queued at all
+static void test_sequence_full(void) {
+    milight_sequence_step_t steps[4];
+    uint8_t count = 0;
+    uint32_t queued_ms[I2C_NUM_MAX] = {0, 0};
+    uint8_t frame[I2C_SLAVE_FRAME_SIZE];
+    frame_encode_key(I2C_NUM_0, GENERAL_ON, frame);
+    milight_sequence_add(steps, &count, queued_ms, I2C_NUM_0, frame,
+                         CLICK_HOLD_MS);
+    frame_encode_key(I2C_NUM_1, ZONE_04_ON, frame);
+    milight_sequence_add(steps, &count, queued_ms, I2C_NUM_1, frame,
+                         CLICK_HOLD_MS);
+
+    drain();
+    for (int i = 0; i < CONFIG_MILIGHT_KEY_QUEUE_LENGTH + 1; i++) {
+        send_key(I2C_NUM_1, ZONE_01_OFF);
+    }
+    latency_trace_t trace = {0};
+    CHECK(milight_sequence_play(steps, count, &trace) == ESP_ERR_TIMEOUT);
+    CHECK(published_count[I2C_NUM_0] == 0);
+    CHECK(milight_queue_depth(I2C_NUM_0) == 0);
+
+    // The slots reserved on bus 0 were given back
+    drain();
+    CHECK(milight_settled());
+    CHECK(milight_sequence_play(steps, count, &trace) == ESP_OK);
+    CHECK(published_count[I2C_NUM_0] == 1);
+    drain();
+}
+
+int main(void) {
+    queues_init();
+    milight_init();
+    test_click();
+    test_burst();
+    test_queue_full();
+    test_sequence_order();
+    test_sequence_full();
+    printf("test_scheduler: %d failures\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,197 @@
+#!/usr/bin/env python3
+"""Dumps, decodes and replays the I2C capture of a device.
+
+    i2c_capture.py dump [--host localhost] <prefix> <capture.bin>
+    i2c_capture.py decode <capture.bin>
+    i2c_capture.py replay [--host localhost] [--port N] <prefix> <capture.bin>
+
+dump asks the device (built with MILIGHT_I2C_CAPTURE) for its capture and
+saves the records of both ports. decode prints them, with the frames the
+remote read decoded as in milight.c. replay sends the frames of a capture
+back to a device on <prefix>/raw/<port>, with their original timing, to
+reproduce what the remote saw. dump and replay require paho-mqtt.
+"""
+
+import argparse
+import struct
+import sys
+import threading
+import time
+
+MAGIC = b"MIC1"
+HEADER = struct.Struct("<4sBBBB")
+RECORD = struct.Struct("<IBBB5s")  # i2c_capture_record_t
+READ, WRITE = 0, 1
+
+# Keycodes of each bus, from milight.h
+KEYS = [
+    {0x08: "general_on", 0x10: "general_off", 0x20: "speed_minus",
+     0x40: "mode", 0x80: "speed_plus"},
+    {0x20: "zone_01_off", 0x10: "zone_01_on", 0x02: "zone_02_off",
+     0x01: "zone_02_on", 0x08: "zone_03_off", 0x04: "zone_03_on",
+     0x80: "zone_04_off", 0x40: "zone_04_on"},
+]
+
+
+def decode_frame(port, frame):
+    """Names a frame served to the remote, see send_key and send_slider."""
+    kind = frame[0]
+    if kind == 0x02:
+        if frame[2] == 0:
+            return "no touch"
+        return "key " + KEYS[port].get(frame[2], "0x%02x" % frame[2])
+    if kind == 0x03 and port == 0:
+        return "wheel %d" % frame[1]
+    if kind == 0x03 and port == 1:
+        if frame[1] & 0x80:
+            return "luminosity %d" % (frame[1] & 0x7F)
+        return "saturation %d" % frame[1]
+    if kind == 0x06:
+        return "temperature %d" % frame[4]
+    return "unknown"
+
+
+def load(path):
+    """Returns the records of a capture as (time_us, port, dir, data)."""
+    with open(path, "rb") as f:
+        data = f.read()
+    records = []
+    for offset in range(0, len(data), RECORD.size):
+        time_us, port, direction, length, payload = \
+            RECORD.unpack_from(data, offset)
+        records.append((time_us, port, direction, payload[:length]))
+    records.sort(key=lambda r: r[0])
+    return records
+
+
+def dump(args):
+    import paho.mqtt.client as mqtt
+
+    pages = {}
+    expected = {}
+    errors = []
+    done = threading.Event()
+
+    # Runs on the paho network thread: errors are handed over to the main
+    # thread, exiting here would only stop this thread
+    def on_message(client, userdata, msg):
+        if len(msg.payload) < HEADER.size:
+            errors.append("truncated capture page")
+            done.set()
+            return
+        magic, port, page, count, size = HEADER.unpack_from(msg.payload)
+        if magic != MAGIC or size != RECORD.size:
+            errors.append("unexpected capture format")
+            done.set()
+            return
+        pages[(port, page)] = msg.payload[HEADER.size:]
+        # An empty port still sends one page
+        expected[port] = max(count, 1)
+        received = [len([k for k in pages if k[0] == p]) for p in (0, 1)]
+        if all(p in expected and received[p] == expected[p] for p in (0, 1)):
+            done.set()
+
+    def on_connect(client, userdata, flags, rc):
+        client.subscribe(args.prefix + "/capture/data", qos=1)
+        client.publish(args.prefix + "/capture/dump", "", qos=1)
+
+    client = mqtt.Client()
+    client.on_connect = on_connect
+    client.on_message = on_message
+    client.connect(args.host, args.mqtt_port)
+    client.loop_start()
+    complete = done.wait(10)
+    client.loop_stop()
+    if errors:
+        sys.exit(errors[0])
+    if not complete:
+        sys.exit("capture incomplete")
+
+    with open(args.capture, "wb") as f:
+        for key in sorted(pages):
+            f.write(pages[key])
+    print("%s: %d records" % (args.capture,
+                             sum(map(len, pages.values())) // RECORD.size))
+
+
+def decode(args):
+    records = load(args.capture)
+    if not records:
+        return
+    start = records[0][0]
+    for time_us, port, direction, data in records:
+        line = "%10.3f ms  port %d  %s  %s" % (
+            (time_us - start) / 1000.0, port,
+            "read " if direction == READ else "write", data.hex())
+        if direction == READ:
+            line += "  " + decode_frame(port, data)
+        print(line)
+
+
+def replay(args):
+    import paho.mqtt.client as mqtt
+
+    # Only the changes of the frame served on each port matter
+    changes = []
+    last = {}
+    for time_us, port, direction, data in load(args.capture):
+        if direction != READ or args.port not in (None, port):
+            continue
+        if last.get(port) != data:
+            changes.append((time_us, port, data))
+            last[port] = data
+    if not changes:
+        return
+
+    client = mqtt.Client()
+    client.connect(args.host, args.mqtt_port)
+    client.loop_start()
+    start_us = changes[0][0]
+    start = time.monotonic()
+    for i, (time_us, port, data) in enumerate(changes):
+        # Hold each frame until the next change on the same port
+        hold_ms = 0
+        for next_us, next_port, _ in changes[i + 1:]:
+            if next_port == port:
+                hold_ms = min((next_us - time_us) // 1000, 0xFFFF)
+                break
+        delay = start + (time_us - start_us) / 1e6 - time.monotonic()
+        if delay > 0:
+            time.sleep(delay)
+        client.publish("%s/raw/%d" % (args.prefix, port),
+                       "%s,%d" % (data.hex(), hold_ms), qos=0)
+        print("%10.3f ms  port %d  %s" % ((time_us - start_us) / 1000.0,
+                                          port, decode_frame(port, data)))
+    client.loop_stop()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    p = commands.add_parser("dump")
+    p.add_argument("--host", default="localhost")
+    p.add_argument("--mqtt-port", type=int, default=1883)
+    p.add_argument("prefix")
+    p.add_argument("capture")
+    p.set_defaults(func=dump)
+
+    p = commands.add_parser("decode")
+    p.add_argument("capture")
+    p.set_defaults(func=decode)
+
+    p = commands.add_parser("replay")
+    p.add_argument("--host", default="localhost")
+    p.add_argument("--mqtt-port", type=int, default=1883)
+    p.add_argument("--port", type=int, choices=(0, 1),
+                   help="only replay this I2C port")
+    p.add_argument("prefix")
+    p.add_argument("capture")
+    p.set_defaults(func=replay)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == "__main__":
+    main()
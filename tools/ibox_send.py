@@ -0,0 +1,97 @@
+#!/usr/bin/env python3
+"""Sends Milight iBox UDP commands, as the apps do.
+
+    ibox_send.py [--host H] [--v5] [--zone Z] on|off|mode|speed_plus|
+                 speed_minus|color <0-255>|brightness <0-100>
+
+By default the v6 protocol is used: a session is opened with a handshake,
+then the command is sent and its acknowledgement awaited. --v5 sends the
+legacy 3 byte packet instead, which is not acknowledged. Colours use the
+bridge convention: red is 0xB0, the hue decreasing as the value grows.
+Point --host at the device built with MILIGHT_IBOX.
+"""
+
+import argparse
+import socket
+import sys
+import time
+
+V6_PORT = 5987
+V5_PORT = 8899
+
+HANDSHAKE = bytes.fromhex("20000000160262" "3ad5eda301ae082d466141a7f6dcaf"
+                          "d3e600001e")
+
+# RGBW bulb commands (type 0x07): command byte and argument
+V6_COMMANDS = {
+    "on": (0x03, 0x01),
+    "off": (0x03, 0x02),
+    "speed_plus": (0x03, 0x03),
+    "speed_minus": (0x03, 0x04),
+    "mode": (0x04, 0x01),
+    "color": (0x01, None),
+    "brightness": (0x02, None),
+}
+
+
+def v5_packet(command, zone, value):
+    if command == "on":
+        code = 0x42 if zone == 0 else 0x45 + 2 * (zone - 1)
+    elif command == "off":
+        code = 0x41 if zone == 0 else 0x46 + 2 * (zone - 1)
+    else:
+        code = {"mode": 0x4D, "speed_plus": 0x44, "speed_minus": 0x43,
+                "color": 0x40, "brightness": 0x4E}[command]
+    if command == "brightness":
+        value = 2 + value * 25 // 100
+    return bytes([code, value or 0, 0x55])
+
+
+def v6_packet(session, sequence, command, zone, value):
+    kind, argument = V6_COMMANDS[command]
+    if argument is None:
+        argument = value
+    # The colour is repeated over the 4 argument bytes
+    arguments = [argument] * 4 if command == "color" else [argument, 0, 0, 0]
+    body = bytes([0x31, 0x00, 0x00, 0x07, kind] + arguments + [zone, 0x00])
+    return (bytes([0x80, 0x00, 0x00, 0x00, 0x11]) + session +
+            bytes([0x00, sequence, 0x00]) + body +
+            bytes([sum(body) & 0xFF]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--v5", action="store_true")
+    parser.add_argument("--zone", type=int, default=0, choices=range(5))
+    parser.add_argument("command", choices=sorted(V6_COMMANDS))
+    parser.add_argument("value", type=int, nargs="?")
+    args = parser.parse_args()
+    if args.command in ("color", "brightness") and args.value is None:
+        parser.error("%s needs a value" % args.command)
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.settimeout(1)
+    if args.v5:
+        sock.sendto(v5_packet(args.command, args.zone, args.value),
+                    (args.host, V5_PORT))
+        return
+
+    sock.sendto(HANDSHAKE, (args.host, V6_PORT))
+    reply = sock.recv(64)
+    if len(reply) != 22 or reply[0] != 0x28:
+        sys.exit("unexpected handshake reply %s" % reply.hex())
+    session = reply[19:21]
+
+    sequence = int(time.time()) & 0xFF
+    start = time.monotonic()
+    sock.sendto(v6_packet(session, sequence, args.command, args.zone,
+                          args.value), (args.host, V6_PORT))
+    reply = sock.recv(64)
+    if len(reply) != 8 or reply[0] != 0x88 or reply[6] != sequence:
+        sys.exit("unexpected acknowledgement %s" % reply.hex())
+    print("acked in %.1f ms" % ((time.monotonic() - start) * 1000))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,33 @@
+#!/usr/bin/env python3
+"""Compresses a firmware image for OTA.
+
+The output is the "MLZ1" magic, the size of the raw image (32 bits, little
+endian) and the image as a zlib stream, which the OTA writer inflates while
+flashing it.
+"""
+
+import struct
+import sys
+import zlib
+
+MAGIC = b"MLZ1"
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit("usage: %s <image.bin> <image.mlz>" % sys.argv[0])
+
+    with open(sys.argv[1], "rb") as f:
+        image = f.read()
+    # The device inflates with a 32kB window, which is zlib's default
+    compressed = zlib.compress(image, 9)
+    with open(sys.argv[2], "wb") as f:
+        f.write(MAGIC + struct.pack("<I", len(image)) + compressed)
+
+    print("%s: %d -> %d bytes (%.0f%%)" %
+          (sys.argv[2], len(image), len(compressed) + 8,
+           100.0 * (len(compressed) + 8) / len(image)))
+
+
+if __name__ == "__main__":
+    main()
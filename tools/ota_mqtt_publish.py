@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+"""Pushes a firmware image to a device over MQTT.
+
+    ota_mqtt_publish.py [--host localhost] [--port 1883] [--window 8]
+                        <prefix> <image>
+
+prefix is the device CONFIG_MQTT_PREFIX, image a raw or compressed
+(ota_compress.py) firmware. The image is announced on <prefix>/firmware/begin
+and sent in chunks on <prefix>/firmware/chunk, each one starting with its
+sequence number and the CRC-32 of its data. The device acknowledges on
+<prefix>/ota/ack with the next chunk it expects, "seq", or asks for chunks
+to be sent again from a missing one with "seq,nack". It reports the result
+on <prefix>/ota/progress. --window must match the device
+CONFIG_OTA_MQTT_WINDOW. Requires paho-mqtt.
+"""
+
+import argparse
+import hashlib
+import json
+import struct
+import sys
+import threading
+import time
+import zlib
+
+import paho.mqtt.client as mqtt
+
+CHUNK_SIZE = 1024   # OTA_MQTT_CHUNK_SIZE
+RETRY_TIMEOUT = 2.0
+
+
+class Sender:
+    def __init__(self, client, prefix, image, window):
+        self.client = client
+        self.prefix = prefix
+        self.window = window
+        self.chunks = [image[i:i + CHUNK_SIZE]
+                       for i in range(0, len(image), CHUNK_SIZE)]
+        self.base = 0        # First chunk not acknowledged
+        self.next = 0        # Next chunk to send
+        self.started = False
+        self.result = None
+        self.last_ack = time.monotonic()
+        self.cond = threading.Condition()
+
+    def on_ack(self, seq, nack):
+        with self.cond:
+            if nack and self.next > seq:
+                # The device lost chunk seq, send again from there
+                self.next = seq
+            self.base = max(self.base, seq)
+            self.next = max(self.next, self.base)
+            self.started = True
+            self.last_ack = time.monotonic()
+            self.cond.notify()
+
+    def on_progress(self, progress):
+        with self.cond:
+            if progress.get("done"):
+                self.result = progress.get("result")
+                self.cond.notify()
+            else:
+                print("%(written)d/%(total)d bytes written, "
+                      "%(bytes_per_s)d B/s" % progress)
+
+    def send(self, seq):
+        data = self.chunks[seq]
+        payload = struct.pack("<II", seq, zlib.crc32(data)) + data
+        self.client.publish(self.prefix + "/firmware/chunk", payload, qos=1)
+
+    def run(self):
+        with self.cond:
+            while self.result is None:
+                if self.started and self.next < len(self.chunks) and \
+                        self.next < self.base + self.window:
+                    seq = self.next
+                    self.next += 1
+                    self.send(seq)
+                    continue
+                self.cond.wait(0.5)
+                if self.started and self.base < len(self.chunks) and \
+                        time.monotonic() - self.last_ack > RETRY_TIMEOUT:
+                    # Go back to the first chunk not acknowledged
+                    self.next = self.base
+                    self.last_ack = time.monotonic()
+        return self.result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--host", default="localhost")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--window", type=int, default=8,
+                        help="CONFIG_OTA_MQTT_WINDOW of the device")
+    parser.add_argument("prefix")
+    parser.add_argument("image")
+    args = parser.parse_args()
+
+    with open(args.image, "rb") as f:
+        image = f.read()
+
+    client = mqtt.Client()
+    sender = Sender(client, args.prefix, image, args.window)
+
+    def on_message(client, userdata, msg):
+        if msg.topic.endswith("/ota/ack"):
+            fields = msg.payload.decode().split(",")
+            sender.on_ack(int(fields[0]), fields[1:] == ["nack"])
+        else:
+            sender.on_progress(json.loads(msg.payload))
+
+    def on_connect(client, userdata, flags, rc):
+        client.subscribe(args.prefix + "/ota/ack", qos=1)
+        client.subscribe(args.prefix + "/ota/progress", qos=1)
+        announce = "%d,%s" % (len(image), hashlib.sha256(image).hexdigest())
+        client.publish(args.prefix + "/firmware/begin", announce, qos=1)
+
+    client.on_connect = on_connect
+    client.on_message = on_message
+    client.connect(args.host, args.port)
+    client.loop_start()
+
+    start = time.monotonic()
+    result = sender.run()
+    client.loop_stop()
+    print("%s: %d bytes in %.1fs" % (result, len(image),
+                                     time.monotonic() - start))
+    sys.exit(0 if result == "ESP_OK" else 1)
+
+
+if __name__ == "__main__":
+    main()
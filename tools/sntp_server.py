@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+"""Answers SNTP requests with the local clock, as a LAN time server.
+
+    sntp_server.py [--port P]
+
+For networks without Internet access: run it on any machine with a sane
+clock and set MILIGHT_SNTP_SERVER to its address, so that the on-device
+schedule (MILIGHT_SCHEDULE) fires on time. Binding port 123 usually needs
+root privileges.
+"""
+
+import argparse
+import socket
+import struct
+import time
+
+# Seconds from the NTP epoch (1900) to the Unix epoch (1970)
+NTP_DELTA = 2208988800
+
+
+def ntp_time(t):
+    seconds = int(t)
+    fraction = int((t - seconds) * (1 << 32))
+    return struct.pack("!II", seconds + NTP_DELTA, fraction)
+
+
+def reply(request, received):
+    # No leap second warning, version 4, server mode, stratum 1 with an
+    # "LOCL" reference. The originate timestamp echoes the client transmit
+    # one.
+    header = struct.pack("!BBbbII4s", 0 << 6 | 4 << 3 | 4, 1, 6, -20, 0, 0,
+                         b"LOCL")
+    now = time.time()
+    return (header + ntp_time(now) + request[40:48] + ntp_time(received) +
+            ntp_time(time.time()))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--port", type=int, default=123)
+    args = parser.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("", args.port))
+    while True:
+        request, client = sock.recvfrom(512)
+        received = time.time()
+        if len(request) < 48:
+            continue
+        sock.sendto(reply(request, received), client)
+        print("%s:%d" % client)
+
+
+if __name__ == "__main__":
+    main()